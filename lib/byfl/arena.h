@@ -0,0 +1,139 @@
+/*
+ * Helper library for computing bytes:flops ratios
+ * (slab-based arena allocator class definition)
+ *
+ * By Scott Pakin <pakin@lanl.gov>
+ */
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <new>
+#include <string.h>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+// Allocate objects of a single type from large slabs instead of
+// individually from the heap.  Freed objects are threaded onto an
+// intrusive free list and reused before any new slab is allocated.
+// Destroying the arena releases all of its slabs at once without
+// running the destructors of any objects still live.  An arena is not
+// thread-safe; callers must ensure that only one thread at a time uses
+// a given arena.
+template<class T, size_t slab_bytes = 1<<20>
+class SlabArena {
+private:
+  // Each slot holds either an object or a pointer to the next free slot.
+  union slot_t {
+    slot_t* next;
+    typename aligned_storage<sizeof(T), alignment_of<T>::value>::type storage;
+  };
+  static const size_t slots_per_slab =
+    sizeof(slot_t) >= slab_bytes ? 1 : slab_bytes/sizeof(slot_t);
+
+  vector<slot_t*> slabs;   // All slabs allocated so far
+  slot_t* free_list;       // Slots freed and not yet reused
+  size_t next_slot;        // Index of the first never-used slot in the newest slab
+
+public:
+  SlabArena() {
+    free_list = NULL;
+    next_slot = slots_per_slab;
+  }
+
+  ~SlabArena() {
+    clear();
+  }
+
+  // Return storage for a single object.
+  void* allocate() {
+    if (free_list != NULL) {
+      slot_t* slot = free_list;
+      free_list = slot->next;
+      return slot;
+    }
+    if (next_slot == slots_per_slab) {
+      slabs.push_back(new slot_t[slots_per_slab]);
+      next_slot = 0;
+    }
+    return &slabs.back()[next_slot++];
+  }
+
+  // Return an object's storage to the free list.
+  void deallocate(void* object) {
+    slot_t* slot = static_cast<slot_t*>(object);
+    slot->next = free_list;
+    free_list = slot;
+  }
+
+  // Allocate and construct an object.
+  template<class... Args>
+  T* create(Args&&... args) {
+    return new (allocate()) T(std::forward<Args>(args)...);
+  }
+
+  // Destruct and free an object.
+  void destroy(T* object) {
+    object->~T();
+    deallocate(object);
+  }
+
+  // Release every slab at once.  All objects allocated from the arena
+  // become invalid.
+  void clear() {
+    for (typename vector<slot_t*>::iterator slab_iter = slabs.begin();
+         slab_iter != slabs.end();
+         slab_iter++)
+      delete[] *slab_iter;
+    slabs.clear();
+    free_list = NULL;
+    next_slot = slots_per_slab;
+  }
+};
+
+// Copy variable-length strings into large slabs instead of
+// individually onto the heap.  Strings are never freed individually;
+// destroying the arena releases all of them at once.  As with
+// SlabArena, callers must ensure that only one thread at a time uses a
+// given arena.
+template<size_t slab_bytes = 1<<16>
+class StringArena {
+private:
+  vector<char*> slabs;     // All slabs allocated so far
+  char* next_byte;         // First unused byte in the newest slab
+  size_t bytes_left;       // Number of unused bytes in the newest slab
+
+public:
+  StringArena() {
+    next_byte = NULL;
+    bytes_left = 0;
+  }
+
+  ~StringArena() {
+    for (typename vector<char*>::iterator slab_iter = slabs.begin();
+         slab_iter != slabs.end();
+         slab_iter++)
+      delete[] *slab_iter;
+  }
+
+  // Return a copy of a string of a given length (not counting the
+  // terminating NUL).
+  const char* copy(const char* str, size_t len) {
+    if (len + 1 > bytes_left) {
+      size_t new_bytes = len + 1 > slab_bytes ? len + 1 : slab_bytes;
+      slabs.push_back(new char[new_bytes]);
+      next_byte = slabs.back();
+      bytes_left = new_bytes;
+    }
+    char* result = next_byte;
+    memcpy(result, str, len + 1);
+    next_byte += len + 1;
+    bytes_left -= len + 1;
+    return result;
+  }
+};
+
+#endif
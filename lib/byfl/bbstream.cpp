@@ -0,0 +1,130 @@
+/*
+ * Helper library for computing bytes:flops ratios
+ * (binary output of per-basic-block tallies)
+ *
+ * By Scott Pakin <pakin@lanl.gov>
+ */
+
+#include "byfl.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace bytesflops {}
+using namespace bytesflops;
+using namespace std;
+
+// A binary basic-block stream begins with an 8-byte magic string
+// followed by the number of columns, the name of each column, and the
+// output prefix.  Each record that follows is one varint per column.
+// Varints use the LEB128 encoding (7 bits per byte, least significant
+// first, high bit set on all but the last byte).  Strings are encoded
+// as a varint length followed by that many bytes.  Because each
+// record already holds the change in each counter since the previous
+// record, most values fit in one or two bytes.
+static const char bb_stream_magic[8] = {'B', 'Y', 'F', 'L', '_', 'B', 'B', '1'};
+
+// Buffer records and write them to a file in large chunks.
+static const size_t bb_buffer_bytes = 1<<20;   // Bytes to buffer before writing
+static const size_t max_varint_bytes = 10;     // Most bytes a single varint can need
+static char* bb_buffer = NULL;                 // Records not yet written
+static size_t bb_buffer_used = 0;              // Number of valid bytes in bb_buffer
+static int bb_fd = -1;                         // File descriptor to which to write records
+static string bb_filename;                     // Name of the above
+
+namespace bytesflops {
+
+// Write the entire buffer to the output file.
+static void flush_bb_buffer (void)
+{
+  const char* data = bb_buffer;
+  size_t bytes_left = bb_buffer_used;
+  while (bytes_left > 0) {
+    ssize_t bytes_written = write(bb_fd, data, bytes_left);
+    if (bytes_written < 0) {
+      if (errno == EINTR)
+        continue;
+      cerr << "Failed to write to " << bb_filename << " (" << strerror(errno) << ")\n";
+      exit(1);
+    }
+    data += bytes_written;
+    bytes_left -= bytes_written;
+  }
+  bb_buffer_used = 0;
+}
+
+// Append a varint to the buffer.  The caller must ensure that the
+// buffer has room for max_varint_bytes more bytes.
+static inline void append_varint (uint64_t value)
+{
+  char* next_byte = bb_buffer + bb_buffer_used;
+  while (value >= 0x80) {
+    *next_byte++ = char(value | 0x80);
+    value >>= 7;
+  }
+  *next_byte++ = char(value);
+  bb_buffer_used = next_byte - bb_buffer;
+}
+
+// Append a length-prefixed string to the buffer.
+static void append_string (const char* str)
+{
+  size_t len = strlen(str);
+  if (bb_buffer_used > bb_buffer_bytes - max_varint_bytes)
+    flush_bb_buffer();
+  append_varint(len);
+  for (size_t i = 0; i < len; i++) {
+    if (bb_buffer_used == bb_buffer_bytes)
+      flush_bb_buffer();
+    bb_buffer[bb_buffer_used++] = str[i];
+  }
+}
+
+// Create a binary basic-block stream and write its header.
+void bf_open_bb_stream (const char* filename,
+                        const char* const* column_names,
+                        size_t num_columns)
+{
+  bb_filename = filename;
+  bb_fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (bb_fd == -1) {
+    cerr << "Failed to create output file " << bb_filename
+         << " (" << strerror(errno) << ")\n";
+    exit(1);
+  }
+  bb_buffer = new char[bb_buffer_bytes];
+  memcpy(bb_buffer, bb_stream_magic, sizeof(bb_stream_magic));
+  bb_buffer_used = sizeof(bb_stream_magic);
+  append_varint(num_columns);
+  for (size_t i = 0; i < num_columns; i++)
+    append_string(column_names[i]);
+  append_string(bf_output_prefix.c_str());
+}
+
+// Append one record of counter values to the binary basic-block
+// stream.  The caller is responsible for serializing calls across
+// threads.
+void bf_write_bb_record (const uint64_t* values, size_t num_columns)
+{
+  if (bb_buffer_used > bb_buffer_bytes - num_columns*max_varint_bytes)
+    flush_bb_buffer();
+  for (size_t i = 0; i < num_columns; i++)
+    append_varint(values[i]);
+}
+
+// Write all buffered records and close the binary basic-block stream.
+void bf_close_bb_stream (void)
+{
+  if (bb_fd == -1)
+    return;
+  flush_bb_buffer();
+  if (close(bb_fd) == -1) {
+    cerr << "Failed to close " << bb_filename << " (" << strerror(errno) << ")\n";
+    exit(1);
+  }
+  bb_fd = -1;
+  delete[] bb_buffer;
+  bb_buffer = NULL;
+}
+
+} // namespace bytesflops
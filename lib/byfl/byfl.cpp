@@ -7,6 +7,7 @@
  */
 
 #include "byfl.h"
+#include "arena.h"
 
 namespace bytesflops {}
 using namespace bytesflops;
@@ -22,21 +23,76 @@ typedef enum {
 } bb_end_t;
 
 
-// Encapsulate of all of our counters into a single structure.
+// Define the number of scalar counters and the total number of
+// counters that every ByteFlopCounters maintains.
+const size_t NUM_SCALAR_COUNTERS = 8;
+const size_t NUM_CORE_COUNTERS = NUM_SCALAR_COUNTERS + BF_END_BB_NUM + BF_NUM_MEM_INTRIN;
+
+// Name each scalar counter in BYFL_BB output.
+static const char* const bb_column_names[NUM_SCALAR_COUNTERS] = {
+  "LD_bytes", "ST_bytes", "LD_ops", "ST_ops",
+  "Flops", "FP_bits", "Int_ops", "Int_op_bits"
+};
+
+// Encapsulate of all of our counters into a single structure.  The
+// counters that are always maintained are stored contiguously, scalars
+// first, so they can be processed with simple loops over core[].  The
+// per-type and instruction-mix counters are large, so they're
+// allocated only if -bf-types or -bf-inst-mix was specified.
 class ByteFlopCounters {
+private:
+  // Add one array of counters to another.
+  static inline void add_counters (uint64_t* __restrict__ sums,
+                                   const uint64_t* __restrict__ more,
+                                   size_t num_counters) {
+    for (size_t i = 0; i < num_counters; i++)
+      sums[i] += more[i];
+  }
+
+  // Copy one array of counters to another, or zero it if the source
+  // is NULL.
+  static inline void copy_counters (uint64_t* __restrict__ dest,
+                                    const uint64_t* __restrict__ source,
+                                    size_t num_counters) {
+    if (source == NULL)
+      memset(dest, 0, num_counters*sizeof(uint64_t));
+    else
+      memcpy(dest, source, num_counters*sizeof(uint64_t));
+  }
+
+  // Store the difference of two arrays of counters in a third.
+  static inline void subtract_counters (uint64_t* __restrict__ diffs,
+                                        const uint64_t* __restrict__ minuends,
+                                        const uint64_t* __restrict__ subtrahends,
+                                        size_t num_counters) {
+    for (size_t i = 0; i < num_counters; i++)
+      diffs[i] = minuends[i] - subtrahends[i];
+  }
+
+  // Allocate the optional counters (uninitialized) if they're needed.
+  void allocate_optional (void) {
+    mem_insts = bf_types ? new uint64_t[NUM_MEM_INSTS] : NULL;
+    inst_mix_histo = bf_tally_inst_mix ? new uint64_t[NUM_OPCODES] : NULL;
+  }
+
 public:
-  uint64_t mem_insts[NUM_MEM_INSTS];  // Number of memory instructions by type
-  uint64_t inst_mix_histo[NUM_OPCODES];   // Histogram of instruction mix
-  uint64_t terminators[BF_END_BB_NUM];    // Tally of basic-block terminator types
-  uint64_t mem_intrinsics[BF_NUM_MEM_INTRIN];  // Tallies of data movement performed by memory intrinsics
-  uint64_t loads;                     // Number of bytes loaded
-  uint64_t stores;                    // Number of bytes stored
-  uint64_t load_ins;                  // Number of load instructions executed
-  uint64_t store_ins;                 // Number of store instructions executed
-  uint64_t flops;                     // Number of floating-point operations performed
-  uint64_t fp_bits;                   // Number of bits consumed or produced by all FP operations
-  uint64_t ops;                       // Number of operations of any type performed
-  uint64_t op_bits;                   // Number of bits consumed or produced by any operation except loads/stores
+  union {
+    struct {
+      uint64_t loads;                 // Number of bytes loaded
+      uint64_t stores;                // Number of bytes stored
+      uint64_t load_ins;              // Number of load instructions executed
+      uint64_t store_ins;             // Number of store instructions executed
+      uint64_t flops;                 // Number of floating-point operations performed
+      uint64_t fp_bits;               // Number of bits consumed or produced by all FP operations
+      uint64_t ops;                   // Number of operations of any type performed
+      uint64_t op_bits;               // Number of bits consumed or produced by any operation except loads/stores
+      uint64_t terminators[BF_END_BB_NUM];    // Tally of basic-block terminator types
+      uint64_t mem_intrinsics[BF_NUM_MEM_INTRIN];  // Tallies of data movement performed by memory intrinsics
+    };
+    uint64_t core[NUM_CORE_COUNTERS];   // All of the above as a single array
+  };
+  uint64_t* mem_insts;        // Number of memory instructions by type (NULL without -bf-types)
+  uint64_t* inst_mix_histo;   // Histogram of instruction mix (NULL without -bf-inst-mix)
 
   // Initialize all of the counters.
   ByteFlopCounters (uint64_t* initial_mem_insts=NULL,
@@ -51,39 +107,13 @@ public:
                     uint64_t initial_fp_bits=0,
                     uint64_t initial_ops=0,
                     uint64_t initial_op_bits=0) {
-    // Initialize mem_insts only if -bf-types was specified.
-    if (bf_types) {
-      if (initial_mem_insts == NULL)
-        for (size_t i = 0; i < NUM_MEM_INSTS; i++)
-          mem_insts[i] = 0;
-      else
-        for (size_t i = 0; i < NUM_MEM_INSTS; i++)
-          mem_insts[i] = initial_mem_insts[i];
-    }
-
-    // Initialize inst_mix_histo only if -bf-inst-mix was specified.
-    if (bf_tally_inst_mix) {
-      if (initial_inst_mix_histo == NULL)
-        for (size_t i = 0; i < NUM_OPCODES; i++)
-          inst_mix_histo[i] = 0;
-      else
-        for(size_t i = 0; i < NUM_OPCODES; i++)
-          inst_mix_histo[i] = initial_inst_mix_histo[i];
-    }
-
-    // Unconditionally initialize everything else.
-    if (initial_terminators == NULL)
-      for (size_t i = 0; i < BF_END_BB_NUM; i++)
-        terminators[i] = 0;
-    else
-      for (size_t i = 0; i < BF_END_BB_NUM; i++)
-        terminators[i] = initial_terminators[i];
-    if (initial_mem_intrinsics == NULL)
-      for (size_t i = 0; i < BF_NUM_MEM_INTRIN; i++)
-        mem_intrinsics[i] = 0;
-    else
-      for (size_t i = 0; i < BF_NUM_MEM_INTRIN; i++)
-        mem_intrinsics[i] = initial_mem_intrinsics[i];
+    allocate_optional();
+    if (mem_insts != NULL)
+      copy_counters(mem_insts, initial_mem_insts, NUM_MEM_INSTS);
+    if (inst_mix_histo != NULL)
+      copy_counters(inst_mix_histo, initial_inst_mix_histo, NUM_OPCODES);
+    copy_counters(terminators, initial_terminators, BF_END_BB_NUM);
+    copy_counters(mem_intrinsics, initial_mem_intrinsics, BF_NUM_MEM_INTRIN);
     loads    = initial_loads;
     stores   = initial_stores;
     load_ins = initial_load_ins;
@@ -94,6 +124,26 @@ public:
     op_bits  = initial_op_bits;
   }
 
+  // Copy another set of counters.
+  ByteFlopCounters (const ByteFlopCounters& other) {
+    allocate_optional();
+    *this = other;
+  }
+
+  ByteFlopCounters& operator= (const ByteFlopCounters& other) {
+    copy_counters(core, other.core, NUM_CORE_COUNTERS);
+    if (mem_insts != NULL)
+      copy_counters(mem_insts, other.mem_insts, NUM_MEM_INSTS);
+    if (inst_mix_histo != NULL)
+      copy_counters(inst_mix_histo, other.inst_mix_histo, NUM_OPCODES);
+    return *this;
+  }
+
+  ~ByteFlopCounters() {
+    delete[] mem_insts;
+    delete[] inst_mix_histo;
+  }
+
   // Accumulate new values into our counters.
   void accumulate (uint64_t* more_mem_insts,
                    uint64_t* more_inst_mix_histo,
@@ -107,21 +157,12 @@ public:
                    uint64_t more_fp_bits,
                    uint64_t more_ops,
                    uint64_t more_op_bits) {
-    // Accumulate mem_insts only if -bf-types was specified.
-    if (bf_types)
-      for (size_t i = 0; i < NUM_MEM_INSTS; i++)
-        mem_insts[i] += more_mem_insts[i];
-
-    // Accumulate inst_mix_histo only if -bf-inst-mix was specified.
-    if (bf_tally_inst_mix)
-      for (size_t i = 0; i < NUM_OPCODES; i++)
-        inst_mix_histo[i] += more_inst_mix_histo[i];
-
-    // Unconditionally accumulate everything else.
-    for (size_t i = 0; i < BF_END_BB_NUM; i++)
-      terminators[i] += more_terminators[i];
-    for (size_t i = 0; i < BF_NUM_MEM_INTRIN; i++)
-      mem_intrinsics[i] += more_mem_intrinsics[i];
+    if (mem_insts != NULL)
+      add_counters(mem_insts, more_mem_insts, NUM_MEM_INSTS);
+    if (inst_mix_histo != NULL)
+      add_counters(inst_mix_histo, more_inst_mix_histo, NUM_OPCODES);
+    add_counters(terminators, more_terminators, BF_END_BB_NUM);
+    add_counters(mem_intrinsics, more_mem_intrinsics, BF_NUM_MEM_INTRIN);
     loads     += more_loads;
     stores    += more_stores;
     load_ins  += more_load_ins;
@@ -134,139 +175,49 @@ public:
 
   // Accumulate another counter's values into our counters.
   void accumulate (ByteFlopCounters* other) {
-    // Accumulate mem_insts only if -bf-types was specified.
-    if (bf_types)
-      for (size_t i = 0; i < NUM_MEM_INSTS; i++)
-        mem_insts[i] += other->mem_insts[i];
-
-    // Accumulate inst_mix_histo only if -bf-inst-mix was specified.
-    if (bf_tally_inst_mix)
-      for (size_t i = 0; i < NUM_OPCODES; i++)
-        inst_mix_histo[i] += other->inst_mix_histo[i];
-
-    // Unconditionally accumulate everything else.
-    for (size_t i = 0; i < BF_END_BB_NUM; i++)
-      terminators[i] += other->terminators[i];
-    for (size_t i = 0; i < BF_NUM_MEM_INTRIN; i++)
-      mem_intrinsics[i] += other->mem_intrinsics[i];
-    loads     += other->loads;
-    stores    += other->stores;
-    load_ins  += other->load_ins;
-    store_ins += other->store_ins;
-    flops     += other->flops;
-    fp_bits   += other->fp_bits;
-    ops       += other->ops;
-    op_bits   += other->op_bits;
+    if (mem_insts != NULL)
+      add_counters(mem_insts, other->mem_insts, NUM_MEM_INSTS);
+    if (inst_mix_histo != NULL)
+      add_counters(inst_mix_histo, other->inst_mix_histo, NUM_OPCODES);
+    add_counters(core, other->core, NUM_CORE_COUNTERS);
   }
 
-  // Return the difference of our counters and another set of counters.
-  ByteFlopCounters* difference (ByteFlopCounters* other) {
-    // Take the difference of mem_insts only if -bf-types was specified.
-    uint64_t delta_mem_insts[NUM_MEM_INSTS];
-    if (bf_types)
-      for (size_t i = 0; i < NUM_MEM_INSTS; i++)
-        delta_mem_insts[i] = mem_insts[i] - other->mem_insts[i];
-
-    // Take the difference of inst_mix_histo only if -bf-inst-mix was specified.
-    uint64_t delta_inst_mix_histo[NUM_OPCODES];
-    if (bf_tally_inst_mix)
-      for (size_t i = 0; i < NUM_OPCODES; i++)
-        delta_inst_mix_histo[i] = inst_mix_histo[i] - other->inst_mix_histo[i];
-
-    // Unconditionally take the difference of everything else.
-    uint64_t delta_terminators[BF_END_BB_NUM];
-    for (size_t i = 0; i < BF_END_BB_NUM; i++)
-      delta_terminators[i] = terminators[i] - other->terminators[i];
-    uint64_t delta_mem_intrinsics[BF_NUM_MEM_INTRIN];
-    for (size_t i = 0; i < BF_NUM_MEM_INTRIN; i++)
-      delta_mem_intrinsics[i] = mem_intrinsics[i] - other->mem_intrinsics[i];
-    ByteFlopCounters *byflc = new ByteFlopCounters(delta_mem_insts,
-                                                   delta_inst_mix_histo,
-                                                   delta_terminators,
-                                                   delta_mem_intrinsics,
-                                                   loads - other->loads,
-                                                   stores - other->stores,
-                                                   load_ins - other->load_ins,
-                                                   store_ins - other->store_ins,
-                                                   flops - other->flops,
-                                                   fp_bits - other->fp_bits,
-                                                   ops - other->ops,
-                                                   op_bits - other->op_bits);
-    return byflc;
+  // Store in deltas the difference between our scalar counters and a
+  // snapshot of earlier values, then update the snapshot.
+  void scalar_difference (uint64_t* snapshot, uint64_t* deltas) const {
+    subtract_counters(deltas, core, snapshot, NUM_SCALAR_COUNTERS);
+    copy_counters(snapshot, core, NUM_SCALAR_COUNTERS);
   }
 
   // Reset all of our counters to zero.
   void reset (void) {
-    // Reset mem_insts only if -bf-types was specified.
-    if (bf_types)
-      for (size_t i = 0; i < NUM_MEM_INSTS; i++)
-        mem_insts[i] = 0;
-
-    // Reset inst_mix_histo only if -bf-inst-mix was specified.
-    if (bf_tally_inst_mix)
-      for (size_t i = 0; i < NUM_OPCODES; i++)
-        inst_mix_histo[i] = 0;
-
-    // Unconditionally reset everything else.
-    for (size_t i = 0; i < BF_END_BB_NUM; i++)
-      terminators[i] = 0;
-    for (size_t i = 0; i < BF_NUM_MEM_INTRIN; i++)
-      mem_intrinsics[i] = 0;
-    loads     = 0;
-    stores    = 0;
-    load_ins  = 0;
-    store_ins = 0;
-    flops     = 0;
-    fp_bits   = 0;
-    ops       = 0;
-    op_bits   = 0;
+    if (mem_insts != NULL)
+      copy_counters(mem_insts, NULL, NUM_MEM_INSTS);
+    if (inst_mix_histo != NULL)
+      copy_counters(inst_mix_histo, NULL, NUM_OPCODES);
+    copy_counters(core, NULL, NUM_CORE_COUNTERS);
   }
 };
 
 // The following values get reset at the end of every basic block.
-uint64_t  bf_load_count       = 0;    // Tally of the number of bytes loaded
-uint64_t  bf_store_count      = 0;    // Tally of the number of bytes stored
-uint64_t* bf_mem_insts_count  = NULL; // Tally of memory instructions by type
-uint64_t* bf_inst_mix_histo   = NULL; // Tally of instruction mix (as histogram)
-uint64_t* bf_terminator_count = NULL; // Tally of terminators by type
-uint64_t* bf_mem_intrin_count = NULL; // Tally of memory intrinsic calls and data movement
-uint64_t  bf_load_ins_count   = 0;    // Tally of the number of load instructions performed
-uint64_t  bf_store_ins_count  = 0;    // Tally of the number of store instructions performed
-uint64_t  bf_flop_count       = 0;    // Tally of the number of FP operations performed
-uint64_t  bf_fp_bits_count    = 0;    // Tally of the number of bits used by all FP operations
-uint64_t  bf_op_count         = 0;    // Tally of the number of operations performed
-uint64_t  bf_op_bits_count    = 0;    // Tally of the number of bits used by all operations except loads/stores
-
-// The following values represent more persistent counter and other state.
-static uint64_t num_merged = 0;    // Number of basic blocks merged so far
-static ByteFlopCounters global_totals;  // Global tallies of all of our counters
-static ByteFlopCounters prev_global_totals;  // Previously reported global tallies of all of our counters
-
-// Keep track of counters on a per-function basis, being careful to
-// work around the "C++ static initialization order fiasco" (cf. the
-// C++ FAQ).
+// Each thread increments its own copy; the copies are merged only
+// when the program exits.
+__thread uint64_t  bf_load_count       = 0;    // Tally of the number of bytes loaded
+__thread uint64_t  bf_store_count      = 0;    // Tally of the number of bytes stored
+__thread uint64_t* bf_mem_insts_count  = NULL; // Tally of memory instructions by type
+__thread uint64_t* bf_inst_mix_histo   = NULL; // Tally of instruction mix (as histogram)
+__thread uint64_t* bf_terminator_count = NULL; // Tally of terminators by type
+__thread uint64_t* bf_mem_intrin_count = NULL; // Tally of memory intrinsic calls and data movement
+__thread uint64_t  bf_load_ins_count   = 0;    // Tally of the number of load instructions performed
+__thread uint64_t  bf_store_ins_count  = 0;    // Tally of the number of store instructions performed
+__thread uint64_t  bf_flop_count       = 0;    // Tally of the number of FP operations performed
+__thread uint64_t  bf_fp_bits_count    = 0;    // Tally of the number of bits used by all FP operations
+__thread uint64_t  bf_op_count         = 0;    // Tally of the number of operations performed
+__thread uint64_t  bf_op_bits_count    = 0;    // Tally of the number of bits used by all operations except loads/stores
+
 typedef CachedUnorderedMap<const char*, ByteFlopCounters*> str2bfc_t;
 typedef str2bfc_t::iterator counter_iterator;
-static str2bfc_t& per_func_totals()
-{
-  static str2bfc_t* mapping = new str2bfc_t();
-  return *mapping;
-}
 typedef CachedUnorderedMap<const char*, uint64_t> str2num_t;
-static str2num_t& func_call_tallies()
-{
-  static str2num_t* mapping = new str2num_t();
-  return *mapping;
-}
-
-// Keep track of counters on a user-defined basis, being careful to
-// work around the "C++ static initialization order fiasco" (cf. the
-// C++ FAQ).
-static str2bfc_t& user_defined_totals()
-{
-  static str2bfc_t* mapping = new str2bfc_t();
-  return *mapping;
-}
 
 // bf_categorize_counters() is intended to be overridden by a
 // user-defined function.
@@ -280,28 +231,23 @@ extern "C" {
 
 namespace bytesflops {
 
-const char* bf_func_and_parents; // Top of the complete_call_stack stack
 string bf_output_prefix;         // String to output before "BYFL" on every line
 ostream* bfout;                  // Stream to which to send standard output
+static bool bb_binary = false;   // true=write BYFL_BB data to a binary stream instead of to bfout
 
 
-// Define a stack of tallies of all of our counters across <=
-// num_merged basic blocks.  This *ought* to be a top-level variable
-// defintion, but because of the "C++ static initialization order
-// fiasco" (cf. the C++ FAQ) we have to use the following roundabout
-// approach.
-typedef vector<ByteFlopCounters*> counter_vector_t;
-static counter_vector_t& bb_totals (void)
-{
-  static counter_vector_t* bfc = new counter_vector_t();
-  return *bfc;
-}
-
 // Define a memory pool for ByteFlopCounters.
 class CounterMemoryPool {
 private:
   vector<ByteFlopCounters*> freelist;
 public:
+  ~CounterMemoryPool() {
+    for (vector<ByteFlopCounters*>::iterator bfc_iter = freelist.begin();
+         bfc_iter != freelist.end();
+         bfc_iter++)
+      delete *bfc_iter;
+  }
+
   // Allocate a new ByteFlopCounters -- from the free list if possible.
   ByteFlopCounters* allocate(void) {
     ByteFlopCounters* newBFC;
@@ -320,66 +266,388 @@ public:
     freelist.push_back(oldBFC);
   }
 };
-static CounterMemoryPool* counter_memory_pool = NULL;
 
-// Maintain a function call stack.
+// Represent a node in a calling-context tree: a function plus the
+// chain of calls that led to it.
+struct CallContext {
+  uint32_t funcid;             // ID of the function called in this context
+  CallContext* parent;         // Context of the caller (NULL for the root)
+  size_t depth;                // Number of functions on the call stack
+  const char* name;            // Function and ancestor names (NULL=not yet constructed)
+  ByteFlopCounters* counters;  // Tallies for this context (NULL=none yet)
+  uint64_t calls;              // Number of times this context was entered
+
+  CallContext(uint32_t id, CallContext* caller) {
+    funcid = id;
+    parent = caller;
+    depth = caller == NULL ? 0 : caller->depth + 1;
+    name = NULL;
+    counters = NULL;
+    calls = 0;
+  }
+};
+
+// Maintain a function call stack as a path through a calling-context
+// tree.  Pushing a function moves to a child of the current context
+// (creating it if necessary), and popping a function moves back to
+// the previous context.  A context's name (the function followed by
+// all of its ancestors) is constructed only when first requested.
+//
+// With bf_collapse_recursion, pushing a function already in the
+// current context moves to the existing context for that function.
+// With bf_max_call_depth, a function pushed at the maximum depth
+// becomes a child of the context one level shallower than the
+// maximum.  Either way, the tree's size no longer grows with the
+// depth of recursion.
 class CallStack {
 private:
-  vector<const char*> complete_call_stack;  // Stack of function and ancestor names
+  typedef pair<CallContext*, uint32_t> child_key_t;  // {Parent context, function ID}
+
+  // Hash a {parent, function ID} pair.
+  struct child_key_hash {
+    size_t operator()(const child_key_t& key) const {
+      return (uintptr_t)key.first + key.second*0x9e3779b97f4a7c15ULL;
+    }
+  };
+
+  typedef FlatHashMap<child_key_t, CallContext*, child_key_hash> child_map_t;
+  child_map_t children;              // Map from a {parent, function ID} pair to a child context
+  SlabArena<CallContext> contexts;   // Storage for all contexts except the root
+  CallContext root;                  // Context before any function is pushed
+  CallContext* current;              // Context at the top of the call stack
+  vector<CallContext*> callers;      // Contexts to return to on each pop
+
 public:
-  size_t max_depth;   // Maximum depth achieved by complete_call_stack
+  size_t max_depth;   // Maximum depth of any context
 
-  CallStack() {
-    bf_func_and_parents = "-";
+  CallStack() : root(0, NULL) {
+    root.name = "-";
+    current = &root;
     max_depth = 0;
   }
 
-  // Push a function name onto the stack.  Return a string containing
-  // the name of the function followed by the names of all of its
-  // ancestors.
-  const char* push_function (const char* funcname) {
-    // Push both the current function name and the combined name of the
-    // function and its call stack.
-    static char* combined_name = NULL;
-    static size_t len_combined_name = 0;
-    const char* unique_combined_name;      // Interned version of combined_name
-    size_t current_stack_depth = complete_call_stack.size();
-    if (current_stack_depth == 0) {
-      // First function on the call stack
-      len_combined_name = strlen(funcname) + 1;
-      combined_name = (char*) malloc(len_combined_name);
-      strcpy(combined_name, funcname);
-      max_depth = 1;
+  // Free every context's tallies.  The contexts themselves are freed
+  // along with their arena.
+  ~CallStack() {
+    vector<CallContext*> all_contexts;
+    get_all_contexts(all_contexts);
+    for (vector<CallContext*>::iterator cc_iter = all_contexts.begin();
+         cc_iter != all_contexts.end();
+         cc_iter++)
+      delete (*cc_iter)->counters;
+  }
+
+  // Push a function onto the stack and return the new context.
+  CallContext* push_function (uint32_t funcid) {
+    callers.push_back(current);
+
+    // Return to the function's existing context if it's recursive.
+    if (bf_collapse_recursion)
+      for (CallContext* context = current; context != &root; context = context->parent)
+        if (context->funcid == funcid) {
+          current = context;
+          return current;
+        }
+
+    // Find or create a child context, dropping the innermost callers
+    // if the new context would be too deep.
+    CallContext* parent = current;
+    if (bf_max_call_depth > 0)
+      while (parent->depth >= bf_max_call_depth)
+        parent = parent->parent;
+    CallContext*& child = children[child_key_t(parent, funcid)];
+    if (child == NULL) {
+      child = contexts.create(funcid, parent);
+      if (child->depth > max_depth)
+        max_depth = child->depth;
     }
-    else {
-      // All other calls (the common case)
-      const char* ancestors_names = complete_call_stack.back();
-      size_t length_needed = strlen(funcname) + strlen(ancestors_names) + 2;
-      if (len_combined_name < length_needed) {
-        len_combined_name = length_needed*2;
-        combined_name = (char*) realloc(combined_name, len_combined_name);
+    current = child;
+    return current;
+  }
+
+  // Pop a function from the stack and return the new context.
+  CallContext* pop_function (void) {
+    if (!callers.empty()) {
+      current = callers.back();
+      callers.pop_back();
+    }
+    return current;
+  }
+
+  // Return the context at the top of the stack.
+  CallContext* current_context (void) {
+    return current;
+  }
+
+  // Return the name of a context, constructing and interning it if
+  // necessary.  We walk up to the nearest named ancestor then name
+  // each context on the way back down so that deep call stacks don't
+  // recurse once per level.
+  const char* context_name (CallContext* context) {
+    if (context->name != NULL)
+      return context->name;
+    vector<CallContext*> unnamed;
+    for (CallContext* ancestor = context; ancestor->name == NULL; ancestor = ancestor->parent)
+      unnamed.push_back(ancestor);
+    for (vector<CallContext*>::reverse_iterator iter = unnamed.rbegin();
+         iter != unnamed.rend();
+         iter++) {
+      CallContext* ctx = *iter;
+      string name(bf_func_id_to_name(ctx->funcid));
+      if (ctx->parent != &root) {
+        name += ' ';
+        name += ctx->parent->name;
       }
-      sprintf(combined_name, "%s %s", funcname, ancestors_names);
-      current_stack_depth++;
-      if (current_stack_depth > max_depth)
-        max_depth = current_stack_depth;
+      ctx->name = bf_string_to_symbol(name.c_str());
     }
-    unique_combined_name = bf_string_to_symbol(combined_name);
-    complete_call_stack.push_back(unique_combined_name);
-    return unique_combined_name;
+    return context->name;
+  }
+
+  // Append every context to a given vector.
+  void get_all_contexts (vector<CallContext*>& all_contexts) {
+    all_contexts.push_back(&root);
+    for (child_map_t::iterator child_iter = children.begin();
+         child_iter != children.end();
+         child_iter++)
+      all_contexts.push_back(child_iter->second);
+  }
+};
+
+// Encapsulate all of the state that a single thread maintains.  A
+// thread modifies only its own ThreadState, so no locking is needed
+// on the fast path.  A thread's ThreadState is merged into a
+// program-wide aggregate and freed when the thread exits, and the
+// ThreadStates of all threads still running are merged with that
+// aggregate when the program exits.
+typedef vector<ByteFlopCounters*> counter_vector_t;
+class ThreadState {
+public:
+  ByteFlopCounters global_totals;       // Tallies of all of this thread's counters
+  uint64_t prev_global_scalars[NUM_SCALAR_COUNTERS];  // Previously reported values of global_totals' scalar counters
+  uint64_t num_merged;                  // Number of basic blocks merged so far
+  counter_vector_t bb_totals;           // Stack of per-basic-block tallies
+  str2bfc_t per_func_totals;            // Per-function tallies
+  str2num_t func_call_tallies;          // Per-function invocation tallies
+  counter_vector_t per_func_id_totals;  // Per-function tallies, indexed by function ID
+  vector<uint64_t> func_id_call_tallies;  // Per-function invocation tallies, indexed by function ID
+  str2bfc_t user_defined_totals;        // Per-partition tallies
+  CallStack call_stack;                 // Function call stack
+  CounterMemoryPool counter_memory_pool;  // Free list of ByteFlopCounters
+
+  // Pointers to the owning thread's instance of each bf_*_count variable
+  uint64_t* load_count;
+  uint64_t* store_count;
+  uint64_t* mem_insts_count;
+  uint64_t* inst_mix_histo;
+  uint64_t* terminator_count;
+  uint64_t* mem_intrin_count;
+  uint64_t* load_ins_count;
+  uint64_t* store_ins_count;
+  uint64_t* flop_count;
+  uint64_t* fp_bits_count;
+  uint64_t* op_count;
+  uint64_t* op_bits_count;
+
+  ThreadState() {
+    num_merged = 0;
+    load_count = store_count = load_ins_count = store_ins_count = NULL;
+    flop_count = fp_bits_count = op_count = op_bits_count = NULL;
+    mem_insts_count = inst_mix_histo = terminator_count = mem_intrin_count = NULL;
+    for (size_t i = 0; i < NUM_SCALAR_COUNTERS; i++)
+      prev_global_scalars[i] = 0;
+  }
+
+  ~ThreadState() {
+    for (counter_iterator sm_iter = per_func_totals.begin();
+         sm_iter != per_func_totals.end();
+         sm_iter++)
+      delete sm_iter->second;
+    for (counter_iterator sm_iter = user_defined_totals.begin();
+         sm_iter != user_defined_totals.end();
+         sm_iter++)
+      delete sm_iter->second;
+    for (counter_vector_t::iterator bfc_iter = per_func_id_totals.begin();
+         bfc_iter != per_func_id_totals.end();
+         bfc_iter++)
+      delete *bfc_iter;
+    for (counter_vector_t::iterator bfc_iter = bb_totals.begin();
+         bfc_iter != bb_totals.end();
+         bfc_iter++)
+      delete *bfc_iter;
+  }
+
+  // Allocate the calling thread's counter arrays and remember where
+  // all of its counters live.
+  void bind_to_calling_thread (void) {
+    if (bf_types) {
+      bf_mem_insts_count = new uint64_t[NUM_MEM_INSTS];
+      for (size_t i = 0; i < NUM_MEM_INSTS; i++)
+        bf_mem_insts_count[i] = 0;
+    }
+    if (bf_tally_inst_mix) {
+      bf_inst_mix_histo = new uint64_t[NUM_OPCODES];
+      for (unsigned int i = 0; i < NUM_OPCODES; i++)
+        bf_inst_mix_histo[i] = 0;
+    }
+    bf_terminator_count = new uint64_t[BF_END_BB_NUM];
+    for (unsigned int i = 0; i < BF_END_BB_NUM; i++)
+      bf_terminator_count[i] = 0;
+    bf_mem_intrin_count = new uint64_t[BF_NUM_MEM_INTRIN];
+    for (unsigned int i = 0; i < BF_NUM_MEM_INTRIN; i++)
+      bf_mem_intrin_count[i] = 0;
+    load_count       = &bf_load_count;
+    store_count      = &bf_store_count;
+    mem_insts_count  = bf_mem_insts_count;
+    inst_mix_histo   = bf_inst_mix_histo;
+    terminator_count = bf_terminator_count;
+    mem_intrin_count = bf_mem_intrin_count;
+    load_ins_count   = &bf_load_ins_count;
+    store_ins_count  = &bf_store_ins_count;
+    flop_count       = &bf_flop_count;
+    fp_bits_count    = &bf_fp_bits_count;
+    op_count         = &bf_op_count;
+    op_bits_count    = &bf_op_bits_count;
+  }
+
+  // Free the calling thread's counter arrays and zero its scalar
+  // counters so that a ThreadState created later for the same thread
+  // (e.g., by instrumented code called from another thread-exit
+  // destructor) starts counting from zero.  This must be called by
+  // the owning thread after its counters have been harvested.
+  void unbind_from_calling_thread (void) {
+    delete[] bf_mem_insts_count;
+    delete[] bf_inst_mix_histo;
+    delete[] bf_terminator_count;
+    delete[] bf_mem_intrin_count;
+    bf_mem_insts_count = bf_inst_mix_histo = bf_terminator_count = bf_mem_intrin_count = NULL;
+    bf_load_count = bf_store_count = bf_load_ins_count = bf_store_ins_count = 0;
+    bf_flop_count = bf_fp_bits_count = bf_op_count = bf_op_bits_count = 0;
+    load_count = store_count = load_ins_count = store_ins_count = NULL;
+    flop_count = fp_bits_count = op_count = op_bits_count = NULL;
+    mem_insts_count = inst_mix_histo = terminator_count = mem_intrin_count = NULL;
   }
 
-  // Pop a function name from the call stack and return the new top of
-  // the call stack (function + ancestors).
-  const char* pop_function (void) {
-    complete_call_stack.pop_back();
-    if (complete_call_stack.size() > 0)
-      return complete_call_stack.back();
+  // Accumulate the owning thread's current counter values into its
+  // global totals.  The owning thread may still be incrementing its
+  // counters (e.g., when another thread calls exit()), so we read
+  // each counter atomically to get an untorn snapshot of its value.
+  void harvest_counters (void) {
+    ByteFlopCounters snapshot;
+    if (snapshot.mem_insts != NULL)
+      snapshot_counters(snapshot.mem_insts, mem_insts_count, NUM_MEM_INSTS);
+    if (snapshot.inst_mix_histo != NULL)
+      snapshot_counters(snapshot.inst_mix_histo, inst_mix_histo, NUM_OPCODES);
+    snapshot_counters(snapshot.terminators, terminator_count, BF_END_BB_NUM);
+    snapshot_counters(snapshot.mem_intrinsics, mem_intrin_count, BF_NUM_MEM_INTRIN);
+    snapshot.loads     = __atomic_load_n(load_count, __ATOMIC_RELAXED);
+    snapshot.stores    = __atomic_load_n(store_count, __ATOMIC_RELAXED);
+    snapshot.load_ins  = __atomic_load_n(load_ins_count, __ATOMIC_RELAXED);
+    snapshot.store_ins = __atomic_load_n(store_ins_count, __ATOMIC_RELAXED);
+    snapshot.flops     = __atomic_load_n(flop_count, __ATOMIC_RELAXED);
+    snapshot.fp_bits   = __atomic_load_n(fp_bits_count, __ATOMIC_RELAXED);
+    snapshot.ops       = __atomic_load_n(op_count, __ATOMIC_RELAXED);
+    snapshot.op_bits   = __atomic_load_n(op_bits_count, __ATOMIC_RELAXED);
+    global_totals.accumulate(&snapshot);
+  }
+
+  // Return the size to which to grow a vector indexed by function ID
+  // so that it can hold a given ID.  We grow to cover every ID
+  // registered so far, but never to less than funcid+1 in case funcid
+  // was registered (e.g., by a dlopen()ed module) after we read the
+  // number of IDs.
+  static size_t func_id_vector_size (uint32_t funcid) {
+    size_t num_ids = bf_num_func_ids();
+    return num_ids > funcid ? num_ids : size_t(funcid) + 1;
+  }
+
+  // Return the per-function tallies associated with a given function
+  // ID, or NULL if there are none yet.
+  ByteFlopCounters*& func_id_totals (uint32_t funcid) {
+    if (__builtin_expect(funcid >= per_func_id_totals.size(), 0))
+      per_func_id_totals.resize(func_id_vector_size(funcid), NULL);
+    return per_func_id_totals[funcid];
+  }
+
+  // Return the invocation tally associated with a given function ID.
+  uint64_t& func_id_call_tally (uint32_t funcid) {
+    if (__builtin_expect(funcid >= func_id_call_tallies.size(), 0))
+      func_id_call_tallies.resize(func_id_vector_size(funcid), 0);
+    return func_id_call_tallies[funcid];
+  }
+
+  // Merge another thread's state into ours.  Tallies kept by function
+  // ID are merged by function name because a function may have been
+  // assigned a different ID in each module that references it.
+  void merge (ThreadState* other) {
+    global_totals.accumulate(&other->global_totals);
+    for (counter_iterator sm_iter = other->per_func_totals.begin();
+         sm_iter != other->per_func_totals.end();
+         sm_iter++)
+      merge_func_totals(sm_iter->first, sm_iter->second);
+    for (uint32_t funcid = 0; funcid < other->per_func_id_totals.size(); funcid++)
+      if (other->per_func_id_totals[funcid] != NULL)
+        merge_func_totals(bf_func_id_to_name(funcid), other->per_func_id_totals[funcid]);
+    for (str2num_t::iterator sm_iter = other->func_call_tallies.begin();
+         sm_iter != other->func_call_tallies.end();
+         sm_iter++)
+      func_call_tallies[sm_iter->first] += sm_iter->second;
+    for (uint32_t funcid = 0; funcid < other->func_id_call_tallies.size(); funcid++)
+      func_call_tallies[bf_func_id_to_name(funcid)] += other->func_id_call_tallies[funcid];
+    vector<CallContext*> contexts;
+    other->call_stack.get_all_contexts(contexts);
+    for (vector<CallContext*>::iterator cc_iter = contexts.begin();
+         cc_iter != contexts.end();
+         cc_iter++) {
+      CallContext* context = *cc_iter;
+      const char* context_name = other->call_stack.context_name(context);
+      if (context->counters != NULL)
+        merge_func_totals(context_name, context->counters);
+      if (context->calls > 0)
+        func_call_tallies[context_name] += context->calls;
+    }
+    for (counter_iterator sm_iter = other->user_defined_totals.begin();
+         sm_iter != other->user_defined_totals.end();
+         sm_iter++) {
+      counter_iterator our_iter = user_defined_totals.find(sm_iter->first);
+      if (our_iter == user_defined_totals.end())
+        user_defined_totals[sm_iter->first] = new ByteFlopCounters(*sm_iter->second);
+      else
+        our_iter->second->accumulate(sm_iter->second);
+    }
+    if (other->call_stack.max_depth > call_stack.max_depth)
+      call_stack.max_depth = other->call_stack.max_depth;
+  }
+
+private:
+  // Atomically read each counter in an array that another thread may
+  // be updating.
+  static void snapshot_counters (uint64_t* dest, const uint64_t* source, size_t num_counters) {
+    for (size_t i = 0; i < num_counters; i++)
+      dest[i] = __atomic_load_n(&source[i], __ATOMIC_RELAXED);
+  }
+
+  // Merge another thread's tallies for a given function into ours.
+  void merge_func_totals (const char* funcname, ByteFlopCounters* other_totals) {
+    counter_iterator our_iter = per_func_totals.find(funcname);
+    if (our_iter == per_func_totals.end())
+      per_func_totals[funcname] = new ByteFlopCounters(*other_totals);
     else
-      return "[EMPTY]";
+      our_iter->second->accumulate(other_totals);
   }
 };
-static CallStack* call_stack = NULL;
+
+// Keep track of every thread's state, being careful to work around
+// the "C++ static initialization order fiasco" (cf. the C++ FAQ).
+static vector<ThreadState*>& all_thread_states (void)
+{
+  static vector<ThreadState*>* states = new vector<ThreadState*>();
+  return *states;
+}
+static pthread_mutex_t thread_states_lock = PTHREAD_MUTEX_INITIALIZER;  // Lock protecting all_thread_states() and retired_state
+static pthread_key_t thread_exit_key;         // Key whose destructor runs at thread exit
+static __thread ThreadState* thread_state = NULL;  // The calling thread's state
+static ThreadState* retired_state = NULL;     // Merge of all exited threads' states
+static ThreadState* merged_state = NULL;      // Merge of all threads' states (valid only at exit)
 
 // As a kludge, set a global variable indicating that all of the
 // constructors in this file have been called.  Because of the "C++
@@ -396,26 +664,63 @@ public:
 } check_construction;
 
 
+// When a thread exits, fold its counters into its state, merge its
+// state into retired_state, and free it.  We hold thread_states_lock
+// throughout so the end-of-program merge sees the thread's state
+// either in all_thread_states() or in retired_state but not both.
+static void retire_thread_state (void* ts_ptr)
+{
+  ThreadState* ts = (ThreadState*) ts_ptr;
+  bf_retire_trace_buffer();
+  pthread_mutex_lock(&thread_states_lock);
+  if (!bf_every_bb)
+    ts->harvest_counters();
+  ts->unbind_from_calling_thread();
+  vector<ThreadState*>& states = all_thread_states();
+  states.erase(find(states.begin(), states.end(), ts));
+  if (retired_state == NULL)
+    retired_state = new ThreadState();
+  retired_state->merge(ts);
+  pthread_mutex_unlock(&thread_states_lock);
+  delete ts;
+  thread_state = NULL;
+}
+
+
 // Initialize some of our variables at first use.
 void initialize_byfl (void) {
-  call_stack = new CallStack();
-  counter_memory_pool = new CounterMemoryPool();
-  if (bf_types) {
-    bf_mem_insts_count = new uint64_t[NUM_MEM_INSTS];
-    for (size_t i = 0; i < NUM_MEM_INSTS; i++)
-      bf_mem_insts_count[i] = 0;
+  if (pthread_key_create(&thread_exit_key, retire_thread_state) != 0) {
+    cerr << "Failed to create a thread-specific data key\n";
+    exit(1);
   }
-  if (bf_tally_inst_mix) {
-    bf_inst_mix_histo = new uint64_t[NUM_OPCODES];
-    for (unsigned int i = 0; i < NUM_OPCODES; i++)
-      bf_inst_mix_histo[i] = 0;
-  }
-  bf_terminator_count = new uint64_t[BF_END_BB_NUM];
-  for (unsigned int i = 0; i < BF_END_BB_NUM; i++)
-    bf_terminator_count[i] = 0;
-  bf_mem_intrin_count = new uint64_t[BF_NUM_MEM_INTRIN];
-  for (unsigned int i = 0; i < BF_NUM_MEM_INTRIN; i++)
-    bf_mem_intrin_count[i] = 0;
+}
+
+
+// Initialize all top-level variables in all files.  This is invoked
+// exactly once, by whichever thread first calls
+// bf_initialize_if_necessary().
+static void initialize_all_files (void)
+{
+  initialize_byfl();
+  initialize_reuse();
+  initialize_symtable();
+  initialize_threading();
+  initialize_tracebuf();
+  initialize_ubytes();
+  initialize_tallybytes();
+  initialize_vectors();
+}
+
+
+// Create and register a ThreadState for the calling thread.
+static void initialize_thread (void)
+{
+  thread_state = new ThreadState();
+  thread_state->bind_to_calling_thread();
+  pthread_mutex_lock(&thread_states_lock);
+  all_thread_states().push_back(thread_state);
+  pthread_mutex_unlock(&thread_states_lock);
+  pthread_setspecific(thread_exit_key, thread_state);
   bf_push_basic_block();
 }
 
@@ -423,19 +728,13 @@ void initialize_byfl (void) {
 // Initialize on first use all top-level variables in all files.  This
 // is a kludge to work around the "C++ static initialization order
 // fiasco" (cf. the C++ FAQ).  bf_initialize_if_necessary() can safely
-// be called multiple times.
+// be called multiple times and from multiple threads.
 void bf_initialize_if_necessary (void)
 {
-  static bool initialized = false;
-  if (!__builtin_expect(initialized, true)) {
-    initialize_byfl();
-    initialize_reuse();
-    initialize_symtable();
-    initialize_threading();
-    initialize_ubytes();
-    initialize_tallybytes();
-    initialize_vectors();
-    initialized = true;
+  static pthread_once_t initialized = PTHREAD_ONCE_INIT;
+  if (__builtin_expect(thread_state == NULL, 0)) {
+    pthread_once(&initialized, initialize_all_files);
+    initialize_thread();
   }
 }
 
@@ -443,7 +742,7 @@ void bf_initialize_if_necessary (void)
 // Push a new basic block onto the stack (before a function call).
 void bf_push_basic_block (void)
 {
-  bb_totals().push_back(counter_memory_pool->allocate());
+  thread_state->bb_totals.push_back(thread_state->counter_memory_pool.allocate());
 }
 
 
@@ -451,36 +750,41 @@ void bf_push_basic_block (void)
 // returns).
 void bf_pop_basic_block (void)
 {
-  counter_memory_pool->deallocate(bb_totals().back());
-  bb_totals().pop_back();
+  thread_state->counter_memory_pool.deallocate(thread_state->bb_totals.back());
+  thread_state->bb_totals.pop_back();
 }
 
 
 // Tally the number of calls to each function.
-void bf_incr_func_tally (const char* funcname)
+void bf_incr_func_tally (uint32_t funcid)
 {
-  const char* unique_name = bf_string_to_symbol(funcname);
-  func_call_tallies()[unique_name]++;
+  thread_state->func_id_call_tally(funcid)++;
 }
 
 
 // Push a function name onto the call stack.  Increment the invocation
 // count the call stack as a whole, and ensure the individual function
-// name also exists in the hash table.
-void bf_push_function (const char* funcname)
+// also has an invocation count.
+void bf_push_function (uint32_t funcid)
 {
-  const char* unique_combined_name = call_stack->push_function(funcname);
-  bf_func_and_parents = unique_combined_name;
-  func_call_tallies()[bf_func_and_parents]++;
-  const char* unique_name = bf_string_to_symbol(funcname);
-  func_call_tallies()[unique_name] += 0;
+  thread_state->call_stack.push_function(funcid)->calls++;
+  thread_state->func_id_call_tally(funcid) += 0;
 }
 
 
 // Pop the top function name from the call stack.
 void bf_pop_function (void)
 {
-  bf_func_and_parents = call_stack->pop_function();
+  thread_state->call_stack.pop_function();
+}
+
+
+// Return the name of the calling thread's current function and all
+// of its ancestors.
+const char* bf_call_context_name (void)
+{
+  CallStack& call_stack = thread_state->call_stack;
+  return call_stack.context_name(call_stack.current_context());
 }
 
 
@@ -524,6 +828,20 @@ static bool suppress_output (void)
       }
     }
 
+    // If the BF_BINOUT environment variable is set, expand it and
+    // write all BYFL_BB data in binary to the named file.
+    char *binout = getenv("BF_BINOUT");
+    if (binout && bf_every_bb) {
+      wordexp_t expansion;
+      if (wordexp(binout, &expansion, 0) || expansion.we_wordc != 1) {
+        cerr << "Failed to expand BF_BINOUT (\"" << binout << "\") to a single filename\n";
+        exit(1);
+      }
+      bf_open_bb_stream(expansion.we_wordv[0], bb_column_names, NUM_SCALAR_COUNTERS);
+      wordfree(&expansion);
+      bb_binary = true;
+    }
+
     // Log the Byfl command line to help users reproduce their results.
     *bfout << "BYFL_INFO: Byfl command line: " << bf_option_string << '\n';
 
@@ -544,7 +862,7 @@ static bool suppress_output (void)
 void bf_accumulate_bb_tallies (void)
 {
   // Add the current values to the per-BB totals.
-  ByteFlopCounters* current_bb = bb_totals().back();
+  ByteFlopCounters* current_bb = thread_state->bb_totals.back();
   current_bb->accumulate(bf_mem_insts_count,
                          bf_inst_mix_histo,
                          bf_terminator_count,
@@ -557,14 +875,15 @@ void bf_accumulate_bb_tallies (void)
                          bf_fp_bits_count,
                          bf_op_count,
                          bf_op_bits_count);
-  global_totals.accumulate(current_bb);
+  thread_state->global_totals.accumulate(current_bb);
   const char* partition = bf_string_to_symbol(bf_categorize_counters());
   if (partition != NULL) {
-    counter_iterator sm_iter = user_defined_totals().find(partition);
-    if (sm_iter == per_func_totals().end())
-      user_defined_totals()[partition] = new ByteFlopCounters(*current_bb);
+    str2bfc_t& user_defined_totals = thread_state->user_defined_totals;
+    counter_iterator sm_iter = user_defined_totals.find(partition);
+    if (sm_iter == user_defined_totals.end())
+      user_defined_totals[partition] = new ByteFlopCounters(*current_bb);
     else
-      user_defined_totals()[partition]->accumulate(current_bb);
+      sm_iter->second->accumulate(current_bb);
   }
 }
 
@@ -572,7 +891,22 @@ void bf_accumulate_bb_tallies (void)
 // push and a pop for every basic block.
 void bf_reset_bb_tallies (void)
 {
-  bb_totals().back()->reset();
+  thread_state->bb_totals.back()->reset();
+}
+
+// Write a number right-justified into a field of a given width, which
+// must be large enough to hold any uint64_t, and return a pointer
+// just past the field.
+static inline char* format_right_justified (char* field, uint64_t value, size_t width)
+{
+  char* digit = field + width;
+  do {
+    *--digit = '0' + value%10;
+    value /= 10;
+  }
+  while (value != 0);
+  memset(field, ' ', digit - field);
+  return field + width;
 }
 
 // Report what we've measured for the current basic block.
@@ -584,59 +918,70 @@ void bf_report_bb_tallies (void)
   if (suppress_output())
     return;
 
-  // If this is our first invocation, output a basic-block header line.
-  if (__builtin_expect(!showed_header, 0)) {
-    *bfout << bf_output_prefix
-           << "BYFL_BB_HEADER: "
-           << setw(HDR_COL_WIDTH) << "LD_bytes" << ' '
-           << setw(HDR_COL_WIDTH) << "ST_bytes" << ' '
-           << setw(HDR_COL_WIDTH) << "LD_ops" << ' '
-           << setw(HDR_COL_WIDTH) << "ST_ops" << ' '
-           << setw(HDR_COL_WIDTH) << "Flops" << ' '
-           << setw(HDR_COL_WIDTH) << "FP_bits" << ' '
-           << setw(HDR_COL_WIDTH) << "Int_ops" << ' '
-           << setw(HDR_COL_WIDTH) << "Int_op_bits";
-    *bfout << '\n';
-    showed_header = true;
-  }
+  // Do nothing until we've accumulated enough basic blocks.
+  ThreadState* ts = thread_state;
+  if (++ts->num_merged < bf_bb_merge)
+    return;
+  ts->num_merged = 0;
+
+  // Determine how much each counter has changed since the previous
+  // report.
+  uint64_t deltas[NUM_SCALAR_COUNTERS];
+  ts->global_totals.scalar_difference(ts->prev_global_scalars, deltas);
+
+  // Serialize output across threads.
+  if (bf_thread_safe)
+    bf_acquire_mega_lock();
+  if (bb_binary)
+    // Append the deltas to the binary stream instead of to bfout.
+    bf_write_bb_record(deltas, NUM_SCALAR_COUNTERS);
+  else {
+    // If this is our first invocation, output a basic-block header line.
+    if (__builtin_expect(!showed_header, 0)) {
+      *bfout << bf_output_prefix << "BYFL_BB_HEADER: ";
+      for (size_t i = 0; i < NUM_SCALAR_COUNTERS; i++) {
+        if (i > 0)
+          *bfout << ' ';
+        *bfout << setw(HDR_COL_WIDTH) << bb_column_names[i];
+      }
+      *bfout << '\n';
+      showed_header = true;
+    }
 
-  // If we've accumulated enough basic blocks, output the aggregate of
-  // their values.
-  if (++num_merged >= bf_bb_merge) {
     // Output the difference between the current counter values and
-    // our previously saved values.
-    ByteFlopCounters* counter_deltas = global_totals.difference(&prev_global_totals);
-    *bfout << bf_output_prefix
-           << "BYFL_BB:        "
-           << setw(HDR_COL_WIDTH) << counter_deltas->loads << ' '
-           << setw(HDR_COL_WIDTH) << counter_deltas->stores << ' '
-           << setw(HDR_COL_WIDTH) << counter_deltas->load_ins << ' '
-           << setw(HDR_COL_WIDTH) << counter_deltas->store_ins << ' '
-           << setw(HDR_COL_WIDTH) << counter_deltas->flops << ' '
-           << setw(HDR_COL_WIDTH) << counter_deltas->fp_bits << ' '
-           << setw(HDR_COL_WIDTH) << counter_deltas->ops << ' '
-           << setw(HDR_COL_WIDTH) << counter_deltas->op_bits;
-    *bfout << '\n';
-    num_merged = 0;
-    prev_global_totals = global_totals;
-    delete counter_deltas;
+    // our previously saved values.  Format the line into a buffer to
+    // avoid the overhead of one stream operation per column.
+    char line[32 + NUM_SCALAR_COUNTERS*(HDR_COL_WIDTH + 1)];
+    char* line_end = line;
+    memcpy(line_end, "BYFL_BB:        ", 16);
+    line_end += 16;
+    for (size_t i = 0; i < NUM_SCALAR_COUNTERS; i++) {
+      if (i > 0)
+        *line_end++ = ' ';
+      line_end = format_right_justified(line_end, deltas[i], HDR_COL_WIDTH);
+    }
+    *line_end++ = '\n';
+    *bfout << bf_output_prefix;
+    bfout->write(line, line_end - line);
   }
+  if (bf_thread_safe)
+    bf_release_mega_lock();
 }
 
 
 // Associate the current counter values with a given function.
-void bf_assoc_counters_with_func (const char* funcname)
+void bf_assoc_counters_with_func (uint32_t funcid)
 {
-  // Ensure that per_func_totals contains an ByteFlopCounters entry
-  // for funcname, then add the current counters to that entry.
+  // Find the ByteFlopCounters entry for the function (or, with
+  // -bf-call-stack, for the function and its ancestors).
+  ByteFlopCounters** func_counters;
   if (bf_call_stack)
-    funcname = bf_func_and_parents;
+    func_counters = &thread_state->call_stack.current_context()->counters;
   else
-    funcname = bf_string_to_symbol(funcname);
-  counter_iterator sm_iter = per_func_totals().find(funcname);
-  if (sm_iter == per_func_totals().end())
-    // This is the first time we've seen this function name.
-    per_func_totals()[funcname] =
+    func_counters = &thread_state->func_id_totals(funcid);
+  if (*func_counters == NULL)
+    // This is the first time we've seen this function.
+    *func_counters =
       new ByteFlopCounters(bf_mem_insts_count,
                            bf_inst_mix_histo,
                            bf_terminator_count,
@@ -649,23 +994,21 @@ void bf_assoc_counters_with_func (const char* funcname)
                            bf_fp_bits_count,
                            bf_op_count,
                            bf_op_bits_count);
-  else {
+  else
     // Accumulate the current counter values into those associated
-    // with an existing function name.
-    ByteFlopCounters* func_counters = sm_iter->second;
-    func_counters->accumulate(bf_mem_insts_count,
-                              bf_inst_mix_histo,
-                              bf_terminator_count,
-                              bf_mem_intrin_count,
-                              bf_load_count,
-                              bf_store_count,
-                              bf_load_ins_count,
-                              bf_store_ins_count,
-                              bf_flop_count,
-                              bf_fp_bits_count,
-                              bf_op_count,
-                              bf_op_bits_count);
-  }
+    // with an existing function.
+    (*func_counters)->accumulate(bf_mem_insts_count,
+                                 bf_inst_mix_histo,
+                                 bf_terminator_count,
+                                 bf_mem_intrin_count,
+                                 bf_load_count,
+                                 bf_store_count,
+                                 bf_load_ins_count,
+                                 bf_store_ins_count,
+                                 bf_flop_count,
+                                 bf_fp_bits_count,
+                                 bf_op_count,
+                                 bf_op_bits_count);
 }
 
 // At the end of the program, report what we measured.
@@ -681,8 +1024,8 @@ private:
   // Compare two function names, reporting which was called more
   // times.  Break ties by comparing function names.
   static bool compare_func_totals (const char* one, const char* two) {
-    uint64_t one_calls = func_call_tallies()[one];
-    uint64_t two_calls = func_call_tallies()[two];
+    uint64_t one_calls = merged_state->func_call_tallies[one];
+    uint64_t two_calls = merged_state->func_call_tallies[two];
     if (one_calls != two_calls)
       return one_calls > two_calls;
     else
@@ -720,19 +1063,21 @@ private:
            << setw(HDR_COL_WIDTH) << "Invocations" << ' '
            << "Function";
     if (bf_call_stack)
-      for (size_t i=0; i<call_stack->max_depth-1; i++)
+      for (size_t i=0; i<merged_state->call_stack.max_depth-1; i++)
         *bfout << ' '
                << "Parent_func_" << i+1;
     *bfout << '\n';
 
     // Output the data by sorted function name.
-    vector<const char*>* all_func_names = per_func_totals().sorted_keys(compare_char_stars);
+    str2bfc_t& per_func_totals = merged_state->per_func_totals;
+    str2num_t& func_call_tallies = merged_state->func_call_tallies;
+    vector<const char*>* all_func_names = per_func_totals.sorted_keys(compare_char_stars);
     for (vector<const char*>::iterator fn_iter = all_func_names->begin();
          fn_iter != all_func_names->end();
          fn_iter++) {
       const string funcname = *fn_iter;
       const char* funcname_c = bf_string_to_symbol(funcname.c_str());
-      ByteFlopCounters* func_counters = per_func_totals()[funcname_c];
+      ByteFlopCounters* func_counters = per_func_totals[funcname_c];
       *bfout << bf_output_prefix
              << "BYFL_FUNC:        "
              << setw(HDR_COL_WIDTH) << func_counters->loads << ' '
@@ -749,7 +1094,7 @@ private:
                << (bf_mem_footprint ? bf_tally_unique_addresses_tb(funcname_c) : bf_tally_unique_addresses(funcname_c));
       *bfout << ' '
              << setw(HDR_COL_WIDTH) << func_counters->terminators[BF_END_BB_DYNAMIC] << ' '
-             << setw(HDR_COL_WIDTH) << func_call_tallies()[funcname_c] << ' '
+             << setw(HDR_COL_WIDTH) << func_call_tallies[funcname_c] << ' '
              << funcname_c << '\n';
     }
     delete all_func_names;
@@ -762,8 +1107,8 @@ private:
            << "Byfl" << ' '
            << "Function\n";
     vector<const char*> all_called_funcs;
-    for (str2num_t::iterator sm_iter = func_call_tallies().begin();
-         sm_iter != func_call_tallies().end();
+    for (str2num_t::iterator sm_iter = func_call_tallies.begin();
+         sm_iter != func_call_tallies.end();
          sm_iter++)
       all_called_funcs.push_back(sm_iter->first);
     sort(all_called_funcs.begin(), all_called_funcs.end(), compare_func_totals);
@@ -775,9 +1120,9 @@ private:
       bool instrumented = true;          // Whether function was instrumented
       if (funcname[0] == '+') {
         const char* unique_name = bf_string_to_symbol(funcname+1);
-        str2num_t::iterator tally_iter = func_call_tallies().find(unique_name);
-        instrumented = (tally_iter != func_call_tallies().end());
-        tally = func_call_tallies()[bf_string_to_symbol(funcname)];
+        str2num_t::iterator tally_iter = func_call_tallies.find(unique_name);
+        instrumented = (tally_iter != func_call_tallies.end());
+        tally = func_call_tallies[bf_string_to_symbol(funcname)];
         funcname = unique_name;
       }
       string funcname_orig = demangle_func_name(funcname);
@@ -794,15 +1139,41 @@ private:
     }
   }
 
+  // Report the median reuse distance of a given reference stream.
+  void report_median_reuse_distance (const string& tag, bf_rd_stream_t stream, const char* kind) {
+    uint64_t median_value;
+    uint64_t mad_value;
+    bf_get_median_reuse_distance(stream, &median_value, &mad_value);
+    *bfout << tag << ": " << setw(25);
+    if (median_value == ~(uint64_t)0)
+      *bfout << "infinite" << " median " << kind << "reuse distance";
+    else
+      *bfout << median_value << " median " << kind << "reuse distance (+/- "
+             << mad_value << ")";
+    if (bf_reuse_dist_gran > 1)
+      *bfout << " in " << bf_reuse_dist_gran << "-byte units";
+    uint64_t lower_bound;
+    uint64_t upper_bound;
+    uint64_t sample_period;
+    bf_get_median_reuse_bounds(stream, &lower_bound, &upper_bound, &sample_period);
+    if (sample_period > 1) {
+      *bfout << ", sampling 1 in " << sample_period << " addresses (approx. 95% CI: ";
+      if (upper_bound == ~(uint64_t)0)
+        *bfout << lower_bound << " to infinite)";
+      else
+        *bfout << lower_bound << " to " << upper_bound << ')';
+    }
+    *bfout << '\n';
+  }
+
   // Report the total counter values across all basic blocks.
   void report_totals (const char* partition, ByteFlopCounters& counter_totals) {
     uint64_t global_bytes = counter_totals.loads + counter_totals.stores;
     uint64_t global_mem_ops = counter_totals.load_ins + counter_totals.store_ins;
     uint64_t global_unique_bytes = 0;
-    vector<uint64_t>* reuse_hist;   // Histogram of reuse distances
-    uint64_t reuse_unique;          // Unique bytes as measured by the reuse-distance calculator
-    bf_get_reuse_distance(&reuse_hist, &reuse_unique);
-    if (reuse_unique > 0)
+    uint64_t reuse_unique;          // Unique addresses as measured by the reuse-distance calculator
+    bf_get_reuse_distance(&reuse_unique);
+    if (reuse_unique > 0 && bf_reuse_dist_gran == 1 && bf_reuse_sample == 1 && bf_reuse_sample_max == 0)
       global_unique_bytes = reuse_unique;
     else
       if (bf_unique_bytes && !partition)
@@ -844,15 +1215,11 @@ private:
 
     // Output reuse distance if measured.
     if (reuse_unique > 0) {
-      uint64_t median_value;
-      uint64_t mad_value;
-      bf_get_median_reuse_distance(&median_value, &mad_value);
-      *bfout << tag << ": " << setw(25);
-      if (median_value == ~(uint64_t)0)
-        *bfout << "infinite" << " median reuse distance\n";
-      else
-        *bfout << median_value << " median reuse distance (+/- "
-               << mad_value << ")\n";
+      report_median_reuse_distance(tag, BF_RD_ALL, "");
+      if (bf_reuse_dist_split) {
+        report_median_reuse_distance(tag, BF_RD_LOADS, "load ");
+        report_median_reuse_distance(tag, BF_RD_STORES, "store ");
+      }
     }
     *bfout << tag << ": " << separator << '\n';
 
@@ -1090,53 +1457,110 @@ public:
     if (suppress_output())
       return;
 
+    // Process all buffered memory-access traces.
+    bf_drain_all_trace_buffers();
+
+    // Merge all threads' state into a single ThreadState.  If we're
+    // not instrumented on the basic-block level, then we first need
+    // to accumulate the current values of each live thread's counters
+    // into that thread's totals.  Exited threads' states have already
+    // been merged into retired_state.
+    pthread_mutex_lock(&thread_states_lock);
+    merged_state = new ThreadState();
+    if (retired_state != NULL)
+      merged_state->merge(retired_state);
+    vector<ThreadState*>& states = all_thread_states();
+    for (vector<ThreadState*>::iterator ts_iter = states.begin();
+         ts_iter != states.end();
+         ts_iter++) {
+      ThreadState* ts = *ts_iter;
+      if (!bf_every_bb)
+        ts->harvest_counters();
+      merged_state->merge(ts);
+    }
+    pthread_mutex_unlock(&thread_states_lock);
+    ByteFlopCounters& global_totals = merged_state->global_totals;
+
+    // Reconstruct the counters of all functions instrumented with
+    // -bf-edge-profile.  Note that functions that are still active at
+    // exit (e.g., because they called exit()) may be miscounted.
+    vector<bf_edge_totals_t> edge_totals;
+    bf_get_edge_profile_totals(edge_totals);
+    for (vector<bf_edge_totals_t>::iterator et_iter = edge_totals.begin();
+         et_iter != edge_totals.end();
+         et_iter++) {
+      vector<uint64_t>& cols = et_iter->second;
+      if (cols[BF_EDGE_TERMINATORS + BF_END_BB_ANY] == 0)
+        continue;
+      ByteFlopCounters func_totals(NULL, NULL,
+                                   &cols[BF_EDGE_TERMINATORS],
+                                   &cols[BF_EDGE_MEM_INTRIN],
+                                   cols[BF_EDGE_LOADS],
+                                   cols[BF_EDGE_STORES],
+                                   cols[BF_EDGE_LOAD_INS],
+                                   cols[BF_EDGE_STORE_INS],
+                                   cols[BF_EDGE_FLOPS],
+                                   cols[BF_EDGE_FP_BITS],
+                                   cols[BF_EDGE_OPS],
+                                   cols[BF_EDGE_OP_BITS]);
+      if (bf_per_func) {
+        const char* funcname = bf_string_to_symbol(et_iter->first);
+        str2bfc_t& per_func_totals = merged_state->per_func_totals;
+        counter_iterator sm_iter = per_func_totals.find(funcname);
+        if (sm_iter == per_func_totals.end())
+          per_func_totals[funcname] = new ByteFlopCounters(func_totals);
+        else
+          sm_iter->second->accumulate(&func_totals);
+      }
+      else
+        global_totals.accumulate(&func_totals);
+    }
+
     // Report per-function counter totals.
-    if (bf_per_func)
+    if (bf_per_func) {
       report_by_function();
+      if (bf_reuse_dist_by_func)
+        bf_report_reuse_by_function();
+    }
 
     // Output a histogram of vector usage.
     if (bf_vectors)
-      bf_report_vector_operations(call_stack->max_depth);
-
-    // If we're not instrumented on the basic-block level, then we
-    // need to accumulate the current values of all of our counters
-    // into the global totals.
-    if (!bf_every_bb)
-      global_totals.accumulate(bf_mem_insts_count,
-                               bf_inst_mix_histo,
-                               bf_terminator_count,
-                               bf_mem_intrin_count,
-                               bf_load_count,
-                               bf_store_count,
-                               bf_load_ins_count,
-                               bf_store_ins_count,
-                               bf_flop_count,
-                               bf_fp_bits_count,
-                               bf_op_count,
-                               bf_op_bits_count);
+      bf_report_vector_operations(merged_state->call_stack.max_depth);
+
+    // Output a miss-ratio curve.
+    if (bf_mrc_sizes[0] != '\0')
+      bf_report_miss_ratio_curve();
 
     // If the global counter totals are empty, this means that we were
     // tallying per-function data and resetting the global counts
     // after each tally.  We therefore reconstruct the lost global
     // counts from the per-function tallies.
     if (global_totals.terminators[BF_END_BB_ANY] == 0)
-      for (counter_iterator sm_iter = per_func_totals().begin();
-           sm_iter != per_func_totals().end();
+      for (counter_iterator sm_iter = merged_state->per_func_totals.begin();
+           sm_iter != merged_state->per_func_totals.end();
            sm_iter++)
         global_totals.accumulate(sm_iter->second);
 
     // Report user-defined counter totals, if any.
-    vector<const char*>* all_tag_names = user_defined_totals().sorted_keys(compare_char_stars);
+    str2bfc_t& user_defined_totals = merged_state->user_defined_totals;
+    vector<const char*>* all_tag_names = user_defined_totals.sorted_keys(compare_char_stars);
     for (vector<const char*>::const_iterator tag_iter = all_tag_names->begin();
          tag_iter != all_tag_names->end();
          tag_iter++) {
       const char* tag_name = *tag_iter;
-      report_totals(tag_name, *user_defined_totals()[tag_name]);
+      report_totals(tag_name, *user_defined_totals[tag_name]);
     }
 
     // Report the global counter totals across all basic blocks.
     report_totals(NULL, global_totals);
+
+    // If the BF_CACHEMAP_STATS environment variable is set, report
+    // how well our hash tables' caches performed.
+    if (getenv("BF_CACHEMAP_STATS"))
+      bf_report_cachemap_stats();
     bfout->flush();
+    if (bb_binary)
+      bf_close_bb_stream();
   }
 } run_at_end_of_program;
 
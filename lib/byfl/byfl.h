@@ -29,14 +29,27 @@
 #include "opcode2name.h"
 
 // The following constants are defined by the instrumented code.
+extern uint8_t  bf_async_analysis;   // 1=process trace buffers on background threads
 extern uint64_t bf_bb_merge;         // Number of basic blocks to merge to compress the output
 extern uint8_t  bf_call_stack;       // 1=maintain a function call stack
+extern uint8_t  bf_collapse_recursion;  // 1=merge recursive calls into the caller's call stack
 extern uint8_t  bf_every_bb;         // 1=tally and output per-basic-block data
+extern uint64_t bf_max_call_depth;   // Maximum number of functions distinguished in a call stack (0=unlimited)
 extern uint64_t bf_max_reuse_distance;  // Maximum reuse distance to consider */
 extern const char* bf_option_string; // -bf-* command-line options
 extern uint8_t  bf_per_func;         // 1=tally and output per-function data
 extern uint8_t  bf_mem_footprint;    // 1=keep track of how many times each byte of memory is accessed
+extern const char* bf_mrc_sizes;     // Comma-separated cache sizes at which to report the miss ratio
+extern uint8_t  bf_reuse_dist;       // 1=compute reuse distance
+extern uint64_t bf_reuse_dist_gran;  // Number of bytes treated as a single address by reuse distance
+extern uint8_t  bf_reuse_dist_split; // 1=also compute reuse distance separately for loads and for stores
+extern uint8_t  bf_reuse_dist_by_func;  // 1=also compute reuse distance for each function
+extern uint64_t bf_reuse_engine;     // BF_REUSE_ENGINE_* algorithm for computing reuse distance
+extern uint64_t bf_reuse_sample;     // Initial period at which to sample addresses for reuse distance
+extern uint64_t bf_reuse_sample_max; // Maximum number of addresses to track for reuse distance (0=unlimited)
 extern uint8_t  bf_tally_inst_mix;   // 1=maintain instruction mix histogram
+extern uint8_t  bf_thread_safe;      // 1=program may invoke the library from multiple threads
+extern uint64_t bf_trace_buffer_entries;  // Number of records per thread to buffer before processing them
 extern uint8_t  bf_types;            // 1=count loads/stores per type
 extern uint8_t  bf_unique_bytes;     // 1=tally and output unique bytes
 extern uint8_t  bf_vectors;          // 1=bin then output vector characteristics
@@ -51,16 +64,42 @@ namespace bytesflops {
   typedef uint32_t bytecount_t;
   const bytecount_t bf_max_bytecount = ~(bytecount_t)(0);  // Clamp to this value
   typedef pair<bytecount_t, bytecount_t> bf_addr_tally_t;  // Number of times a count was seen ({count, multiplier})
+  typedef pair<const char*, vector<uint64_t> > bf_edge_totals_t;  // Function name and its BF_EDGE_NUM_COLS totals
+
+  // Define the reference streams for which reuse distance is reported.
+  typedef enum {
+    BF_RD_ALL,      // Loads and stores together
+    BF_RD_LOADS,    // Loads only (requires bf_reuse_dist_split)
+    BF_RD_STORES    // Stores only (requires bf_reuse_dist_split)
+  } bf_rd_stream_t;
 
   // The following library functions are used in files other than the
   // one in which they're defined.
+  extern void bf_acquire_mega_lock(void);
+  extern void bf_assoc_trace_with_prog(const uint64_t* trace, size_t num_records);
+  extern const char* bf_call_context_name(void);
+  extern void bf_assoc_trace_with_prog_tb(const uint64_t* trace, size_t num_records);
+  extern void bf_close_bb_stream(void);
+  extern void bf_drain_all_trace_buffers(void);
   extern void bf_get_address_tally_hist (vector<bf_addr_tally_t>& histogram, uint64_t* total);
-  extern void bf_get_median_reuse_distance(uint64_t* median_value, uint64_t* mad_value);
-  extern void bf_get_reuse_distance(vector<uint64_t>** hist, uint64_t* unique_addrs);
+  extern const char* bf_func_id_to_name(uint32_t funcid);
+  extern void bf_get_edge_profile_totals(vector<bf_edge_totals_t>& func_totals);
+  extern void bf_get_median_reuse_bounds(bf_rd_stream_t stream, uint64_t* lower, uint64_t* upper, uint64_t* sample_period);
+  extern void bf_get_median_reuse_distance(bf_rd_stream_t stream, uint64_t* median_value, uint64_t* mad_value);
+  extern void bf_get_reuse_distance(uint64_t* unique_addrs);
   extern void bf_get_vector_statistics(const char* tag, uint64_t* num_ops, uint64_t* total_elts, uint64_t* total_bits);
   extern void bf_get_vector_statistics(uint64_t* num_ops, uint64_t* total_elts, uint64_t* total_bits);
+  extern uint32_t bf_num_func_ids(void);
+  extern void bf_open_bb_stream(const char* filename, const char* const* column_names, size_t num_columns);
   extern void bf_push_basic_block(void);
+  extern void bf_release_mega_lock(void);
+  extern void bf_report_cachemap_stats(void);
+  extern void bf_report_miss_ratio_curve(void);
+  extern void bf_report_reuse_by_function(void);
   extern void bf_report_vector_operations(size_t call_stack_depth);
+  extern void bf_retire_trace_buffer(void);
+  extern void bf_reuse_dist_trace_prog(const uint64_t* trace, size_t num_records);
+  extern void bf_write_bb_record(const uint64_t* values, size_t num_columns);
   extern uint64_t bf_tally_unique_addresses(const char* funcname);
   extern uint64_t bf_tally_unique_addresses_tb(const char* funcname);
   extern uint64_t bf_tally_unique_addresses_tb(void);
@@ -71,12 +110,12 @@ namespace bytesflops {
   extern void initialize_symtable(void);
   extern void initialize_tallybytes(void);
   extern void initialize_threading(void);
+  extern void initialize_tracebuf(void);
   extern void initialize_ubytes(void);
   extern void initialize_vectors(void);
 
   // The following library variables are used in files other than the
   // one in which they're defined.
-  extern const char* bf_func_and_parents;   // Name of the current function and its parents
   extern string bf_output_prefix;           // Prefix appearing before each line of output
   extern const char* opcode2name[];         // Map from an LLVM opcode to its name
 }
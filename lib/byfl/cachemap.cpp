@@ -0,0 +1,131 @@
+/*
+ * Helper library for computing bytes:flops ratios
+ * (reporting CachedUnorderedMap cache statistics)
+ *
+ * By Scott Pakin <pakin@lanl.gov>
+ */
+
+#include "byfl.h"
+
+namespace bytesflops {}
+using namespace bytesflops;
+using namespace std;
+
+// Keep track of the statistics of every live CachedUnorderedMap and
+// the accumulated statistics of every destroyed CachedUnorderedMap.
+// The latter are summed per constructor signature (i.e., per map
+// type) so that programs that create and destroy many maps don't
+// accumulate one entry per map.  These are allocated on first use
+// because maps may be constructed before our own constructors run.
+typedef map<const char*, pair<uint64_t, uint64_t> > retired_stats_t;
+static vector<CacheMapStats*>* live_stats = NULL;
+static retired_stats_t* retired_stats = NULL;   // Map from a label to {hits, misses}
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+namespace bytesflops {
+
+extern ostream* bfout;
+
+// Begin tracking a map's cache statistics.
+void bf_register_cachemap_stats (CacheMapStats* stats)
+{
+  pthread_mutex_lock(&stats_lock);
+  if (live_stats == NULL) {
+    live_stats = new vector<CacheMapStats*>();
+    retired_stats = new retired_stats_t();
+  }
+  live_stats->push_back(stats);
+  pthread_mutex_unlock(&stats_lock);
+}
+
+
+// Stop tracking a map's cache statistics but retain its counts.
+void bf_unregister_cachemap_stats (CacheMapStats* stats)
+{
+  pthread_mutex_lock(&stats_lock);
+  for (vector<CacheMapStats*>::iterator stats_iter = live_stats->begin();
+       stats_iter != live_stats->end();
+       stats_iter++)
+    if (*stats_iter == stats) {
+      live_stats->erase(stats_iter);
+      break;
+    }
+  pair<uint64_t, uint64_t>& counts = (*retired_stats)[stats->label];
+  counts.first += stats->hits;
+  counts.second += stats->misses;
+  pthread_mutex_unlock(&stats_lock);
+}
+
+
+#ifdef BYFL_CACHEMAP_STATS
+// Extract a map type's template arguments from its constructor's
+// signature, if possible.
+static string type_label (const char* signature)
+{
+  string label(signature);
+  size_t args_begin = label.find("[with ");
+  if (args_begin == string::npos || label[label.size() - 1] != ']')
+    return label;
+  args_begin += 6;
+  return label.substr(args_begin, label.size() - 1 - args_begin);
+}
+#endif
+
+
+// Output the cache hit rate of each type of CachedUnorderedMap,
+// summed across all maps of that type.
+void bf_report_cachemap_stats (void)
+{
+#ifndef BYFL_CACHEMAP_STATS
+  *bfout << bf_output_prefix
+         << "BYFL_WARNING: BF_CACHEMAP_STATS has no effect unless the Byfl library is built with CACHEMAP_STATS=1.\n";
+#else
+  // Sum the statistics by map type.  For brevity, we label each type
+  // with only its template arguments when the compiler lists those
+  // separately ("... [with Key = ...]").
+  typedef map<string, pair<uint64_t, uint64_t> > label_to_counts_t;
+  label_to_counts_t label_to_counts;    // Map from a map type to {hits, misses}
+  pthread_mutex_lock(&stats_lock);
+  if (live_stats != NULL) {
+    for (vector<CacheMapStats*>::iterator stats_iter = live_stats->begin();
+         stats_iter != live_stats->end();
+         stats_iter++) {
+      pair<uint64_t, uint64_t>& counts = label_to_counts[type_label((*stats_iter)->label)];
+      counts.first += (*stats_iter)->hits;
+      counts.second += (*stats_iter)->misses;
+    }
+    for (retired_stats_t::iterator stats_iter = retired_stats->begin();
+         stats_iter != retired_stats->end();
+         stats_iter++) {
+      pair<uint64_t, uint64_t>& counts = label_to_counts[type_label(stats_iter->first)];
+      counts.first += stats_iter->second.first;
+      counts.second += stats_iter->second.second;
+    }
+  }
+  pthread_mutex_unlock(&stats_lock);
+
+  // Output a header line followed by one line per map type.
+  *bfout << bf_output_prefix
+         << "BYFL_CACHEMAP_HEADER: "
+         << setw(20) << "Lookups" << ' '
+         << setw(20) << "Hits" << ' '
+         << setw(20) << "Hit_rate" << ' '
+         << "Map_type\n";
+  for (label_to_counts_t::iterator lc_iter = label_to_counts.begin();
+       lc_iter != label_to_counts.end();
+       lc_iter++) {
+    uint64_t hits = lc_iter->second.first;
+    uint64_t lookups = hits + lc_iter->second.second;
+    if (lookups == 0)
+      continue;
+    *bfout << bf_output_prefix
+           << "BYFL_CACHEMAP: "
+           << setw(27) << lookups << ' '
+           << setw(20) << hits << ' '
+           << fixed << setw(20) << setprecision(6) << double(hits)/double(lookups) << ' '
+           << lc_iter->first << '\n';
+  }
+#endif
+}
+
+} // namespace bytesflops
@@ -9,36 +9,101 @@
 #define _CACHEMAP_H_
 
 #include "byfl.h"
+#include "flatmap.h"
 
 using namespace std;
 
-// Wrap unordered_map with a simple cache.  We expect to have many
-// hits to the same key.
+// Count the lookups that hit and miss in a CachedUnorderedMap's
+// cache.  Counting costs two increments per lookup so it's compiled
+// in only when BYFL_CACHEMAP_STATS is defined (e.g., by building with
+// "make CACHEMAP_STATS=1").  Every map then registers its counts so
+// they can be reported at exit (see BF_CACHEMAP_STATS).
+class CacheMapStats {
+public:
+  const char* label;   // Signature of the map's constructor, which names its type
+  uint64_t hits;       // Lookups satisfied by the cache
+  uint64_t misses;     // Lookups that fell through to the hash table
+};
+
+namespace bytesflops {
+  extern void bf_register_cachemap_stats(CacheMapStats* stats);
+  extern void bf_unregister_cachemap_stats(CacheMapStats* stats);
+}
+
+// Wrap a flat hash table with a small set-associative cache of
+// recently found key:value pairs.  We expect to have many hits to the
+// same few keys.  A key's set is chosen by its hash.  Within a set,
+// a hit swaps the entry with its predecessor, and a miss inserts the
+// entry at the front, evicting the entry at the back.
 template<class Key,
          class T,
          class Hash = std::hash<Key>,
          class KeyEqual = std::equal_to<Key>,
-         class Allocator = std::allocator< std::pair<const Key, T> > >
+         size_t cache_sets = 2,
+         size_t cache_ways = 4>
 class CachedUnorderedMap {
+  static_assert(cache_sets > 0 && (cache_sets&(cache_sets - 1)) == 0,
+                "cache_sets must be a power of two");
+  static_assert(cache_ways > 0, "cache_ways must be positive");
+
 private:
-  typedef unordered_map<Key, T, Hash, KeyEqual, Allocator> umap_type;
-  static const size_t cache_size = 1;  // Number of previous entries to cache
-  Key prev_key[cache_size];            // Keys previously searched for
-  typename umap_type::iterator prev_iter[cache_size];   // Iterators previously returned
-  KeyEqual compare_keys;               // Functor for comparing two keys for equality
-  umap_type* the_map;                  // The underlying unordered_map
+  typedef FlatHashMap<Key, T, Hash, KeyEqual> fmap_type;
+  typedef struct {
+    Key key;                                // Key previously searched for
+    typename fmap_type::iterator iter;      // Iterator previously returned
+  } cache_entry_t;
+  cache_entry_t cache[cache_sets][cache_ways];  // Cached key:iterator pairs
+  size_t cache_fill[cache_sets];            // Number of valid entries in each set
+  size_t map_generation;                    // Hash-table generation the cache reflects
+#ifdef BYFL_CACHEMAP_STATS
+  CacheMapStats stats;                      // Cache hit and miss counts
+#endif
+  Hash hash_key;                            // Functor for hashing a key
+  KeyEqual compare_keys;                    // Functor for comparing two keys for equality
+  fmap_type* the_map;                       // The underlying hash table
+
+  // Disallow copying.
+  CachedUnorderedMap(const CachedUnorderedMap&);
+  CachedUnorderedMap& operator=(const CachedUnorderedMap&);
+
+  // Return the cache set to which a key belongs.
+  size_t cache_set(const Key& key) {
+    if (cache_sets == 1)
+      return 0;
+    size_t hash = hash_key(key);
+    return (hash ^ (hash >> 4) ^ (hash >> 13)) & (cache_sets - 1);
+  }
+
+  // Empty every cache set.
+  void clear_cache() {
+    for (size_t s = 0; s < cache_sets; s++)
+      cache_fill[s] = 0;
+    map_generation = the_map->generation();
+  }
 
 public:
-  // The constructor sets prev_key and prev_value to (hopefully) bogus values.
+  // The constructor empties the cache and registers its statistics.
   CachedUnorderedMap() {
-    the_map = new umap_type();
-    for (size_t i=0; i<cache_size; i++)
-      memset((void *)&prev_key[i], 0, sizeof(Key));
+    the_map = new fmap_type();
+    clear_cache();
+#ifdef BYFL_CACHEMAP_STATS
+    stats.label = __PRETTY_FUNCTION__;   // Works even without RTTI
+    stats.hits = 0;
+    stats.misses = 0;
+    bytesflops::bf_register_cachemap_stats(&stats);
+#endif
   }
 
-  // All iterator types and methods get delegated to unordered_map.
-  typedef typename umap_type::iterator iterator;
-  typedef typename umap_type::const_iterator const_iterator;
+  ~CachedUnorderedMap() {
+#ifdef BYFL_CACHEMAP_STATS
+    bytesflops::bf_unregister_cachemap_stats(&stats);
+#endif
+    delete the_map;
+  }
+
+  // All iterator types and methods get delegated to the hash table.
+  typedef typename fmap_type::iterator iterator;
+  typedef typename fmap_type::const_iterator const_iterator;
   iterator begin() { return the_map->begin(); }
   const_iterator begin() const { return the_map->begin(); }
   iterator end() { return the_map->end(); }
@@ -48,58 +113,51 @@ public:
   size_t size() const { return the_map->size(); }
 
   // The find() method first checks the cache then falls back to the
-  // unordered_map.
+  // hash table.
   iterator find (const Key& key) {
-    // Linear-search the cache.
-    for (size_t i=0; i<cache_size; i++) {
-      if (compare_keys(key, prev_key[i])) {
+    // Linear-search the key's cache set.
+    size_t s = cache_set(key);
+    cache_entry_t* set = cache[s];
+    for (size_t i = 0; i < cache_fill[s]; i++)
+      if (compare_keys(key, set[i].key)) {
         // Hit -- bubble up.
-        typename umap_type::iterator found_iter;
-        if (i > 0) {
-          Key temp_key = prev_key[i-1];
-          typename umap_type::iterator temp_iter = prev_iter[i-1];
-          prev_key[i-1] = prev_key[i];
-          prev_iter[i-1] = prev_iter[i];
-          prev_key[i] = temp_key;
-          prev_iter[i] = temp_iter;
-          found_iter = prev_iter[i-1];
-        }
-        else
-          found_iter = prev_iter[i];
-        return found_iter;
+#ifdef BYFL_CACHEMAP_STATS
+        stats.hits++;
+#endif
+        if (i == 0)
+          return set[0].iter;
+        swap(set[i - 1], set[i]);
+        return set[i - 1].iter;
       }
-    }
 
-    // The entry wasn't found in the cache -- search the unordered map.
+    // The entry wasn't found in the cache -- search the hash table.
+#ifdef BYFL_CACHEMAP_STATS
+    stats.misses++;
+#endif
     iterator iter = the_map->find(key);
     if (iter != end()) {
       // Cache only successful searches.
-      memcpy((void *)&prev_key[cache_size-1], &key, sizeof(Key));
-      prev_iter[cache_size-1] = iter;
+      size_t last = cache_fill[s] < cache_ways ? cache_fill[s]++ : cache_ways - 1;
+      for (size_t i = last; i > 0; i--)
+        set[i] = set[i - 1];
+      set[0].key = key;
+      set[0].iter = iter;
     }
     return iter;
   }
 
   // The erase() method erases the key:value pair from both the cache
-  // and the unordered_map.
+  // and the hash table.
   size_t erase (const Key& key) {
-    // Linear-search the cache.
-    for (size_t i=0; i<cache_size; i++) {
-      if (compare_keys(key, prev_key[i])) {
-        // Hit -- bubble up.
-        if (i > 0) {
-          Key temp_key = prev_key[i-1];
-          typename umap_type::iterator temp_iter = prev_iter[i-1];
-          prev_key[i-1] = prev_key[i];
-          prev_iter[i-1] = prev_iter[i];
-          prev_key[i] = temp_key;
-          prev_iter[i] = temp_iter;
-        }
+    size_t s = cache_set(key);
+    cache_entry_t* set = cache[s];
+    for (size_t i = 0; i < cache_fill[s]; i++)
+      if (compare_keys(key, set[i].key)) {
+        for (size_t j = i + 1; j < cache_fill[s]; j++)
+          set[j - 1] = set[j];
+        cache_fill[s]--;
         break;
       }
-    }
-
-    // Remove the key:value pair from the unordered map.
     return the_map->erase(key);
   }
 
@@ -107,8 +165,11 @@ public:
   T& operator[] (const Key& key) {
     iterator iter = find(key);
     if (iter == end()) {
-      // Not found -- create a new value then try again.
+      // Not found -- create a new value then try again.  If doing so
+      // moved the other key:value pairs, empty the cache first.
       (void) (*the_map)[key];
+      if (the_map->generation() != map_generation)
+        clear_cache();
       return (*this)[key];
     }
     else
@@ -0,0 +1,159 @@
+/*
+ * Helper library for computing bytes:flops ratios
+ * (reconstructing counters from edge profiles)
+ *
+ * By Scott Pakin <pakin@lanl.gov>
+ */
+
+#include "byfl.h"
+
+namespace bytesflops {}
+using namespace bytesflops;
+using namespace std;
+
+// Describe a single function's edge profile.
+typedef struct {
+  const char* funcname;     // Name of the function
+  const uint64_t* cfg;      // Static description of the function's control-flow graph
+  const uint64_t* counters; // Execution counts of a subset of the function's edges
+} edge_profile_t;
+
+// Keep track of all registered edge profiles, being careful to work
+// around the "C++ static initialization order fiasco" (cf. the C++
+// FAQ).
+static vector<edge_profile_t>& edge_profiles (void)
+{
+  static vector<edge_profile_t>* profiles = new vector<edge_profile_t>();
+  return *profiles;
+}
+
+namespace bytesflops {
+
+extern ostream* bfout;
+
+// Register a function's edge profile.  This is invoked by a
+// constructor in every module compiled with -bf-edge-profile.
+void bf_register_edge_profile (const char* funcname, const uint64_t* cfg,
+                               uint64_t* counters)
+{
+  edge_profile_t profile;
+  profile.funcname = funcname;
+  profile.cfg = cfg;
+  profile.counters = counters;
+  edge_profiles().push_back(profile);
+}
+
+
+// Given a function's control-flow graph and the execution counts of
+// the edges not on its spanning tree, use flow conservation (inflow
+// equals outflow at every node) to compute the execution count of
+// every basic block.  A negative count means that the counts are
+// inconsistent with the control-flow graph (e.g., because the function
+// was still active at exit).  We warn about every such basic block and
+// treat it as never having executed.
+static void compute_block_counts (const char* funcname,
+                                  const uint64_t* cfg, const uint64_t* counters,
+                                  vector<uint64_t>& block_counts)
+{
+  // Parse the control-flow graph.
+  uint64_t num_blocks = cfg[0];
+  uint64_t num_edges = cfg[1];
+  const uint64_t* edges = cfg + 2 + num_blocks*BF_EDGE_NUM_COLS;
+
+  // Associate each node with its incident edges, and assign counts
+  // to the edges we know.
+  vector<int64_t> edge_counts(num_edges, 0);
+  vector<bool> known(num_edges, false);
+  vector< vector<uint64_t> > incident(num_blocks + 1);
+  for (uint64_t e = 0; e < num_edges; e++) {
+    uint64_t source = edges[e*3];
+    uint64_t target = edges[e*3 + 1];
+    uint64_t counter = edges[e*3 + 2];
+    if (counter != BF_EDGE_NO_COUNTER) {
+      edge_counts[e] = int64_t(counters[counter]);
+      known[e] = true;
+    }
+    incident[source].push_back(e);
+    if (target != source)
+      incident[target].push_back(e);
+  }
+
+  // Repeatedly find a node with exactly one edge of unknown count and
+  // solve for that edge.
+  bool progress = true;
+  while (progress) {
+    progress = false;
+    for (uint64_t node = 0; node <= num_blocks; node++) {
+      int64_t net_inflow = 0;     // Known inflow minus known outflow
+      uint64_t unknown_edge = 0;  // Edge whose count we don't know
+      size_t num_unknown = 0;     // Number of edges whose count we don't know
+      vector<uint64_t>& node_edges = incident[node];
+      for (vector<uint64_t>::iterator e_iter = node_edges.begin();
+           e_iter != node_edges.end();
+           e_iter++) {
+        uint64_t e = *e_iter;
+        if (!known[e]) {
+          unknown_edge = e;
+          num_unknown++;
+          continue;
+        }
+        if (edges[e*3 + 1] == node)
+          net_inflow += edge_counts[e];
+        if (edges[e*3] == node)
+          net_inflow -= edge_counts[e];
+      }
+      if (num_unknown != 1)
+        continue;
+      edge_counts[unknown_edge] = edges[unknown_edge*3 + 1] == node ? -net_inflow : net_inflow;
+      known[unknown_edge] = true;
+      progress = true;
+    }
+  }
+
+  // A basic block's execution count is the sum of its outgoing edges'
+  // execution counts.
+  vector<int64_t> signed_counts(num_blocks, 0);
+  for (uint64_t e = 0; e < num_edges; e++) {
+    uint64_t source = edges[e*3];
+    if (known[e] && source < num_blocks)
+      signed_counts[source] += edge_counts[e];
+  }
+  block_counts.assign(num_blocks, 0);
+  for (uint64_t b = 0; b < num_blocks; b++)
+    if (signed_counts[b] < 0)
+      *bfout << bf_output_prefix
+             << "BYFL_WARNING: Edge counts for " << funcname
+             << " imply that basic block " << b << " executed "
+             << signed_counts[b] << " times; ignoring that block"
+             << " (was the function still active at exit?)\n";
+    else
+      block_counts[b] = uint64_t(signed_counts[b]);
+}
+
+
+// Reconstruct the dynamic tallies of every function that was
+// instrumented with -bf-edge-profile.
+void bf_get_edge_profile_totals (vector<bf_edge_totals_t>& func_totals)
+{
+  vector<edge_profile_t>& profiles = edge_profiles();
+  for (vector<edge_profile_t>::iterator prof_iter = profiles.begin();
+       prof_iter != profiles.end();
+       prof_iter++) {
+    // Compute the number of times each basic block executed.
+    const uint64_t* cfg = prof_iter->cfg;
+    uint64_t num_blocks = cfg[0];
+    vector<uint64_t> block_counts;
+    compute_block_counts(prof_iter->funcname, cfg, prof_iter->counters, block_counts);
+
+    // Multiply each basic block's static tallies by its execution
+    // count, and sum the results.
+    vector<uint64_t> totals(BF_EDGE_NUM_COLS, 0);
+    const uint64_t* block_tallies = cfg + 2;
+    for (uint64_t b = 0; b < num_blocks; b++)
+      for (size_t c = 0; c < BF_EDGE_NUM_COLS; c++)
+        totals[c] += block_counts[b]*block_tallies[b*BF_EDGE_NUM_COLS + c];
+    func_totals.push_back(bf_edge_totals_t(prof_iter->funcname, totals));
+  }
+}
+
+} // namespace bytesflops
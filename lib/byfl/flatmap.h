@@ -0,0 +1,280 @@
+/*
+ * Helper library for computing bytes:flops ratios
+ * (open-addressing hash table class definition)
+ *
+ * By Scott Pakin <pakin@lanl.gov>
+ */
+
+#ifndef _FLATMAP_H_
+#define _FLATMAP_H_
+
+#include <functional>
+#include <new>
+#include <stdint.h>
+#include <string.h>
+#include <utility>
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
+using namespace std;
+
+// Map keys to values using open addressing with all key:value pairs
+// stored in a single flat array (cf. Google's "Swiss tables").  A
+// parallel array holds one control byte per slot: either a marker for
+// an empty or erased slot or the low 7 bits of the hash of the key in
+// the slot.  Lookups compare a group of 16 control bytes at once
+// (using SSE2 when available) and touch a slot only when its control
+// byte matches.  Erased slots become tombstones, so erasing never
+// invalidates iterators, but inserting may (see generation()).
+template<class Key,
+         class T,
+         class Hash = std::hash<Key>,
+         class KeyEqual = std::equal_to<Key> >
+class FlatHashMap {
+public:
+  typedef pair<Key, T> value_type;
+
+private:
+  static const int8_t ctrl_empty = -128;  // Slot has never held a key
+  static const int8_t ctrl_deleted = -2;  // Slot held a key that was erased
+  static const size_t group_width = 16;   // Number of control bytes examined at once
+  static const size_t min_capacity = 16;  // Initial number of slots
+
+  int8_t* ctrl;             // One control byte per slot plus group_width-1 copies of the first few
+  value_type* slots;        // Key:value pairs
+  size_t capacity;          // Number of slots (a power of two)
+  size_t num_full;          // Number of slots holding a key:value pair
+  size_t growth_left;       // Number of empty slots we can fill before rehashing
+  size_t num_rehashes;      // Number of times all key:value pairs have moved
+  Hash hash_key;            // Functor for hashing a key
+  KeyEqual compare_keys;    // Functor for comparing two keys for equality
+
+  // Disallow copying.
+  FlatHashMap(const FlatHashMap&);
+  FlatHashMap& operator=(const FlatHashMap&);
+
+  // Scramble a hash value so that every bit depends on every input
+  // bit.  std::hash is the identity function on integers and
+  // pointers, and page numbers and interned pointers differ mostly in
+  // their middle bits, but we store the low 7 bits in the control
+  // bytes and index slots with the bits just above those.
+  static uint64_t mix_hash(uint64_t hash) {
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+  }
+
+  // Return a bit mask of the control bytes in a group that equal a
+  // given value.
+  static uint32_t match_byte(const int8_t* group, int8_t value) {
+#ifdef __SSE2__
+    __m128i ctrl_bytes = _mm_loadu_si128((const __m128i*) group);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl_bytes, _mm_set1_epi8(value)));
+#else
+    uint32_t mask = 0;
+    for (size_t i = 0; i < group_width; i++)
+      mask |= uint32_t(group[i] == value) << i;
+    return mask;
+#endif
+  }
+
+  // Return a bit mask of the control bytes in a group that represent
+  // empty or erased slots.
+  static uint32_t match_free(const int8_t* group) {
+#ifdef __SSE2__
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i*) group));
+#else
+    uint32_t mask = 0;
+    for (size_t i = 0; i < group_width; i++)
+      mask |= uint32_t(group[i] < 0) << i;
+    return mask;
+#endif
+  }
+
+  // Set a slot's control byte and, for the first group_width-1 slots,
+  // its copy past the end of the array.
+  void set_ctrl(size_t slot, int8_t value) {
+    ctrl[slot] = value;
+    ctrl[((slot - (group_width - 1)) & (capacity - 1)) + (group_width - 1)] = value;
+  }
+
+  // Allocate empty control and slot arrays of a given capacity.
+  void allocate(size_t new_capacity) {
+    capacity = new_capacity;
+    ctrl = new int8_t[capacity + group_width - 1];
+    memset((void *)ctrl, ctrl_empty, capacity + group_width - 1);
+    slots = static_cast<value_type*>(::operator new(capacity*sizeof(value_type)));
+    num_full = 0;
+    growth_left = capacity - capacity/8;
+  }
+
+  // Return the slot holding a given key, or capacity if the key is
+  // not present.
+  size_t find_slot(const Key& key, uint64_t hash) const {
+    int8_t h2 = int8_t(hash & 0x7f);
+    size_t offset = size_t(hash >> 7) & (capacity - 1);
+    for (size_t step = group_width; ; step += group_width) {
+      const int8_t* group = ctrl + offset;
+      for (uint32_t mask = match_byte(group, h2); mask != 0; mask &= mask - 1) {
+        size_t slot = (offset + __builtin_ctz(mask)) & (capacity - 1);
+        if (compare_keys(slots[slot].first, key))
+          return slot;
+      }
+      if (match_byte(group, ctrl_empty) != 0)
+        return capacity;
+      offset = (offset + step) & (capacity - 1);
+    }
+  }
+
+  // Return the first empty or erased slot in a given hash's probe
+  // sequence.
+  size_t find_free_slot(uint64_t hash) const {
+    size_t offset = size_t(hash >> 7) & (capacity - 1);
+    for (size_t step = group_width; ; step += group_width) {
+      uint32_t mask = match_free(ctrl + offset);
+      if (mask != 0)
+        return (offset + __builtin_ctz(mask)) & (capacity - 1);
+      offset = (offset + step) & (capacity - 1);
+    }
+  }
+
+  // Move all key:value pairs into new arrays, doubling the capacity
+  // unless most of the used slots are merely tombstones.
+  void rehash() {
+    num_rehashes++;
+    int8_t* old_ctrl = ctrl;
+    value_type* old_slots = slots;
+    size_t old_capacity = capacity;
+    allocate(num_full*2 < old_capacity - old_capacity/8 ? old_capacity : old_capacity*2);
+    for (size_t i = 0; i < old_capacity; i++)
+      if (old_ctrl[i] >= 0) {
+        uint64_t hash = mix_hash(hash_key(old_slots[i].first));
+        size_t slot = find_free_slot(hash);
+        set_ctrl(slot, int8_t(hash & 0x7f));
+        new (&slots[slot]) value_type(old_slots[i]);
+        old_slots[i].~value_type();
+        num_full++;
+        growth_left--;
+      }
+    delete[] old_ctrl;
+    ::operator delete(old_slots);
+  }
+
+  // Destroy all key:value pairs and free both arrays.
+  void deallocate() {
+    for (size_t i = 0; i < capacity; i++)
+      if (ctrl[i] >= 0)
+        slots[i].~value_type();
+    delete[] ctrl;
+    ::operator delete(slots);
+  }
+
+public:
+  // Define an iterator that visits every full slot in order.
+  template<class MapType, class ValueType>
+  class slot_iterator {
+  private:
+    MapType* map;     // Map being iterated over
+    size_t slot;      // Current slot
+
+    friend class FlatHashMap;
+
+    // Advance to the first full slot at or after the current slot.
+    void skip_free() {
+      while (slot < map->capacity && map->ctrl[slot] < 0)
+        slot++;
+    }
+
+  public:
+    slot_iterator() : map(NULL), slot(0) {}
+    slot_iterator(MapType* the_map, size_t first_slot) : map(the_map), slot(first_slot) {}
+
+    // Allow conversion from a mutable to a const iterator.
+    template<class OtherMap, class OtherValue>
+    slot_iterator(const slot_iterator<OtherMap, OtherValue>& other)
+      : map(other.get_map()), slot(other.get_slot()) {}
+
+    MapType* get_map() const { return map; }
+    size_t get_slot() const { return slot; }
+    ValueType& operator*() const { return map->slots[slot]; }
+    ValueType* operator->() const { return &map->slots[slot]; }
+    slot_iterator& operator++() { slot++; skip_free(); return *this; }
+    slot_iterator operator++(int) { slot_iterator prev = *this; ++*this; return prev; }
+    bool operator==(const slot_iterator& other) const { return slot == other.slot; }
+    bool operator!=(const slot_iterator& other) const { return slot != other.slot; }
+  };
+  typedef slot_iterator<FlatHashMap, value_type> iterator;
+  typedef slot_iterator<const FlatHashMap, const value_type> const_iterator;
+
+  FlatHashMap() {
+    allocate(min_capacity);
+    num_rehashes = 0;
+  }
+
+  ~FlatHashMap() {
+    deallocate();
+  }
+
+  iterator begin() {
+    iterator iter(this, 0);
+    iter.skip_free();
+    return iter;
+  }
+  const_iterator begin() const {
+    const_iterator iter(this, 0);
+    iter.skip_free();
+    return iter;
+  }
+  iterator end() { return iterator(this, capacity); }
+  const_iterator end() const { return const_iterator(this, capacity); }
+
+  size_t size() const { return num_full; }
+
+  // Return a value that changes whenever inserting a key moves the
+  // other key:value pairs, invalidating all iterators.
+  size_t generation() const { return num_rehashes; }
+
+  // Return an iterator for a given key or end() if the key isn't found.
+  iterator find(const Key& key) {
+    return iterator(this, find_slot(key, mix_hash(hash_key(key))));
+  }
+
+  // Return a reference to a given key's value, inserting a
+  // value-initialized value if the key isn't found.  Inserting
+  // invalidates all iterators.
+  T& operator[](const Key& key) {
+    uint64_t hash = mix_hash(hash_key(key));
+    size_t slot = find_slot(key, hash);
+    if (slot != capacity)
+      return slots[slot].second;
+    slot = find_free_slot(hash);
+    if (growth_left == 0 && ctrl[slot] == ctrl_empty) {
+      rehash();
+      slot = find_free_slot(hash);
+    }
+    if (ctrl[slot] == ctrl_empty)
+      growth_left--;
+    set_ctrl(slot, int8_t(hash & 0x7f));
+    new (&slots[slot]) value_type(key, T());
+    num_full++;
+    return slots[slot].second;
+  }
+
+  // Erase a given key and return the number of key:value pairs erased
+  // (0 or 1).
+  size_t erase(const Key& key) {
+    size_t slot = find_slot(key, mix_hash(hash_key(key)));
+    if (slot == capacity)
+      return 0;
+    slots[slot].~value_type();
+    set_ctrl(slot, ctrl_deleted);
+    num_full--;
+    return 1;
+  }
+};
+
+#endif
@@ -6,6 +6,8 @@
  */
 
 #include "byfl.h"
+#include "arena.h"
+#include <cmath>
 
 namespace bytesflops {}
 using namespace bytesflops;
@@ -14,8 +16,9 @@ using namespace std;
 
 namespace bytesflops {
 
+extern ostream* bfout;
+
 typedef CachedUnorderedMap<uint64_t, uint64_t> addr_to_time_t;
-addr_to_time_t last_access;   // Last access time of a given address
 
 // An RDnode is one node in a reuse-distance tree.
 class RDnode {
@@ -53,8 +56,10 @@ public:
   RDnode* remove(uint64_t timestamp, RDnode** removed_node);
 
   // Remove all timestamps less than a given value from the tree and
-  // from a given histogram, and return the new tree.
-  RDnode* prune_tree(uint64_t timestamp, addr_to_time_t* histogram);
+  // from a given histogram, return the removed nodes to a given arena,
+  // and return the new tree.
+  RDnode* prune_tree(uint64_t timestamp, addr_to_time_t* histogram,
+                     SlabArena<RDnode>* arena);
 
   // Return the number of nodes in a splay tree whose timestamp is
   // larger than a given value.
@@ -186,9 +191,13 @@ RDnode* RDnode::splay(uint64_t target)
   node->left = new_node.right;
   node->right = new_node.left;
 
-  // Fix weights up to the node from its previous position.
-  node->left->fix_path_weights(node->time);
-  node->right->fix_path_weights(node->time);
+  // Fix weights up to the node from its previous position.  (Don't
+  // call methods on a NULL child; optimizing compilers assume that
+  // "this" is never NULL.)
+  if (node->left != NULL)
+    node->left->fix_path_weights(node->time);
+  if (node->right != NULL)
+    node->right->fix_path_weights(node->time);
   return node;
 }
 
@@ -256,7 +265,8 @@ RDnode* RDnode::remove(uint64_t target, RDnode** removed_node)
 // Remove all timestamps less than a given value from the tree and
 // from a given histogram, and return the new tree and new set of
 // symbols.
-RDnode* RDnode::prune_tree(uint64_t timestamp, addr_to_time_t* histogram)
+RDnode* RDnode::prune_tree(uint64_t timestamp, addr_to_time_t* histogram,
+                           SlabArena<RDnode>* arena)
 {
   RDnode* new_tree = splay(0);
   while (new_tree && new_tree->time < timestamp) {
@@ -265,7 +275,7 @@ RDnode* RDnode::prune_tree(uint64_t timestamp, addr_to_time_t* histogram)
     if (new_tree->left)
       new_tree = new_tree->splay(0);
     histogram->erase(dead_node->address);
-    delete dead_node;
+    arena->destroy(dead_node);
   }
   return new_tree;
 }
@@ -345,42 +355,282 @@ RDnode::RDnode(uint64_t address, uint64_t time)
 // Define infinite distance.
 const uint64_t infinite_distance = ~(uint64_t)0;
 
+// Define log2(bf_reuse_dist_gran).
+static uint64_t gran_shift = 0;
+
+
+// A ReuseHistogram tallies reuse distances in buckets of bounded
+// relative error, in the style of an HDR histogram.  Distances below
+// 2^exact_bits get a bucket apiece.  Larger distances are binned by
+// their exact_bits most significant bits, so each power-of-two range
+// of distances gets 2^(exact_bits-1) buckets and the relative error
+// is at most 2^(1-exact_bits).  The number of buckets therefore
+// depends only on the magnitude of the largest distance observed.
+class ReuseHistogram {
+private:
+  static const uint64_t exact_bits = 10;   // log2 of the number of exact buckets
+  static const uint64_t half_buckets = 1ULL << (exact_bits - 1);  // Buckets per power of two
+  vector<uint64_t> tallies;   // Tally of each bucket
+  uint64_t total;             // Sum of all tallies
+  uint64_t max_value;         // Largest value observed
+
+  // Map a value to its bucket.
+  static size_t bucket_of(uint64_t value) {
+    if (value < 2*half_buckets)
+      return value;
+    uint64_t shift = 64 - __builtin_clzll(value) - exact_bits;
+    return 2*half_buckets + (shift - 1)*half_buckets + ((value >> shift) - half_buckets);
+  }
+
+public:
+  ReuseHistogram() {
+    total = 0;
+    max_value = 0;
+  }
+
+  // Add a tally to the bucket containing a given value.
+  void add(uint64_t value, uint64_t tally) {
+    size_t bucket = bucket_of(value);
+    if (bucket >= tallies.size())
+      tallies.resize(bucket + 1, 0);
+    tallies[bucket] += tally;
+    total += tally;
+    if (value > max_value)
+      max_value = value;
+  }
+
+  // Return the number of buckets allocated.
+  size_t num_buckets() const { return tallies.size(); }
+
+  // Return a given bucket's tally.
+  uint64_t bucket_tally(size_t bucket) const { return tallies[bucket]; }
+
+  // Return the smallest value that maps to a given bucket.
+  static uint64_t bucket_low(size_t bucket) {
+    if (bucket < 2*half_buckets)
+      return bucket;
+    uint64_t offset = bucket - 2*half_buckets;
+    uint64_t shift = offset/half_buckets + 1;
+    return (offset%half_buckets + half_buckets) << shift;
+  }
+
+  // Return the sum of all tallies.
+  uint64_t total_tally() const { return total; }
+
+  // Return one more than the largest value observed (0 if none).
+  uint64_t span() const { return total == 0 ? 0 : max_value + 1; }
+};
+
 
 // A ReuseDistance encapsulates all the state needed for a
-// reuse-distance calculation.
+// reuse-distance calculation.  Subclasses implement different
+// algorithms for finding the distance.
 class ReuseDistance {
 private:
+  uint64_t sample_period;   // Process only addresses whose hash is a multiple of this
+  uint64_t sampled_addrs;   // Number of distinct addresses actually processed
+
+  // Return true if an address belongs to the current sample.
+  bool is_sampled(uint64_t address);
+
+  // Double the sample period until no more than bf_reuse_sample_max
+  // addresses are tracked.
+  void reduce_sample();
+
+  // Return the sum of all histogram tallies.
+  uint64_t total_tally();
+
+  // Return the first distance at which the cumulative tally exceeds a
+  // given fraction of the total tally.
+  uint64_t find_quantile(double fraction);
+
+protected:
   uint64_t clock;           // Current time
-  vector<uint64_t> hist;    // Histogram of the number of times each reuse distance was observed
+  ReuseHistogram hist;      // Histogram of the number of times each reuse distance was observed
   uint64_t unique_entries;  // Number of unique addresses (infinite reuse distance)
-  RDnode* dist_tree;            // Tree of reuse distances
+
+  // Record an access to an address at the current time, and return
+  // the number of unique addresses accessed since its previous access
+  // (infinite_distance if none).
+  virtual uint64_t update_distance(uint64_t address) = 0;
+
+  // Return the number of addresses currently being tracked.
+  virtual uint64_t num_tracked() = 0;
+
+  // Append every address currently being tracked to a vector.
+  virtual void get_tracked(vector<uint64_t>& addresses) = 0;
+
+  // Stop tracking an address, if it's being tracked.
+  virtual void forget(uint64_t address) = 0;
 
 public:
   // Initialize our various fields.
   ReuseDistance() {
     clock = 0;
     unique_entries = 0;
-    dist_tree = NULL;
+    sample_period = bf_reuse_sample;
+    sampled_addrs = 0;
   }
 
+  virtual ~ReuseDistance() {}
+
   // Incorporate a new address into the reuse-distance histogram.
   void process_address(uint64_t address);
 
-  // Return a pointer to the reuse-distance histogram.
-  vector<uint64_t>* get_histogram() { return &hist; }
+  // Incorporate each unit of bf_reuse_dist_gran bytes touched by a
+  // range of addresses into the reuse-distance histogram.
+  void process_range(uint64_t baseaddr, uint64_t numaddrs);
 
   // Return the number of unique addresses.
   uint64_t get_unique_addrs() { return unique_entries; }
 
   // Compute the median reuse distance.
   void compute_median(uint64_t* median_value, uint64_t* mad_value);
+
+  // Compute an approximate 95% confidence interval for the median
+  // reuse distance.
+  void compute_median_bounds(uint64_t* lower, uint64_t* upper);
+
+  // Compute the fraction of accesses that would miss in a fully
+  // associative LRU cache of each of a set of capacities, given in
+  // ascending order.
+  void compute_miss_ratios(const vector<uint64_t>& capacities, vector<double>& miss_ratios);
+
+  // Return the current sample period.
+  uint64_t get_sample_period() { return sample_period; }
+};
+
+
+// A SplayReuseDistance computes reuse distance using a splay tree
+// containing one node per address.
+class SplayReuseDistance : public ReuseDistance {
+private:
+  addr_to_time_t last_access;   // Last access time of a given address
+  RDnode* dist_tree;            // Tree of reuse distances
+  SlabArena<RDnode> node_arena; // Storage for all nodes in the above
+
+protected:
+  uint64_t update_distance(uint64_t address);
+  uint64_t num_tracked() { return last_access.size(); }
+  void get_tracked(vector<uint64_t>& addresses);
+  void forget(uint64_t address);
+
+public:
+  SplayReuseDistance() {
+    dist_tree = NULL;
+  }
+};
+
+
+// A FenwickReuseDistance computes reuse distance using a Fenwick
+// (binary indexed) tree containing a 1 for each timestamp that is
+// some address's most recent access and a 0 for each timestamp that
+// is not (cf. Bennett and Kruskal, "LRU Stack Processing", IBM
+// Journal of Research and Development 19(4), 1975).  Timestamps are
+// mapped to tree slots, which are renumbered densely whenever the
+// tree fills.
+class FenwickReuseDistance : public ReuseDistance {
+private:
+  addr_to_time_t last_slot;     // Tree slot of a given address's last access
+  vector<uint64_t> tree;        // Fenwick tree of last-access indicators
+  vector<uint64_t> slot_addr;   // Address accessed in each slot
+  vector<uint64_t> slot_time;   // Time of the access in each slot
+  uint64_t next_slot;           // Slot to assign to the next access
+  uint64_t oldest_slot;         // Oldest slot that has not been pruned
+  uint64_t live_entries;        // Number of 1s in the tree
+  static const uint64_t min_slots = 65536;   // Minimum tree size
+
+  // Add a value to a given tree slot.
+  void add(uint64_t slot, int64_t delta);
+
+  // Return the sum of all tree slots up to and including a given one.
+  uint64_t prefix_sum(uint64_t slot);
+
+  // Return true if a slot holds its address's most recent access.
+  bool is_live(uint64_t slot);
+
+  // Forget all addresses last accessed before a given time.
+  void prune(uint64_t timestamp);
+
+  // Renumber all live slots densely.
+  void compact();
+
+protected:
+  uint64_t update_distance(uint64_t address);
+  uint64_t num_tracked() { return last_slot.size(); }
+  void get_tracked(vector<uint64_t>& addresses);
+  void forget(uint64_t address);
+
+public:
+  FenwickReuseDistance() {
+    next_slot = 0;
+    oldest_slot = 0;
+    live_entries = 0;
+  }
 };
 
 
 // Incorporate a new address into the reuse-distance histogram.
+// Each sampled access stands for sample_period accesses.
 void ReuseDistance::process_address(uint64_t address)
 {
-  // Update the histogram.
+  uint64_t distance = update_distance(address);
+  if (distance == infinite_distance) {
+    // This is the first time we've seen this symbol.
+    unique_entries += sample_period;
+    sampled_addrs++;
+  }
+  else
+    // Scale the distance among sampled addresses to all addresses.
+    hist.add(distance*sample_period, sample_period);
+  clock++;
+
+  // If we're tracking too many addresses, sample fewer of them.
+  if (bf_reuse_sample_max > 0 && num_tracked() > bf_reuse_sample_max)
+    reduce_sample();
+}
+
+
+// Return true if an address belongs to the current sample.  As in
+// SHARDS (Waldspurger et al., "Efficient MRC Construction with
+// SHARDS", FAST 2015), an address is sampled based on a hash of the
+// address so that either all or none of its accesses are processed.
+// Because the sample period only ever doubles, every address sampled
+// at a given period was also sampled at all smaller periods.
+bool ReuseDistance::is_sampled(uint64_t address)
+{
+  if (sample_period == 1)
+    return true;
+  uint64_t hash = address;
+  hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+  hash ^= hash >> 31;
+  return hash%sample_period == 0;
+}
+
+
+// Double the sample period until no more than bf_reuse_sample_max
+// addresses are tracked.  Each doubling discards the addresses that
+// drop out of the sample.
+void ReuseDistance::reduce_sample()
+{
+  vector<uint64_t> addresses;
+  get_tracked(addresses);
+  while (num_tracked() > bf_reuse_sample_max) {
+    sample_period *= 2;
+    for (vector<uint64_t>::iterator addr_iter = addresses.begin();
+         addr_iter != addresses.end();
+         addr_iter++)
+      if (!is_sampled(*addr_iter))
+        forget(*addr_iter);
+  }
+}
+
+
+// Find the reuse distance of an address using the splay tree.
+uint64_t SplayReuseDistance::update_distance(uint64_t address)
+{
+  // Find the distance.
   uint64_t distance = infinite_distance;
   addr_to_time_t::iterator prev_time_iter = last_access.find(address);
   RDnode* new_node = NULL;
@@ -390,24 +640,10 @@ void ReuseDistance::process_address(uint64_t address)
     distance = dist_tree->tree_dist(prev_time);
     dist_tree = dist_tree->remove(prev_time, &new_node);
   }
-  uint64_t hist_len = hist.size();
-  if (distance < hist_len)
-    // We've previously seen both this symbol and this reuse distance.
-    hist[distance]++;
-  else {
-    if (distance == infinite_distance)
-      // This is the first time we've seen this symbol.
-      unique_entries++;
-    else {
-      // We've previously seen this symbol but not this reuse distance.
-      hist.resize(distance+1, 0);
-      hist[distance]++;
-    }
-  }
 
   // Update the tree and the map.
   if (new_node == NULL)
-    new_node = new RDnode(address, clock);
+    new_node = node_arena.create(address, clock);
   else
     new_node->initialize(address, clock);
   if (__builtin_expect(dist_tree == NULL, 0))
@@ -417,54 +653,211 @@ void ReuseDistance::process_address(uint64_t address)
     // All other tree insertions.
     dist_tree = dist_tree->insert(new_node);
   last_access[address] = clock;
-  clock++;
 
   // If the tree and the map have grown too large, prune old addresses
   // from them.
   if (last_access.size() > bf_max_reuse_distance)
-    dist_tree = dist_tree->prune_tree(clock - bf_max_reuse_distance, &last_access);
+    dist_tree = dist_tree->prune_tree(clock + 1 - bf_max_reuse_distance, &last_access,
+                                   &node_arena);
+  return distance;
+}
+
+
+// Append every address in the splay tree to a vector.
+void SplayReuseDistance::get_tracked(vector<uint64_t>& addresses)
+{
+  for (addr_to_time_t::iterator time_iter = last_access.begin();
+       time_iter != last_access.end();
+       time_iter++)
+    addresses.push_back(time_iter->first);
+}
+
+
+// Remove an address from the splay tree, if present.
+void SplayReuseDistance::forget(uint64_t address)
+{
+  addr_to_time_t::iterator time_iter = last_access.find(address);
+  if (time_iter == last_access.end())
+    return;
+  RDnode* dead_node;
+  dist_tree = dist_tree->remove(time_iter->second, &dead_node);
+  node_arena.destroy(dead_node);
+  last_access.erase(address);
+}
+
+
+// Add a value to a given slot in the Fenwick tree.
+void FenwickReuseDistance::add(uint64_t slot, int64_t delta)
+{
+  uint64_t num_slots = tree.size();
+  for (uint64_t i = slot + 1; i <= num_slots; i += i & -i)
+    tree[i - 1] += delta;
+}
+
+
+// Return the sum of all Fenwick-tree slots up to and including a
+// given one.
+uint64_t FenwickReuseDistance::prefix_sum(uint64_t slot)
+{
+  uint64_t sum = 0;
+  for (uint64_t i = slot + 1; i > 0; i -= i & -i)
+    sum += tree[i - 1];
+  return sum;
+}
+
+
+// Return true if a slot holds its address's most recent access.
+bool FenwickReuseDistance::is_live(uint64_t slot)
+{
+  addr_to_time_t::iterator slot_iter = last_slot.find(slot_addr[slot]);
+  return slot_iter != last_slot.end() && slot_iter->second == slot;
+}
+
+
+// Forget all addresses last accessed before a given time.
+void FenwickReuseDistance::prune(uint64_t timestamp)
+{
+  for (; oldest_slot < next_slot && slot_time[oldest_slot] < timestamp; oldest_slot++)
+    if (is_live(oldest_slot)) {
+      last_slot.erase(slot_addr[oldest_slot]);
+      add(oldest_slot, -1);
+      live_entries--;
+    }
+}
+
+
+// Renumber all live slots densely and size the tree to leave room for
+// at least as many accesses as there are live slots.
+void FenwickReuseDistance::compact()
+{
+  // Move all live slots to the beginning of the slot arrays.
+  uint64_t num_live = 0;
+  for (uint64_t slot = oldest_slot; slot < next_slot; slot++)
+    if (is_live(slot)) {
+      slot_addr[num_live] = slot_addr[slot];
+      slot_time[num_live] = slot_time[slot];
+      last_slot[slot_addr[num_live]] = num_live;
+      num_live++;
+    }
+
+  // Rebuild the tree in linear time.
+  uint64_t num_slots = max(2*num_live, uint64_t(min_slots));
+  tree.assign(num_slots, 0);
+  slot_addr.resize(num_slots);
+  slot_time.resize(num_slots);
+  for (uint64_t i = 0; i < num_live; i++)
+    tree[i] = 1;
+  for (uint64_t i = 1; i <= num_slots; i++) {
+    uint64_t parent = i + (i & -i);
+    if (parent <= num_slots)
+      tree[parent - 1] += tree[i - 1];
+  }
+  next_slot = num_live;
+  oldest_slot = 0;
+}
+
+
+// Append every address in the Fenwick tree to a vector.
+void FenwickReuseDistance::get_tracked(vector<uint64_t>& addresses)
+{
+  for (addr_to_time_t::iterator slot_iter = last_slot.begin();
+       slot_iter != last_slot.end();
+       slot_iter++)
+    addresses.push_back(slot_iter->first);
+}
+
+
+// Remove an address from the Fenwick tree, if present.
+void FenwickReuseDistance::forget(uint64_t address)
+{
+  addr_to_time_t::iterator slot_iter = last_slot.find(address);
+  if (slot_iter == last_slot.end())
+    return;
+  add(slot_iter->second, -1);
+  live_entries--;
+  last_slot.erase(address);
+}
+
+
+// Find the reuse distance of an address using the Fenwick tree.
+uint64_t FenwickReuseDistance::update_distance(uint64_t address)
+{
+  // Make room for the current access.
+  if (next_slot == tree.size())
+    compact();
+
+  // The distance is the number of live slots more recent than the
+  // address's previous slot.
+  uint64_t distance = infinite_distance;
+  addr_to_time_t::iterator prev_slot_iter = last_slot.find(address);
+  if (prev_slot_iter != last_slot.end()) {
+    uint64_t prev_slot = prev_slot_iter->second;
+    distance = live_entries - prefix_sum(prev_slot);
+    add(prev_slot, -1);
+    prev_slot_iter->second = next_slot;
+  }
+  else {
+    live_entries++;
+    last_slot[address] = next_slot;
+  }
+  slot_addr[next_slot] = address;
+  slot_time[next_slot] = clock;
+  add(next_slot, 1);
+  next_slot++;
+
+  // If too many addresses are live, prune old addresses exactly as
+  // SplayReuseDistance does.
+  if (live_entries > bf_max_reuse_distance)
+    prune(clock + 1 - bf_max_reuse_distance);
+  return distance;
+}
+
+
+// Incorporate each unit of bf_reuse_dist_gran bytes touched by a
+// range of addresses into the reuse-distance histogram.  Each unit is
+// identified by its address divided by the granularity.
+void ReuseDistance::process_range(uint64_t baseaddr, uint64_t numaddrs)
+{
+  if (numaddrs == 0)
+    return;
+  uint64_t first_unit = baseaddr >> gran_shift;
+  uint64_t last_unit = (baseaddr + numaddrs - 1) >> gran_shift;
+  for (uint64_t unit = first_unit; unit <= last_unit; unit++)
+    if (is_sampled(unit))
+      process_address(unit);
 }
 
 
 // Compute the median reuse distance and the median absolute
 // deviation of that.
 void ReuseDistance::compute_median(uint64_t* median_value, uint64_t* mad_value) {
-  // Find the total tally.
-  uint64_t hist_len = hist.size();   // Entries in the histogram
-  uint64_t total_tally;              // Total number of accesses including one-time accesses
-  total_tally = unique_entries - hist_len;
-  for (size_t dist = 0; dist < hist_len; dist++)
-    total_tally += hist[dist];
-
   // Find the distance that lies at half the total tally.
-  uint64_t median_distance = infinite_distance;
-  uint64_t median_tally = 0;
-  for (size_t dist = 0; dist < hist_len; dist++) {
-    median_distance = dist;
-    median_tally += hist[dist];
-    if (median_tally > total_tally/2)
-      break;
-  }
+  uint64_t total_tally = this->total_tally();   // Total number of accesses including one-time accesses
+  uint64_t median_distance = find_quantile(0.5);
 
   // Tally the absolute deviations.
-  vector<uint64_t> absdev(hist_len, 0);
-  for (size_t dist = 0; dist < hist_len; dist++) {
-    uint64_t tally = hist[dist];
+  ReuseHistogram absdev;
+  size_t num_buckets = hist.num_buckets();
+  for (size_t bucket = 0; bucket < num_buckets; bucket++) {
+    uint64_t dist = ReuseHistogram::bucket_low(bucket);
+    uint64_t tally = hist.bucket_tally(bucket);
+    if (tally == 0)
+      continue;
     uint64_t deviation;
     if (dist > median_distance)
       deviation = dist - median_distance;
     else
       deviation = median_distance - dist;
-    absdev[deviation] += tally;
+    absdev.add(deviation, tally);
   }
 
   // Find the deviation that lies at half the total tally.
   uint64_t mad = 0;
   uint64_t absdev_tally = 0;
-  uint64_t absdev_len = absdev.size();
-  for (size_t dev = 0; dev < absdev_len; dev++) {
-    mad = dev;
-    absdev_tally += absdev[dev];
+  size_t absdev_len = absdev.num_buckets();
+  for (size_t bucket = 0; bucket < absdev_len; bucket++) {
+    mad = ReuseHistogram::bucket_low(bucket);
+    absdev_tally += absdev.bucket_tally(bucket);
     if (absdev_tally > total_tally/2)
       break;
   }
@@ -475,39 +868,343 @@ void ReuseDistance::compute_median(uint64_t* median_value, uint64_t* mad_value)
 }
 
 
-// Keep track of the reuse distance of the program as a whole.
+// Compute the fraction of accesses that would miss in a fully
+// associative LRU cache of each of a set of capacities, given in
+// ascending order.  An access hits in a cache of capacity C if and
+// only if its reuse distance is less than C, so the entire curve can
+// be computed in a single pass over the histogram.
+void ReuseDistance::compute_miss_ratios(const vector<uint64_t>& capacities,
+                                        vector<double>& miss_ratios)
+{
+  // Accumulate hits up to each capacity in turn.
+  uint64_t total = unique_entries + hist.total_tally();
+  size_t num_buckets = hist.num_buckets();
+  miss_ratios.clear();
+  uint64_t hits = 0;
+  size_t bucket = 0;
+  for (vector<uint64_t>::const_iterator cap_iter = capacities.begin();
+       cap_iter != capacities.end();
+       cap_iter++) {
+    for (; bucket < num_buckets && ReuseHistogram::bucket_low(bucket) < *cap_iter; bucket++)
+      hits += hist.bucket_tally(bucket);
+    miss_ratios.push_back(total == 0 ? 0.0 : 1.0 - double(hits)/double(total));
+  }
+}
+
+
+// Return the sum of all histogram tallies.
+uint64_t ReuseDistance::total_tally()
+{
+  return unique_entries - hist.span() + hist.total_tally();
+}
+
+
+// Return the first distance at which the cumulative tally exceeds a
+// given fraction of the total tally.
+uint64_t ReuseDistance::find_quantile(double fraction)
+{
+  uint64_t target = uint64_t(fraction*total_tally());
+  size_t num_buckets = hist.num_buckets();
+  uint64_t distance = infinite_distance;
+  uint64_t tally = 0;
+  for (size_t bucket = 0; bucket < num_buckets; bucket++) {
+    distance = ReuseHistogram::bucket_low(bucket);
+    tally += hist.bucket_tally(bucket);
+    if (tally > target)
+      break;
+  }
+  return distance;
+}
+
+
+// Compute an approximate 95% confidence interval for the median reuse
+// distance.  Accesses to the same address are far from independent --
+// sampling keeps or drops all of them together, and each one's
+// distance depends on the last -- so we treat each distinct sampled
+// address, not each access, as one independent draw.  The interval
+// thus lies 1.96*sqrt(n)/2 ranks on either side of the median of n
+// addresses, or 0.98/sqrt(n) on either side of the 0.5 quantile.
+// This is still only approximate: distances of different addresses
+// are correlated, too, and an address evicted by bf_max_reuse_distance
+// is counted again when it returns.  When not sampling, the bounds
+// equal the median.
+void ReuseDistance::compute_median_bounds(uint64_t* lower, uint64_t* upper)
+{
+  double half_width = 0.0;
+  if (sample_period > 1 && sampled_addrs > 0)
+    half_width = 0.98/sqrt(double(sampled_addrs));
+  *lower = find_quantile(max(0.5 - half_width, 0.0));
+  *upper = find_quantile(min(0.5 + half_width, 1.0));
+}
+
+
+// Keep track of the reuse distance of the program as a whole, of its
+// loads and stores separately (if bf_reuse_dist_split), and of each
+// function (if bf_reuse_dist_by_func).
 static ReuseDistance* global_reuse_dist = NULL;
+static ReuseDistance* load_reuse_dist = NULL;
+static ReuseDistance* store_reuse_dist = NULL;
+typedef CachedUnorderedMap<const char*, ReuseDistance*> func_to_reuse_t;
+static func_to_reuse_t* function_reuse_dist = NULL;
+
+
+// Allocate a reuse-distance calculator of the type selected by
+// bf_reuse_engine.
+static ReuseDistance* new_reuse_distance (void)
+{
+  if (bf_reuse_engine == BF_REUSE_ENGINE_FENWICK)
+    return new FenwickReuseDistance();
+  else
+    return new SplayReuseDistance();
+}
 
 
 // Initialize some of our variables at first use.
 void initialize_reuse (void)
 {
-  global_reuse_dist = new ReuseDistance();
+  global_reuse_dist = new_reuse_distance();
+  if (bf_reuse_dist_split) {
+    load_reuse_dist = new_reuse_distance();
+    store_reuse_dist = new_reuse_distance();
+  }
+  if (bf_reuse_dist_by_func)
+    function_reuse_dist = new func_to_reuse_t();
+  gran_shift = __builtin_ctzll(bf_reuse_dist_gran);
+}
+
+
+// Return the reuse-distance calculator for a given reference stream.
+static ReuseDistance* stream_reuse_dist (bf_rd_stream_t stream)
+{
+  switch (stream) {
+    case BF_RD_LOADS:
+      return load_reuse_dist;
+
+    case BF_RD_STORES:
+      return store_reuse_dist;
+
+    default:
+      return global_reuse_dist;
+  }
+}
+
+
+// Process the reuse distance of a set of addresses relative to the
+// program as a whole and, if bf_reuse_dist_split, relative to either
+// the program's loads or its stores.
+static inline void reuse_dist_addrs_prog (uint64_t baseaddr, uint64_t numaddrs,
+                                          bool is_store)
+{
+  global_reuse_dist->process_range(baseaddr, numaddrs);
+  if (bf_reuse_dist_split)
+    (is_store ? store_reuse_dist : load_reuse_dist)->process_range(baseaddr, numaddrs);
 }
 
 
 // Process the reuse distance of a set of addresses relative to the
 // program as a whole.
-void bf_reuse_dist_addrs_prog (uint64_t baseaddr, uint64_t numaddrs)
+void bf_reuse_dist_addrs_prog (uint64_t baseaddr, uint64_t numaddrs, bool is_store)
 {
-  for (uint64_t ofs = 0; ofs < numaddrs; ofs++)
-    global_reuse_dist->process_address(baseaddr + ofs);
+  if (bf_thread_safe)
+    bf_acquire_mega_lock();
+  reuse_dist_addrs_prog(baseaddr, numaddrs, is_store);
+  if (bf_thread_safe)
+    bf_release_mega_lock();
 }
 
 
-// Return the reuse distance histogram and count of unique bytes for
-// the program as a whole.
-void bf_get_reuse_distance (vector<uint64_t>** hist, uint64_t* unique_addrs)
+// Process the reuse distance of the addresses in a batch of trace
+// records relative to the program as a whole.  The caller is
+// responsible for taking the mega-lock if necessary.
+void bf_reuse_dist_trace_prog (const uint64_t* trace, size_t num_records)
+{
+  for (size_t i = 0; i < num_records; i++) {
+    uint64_t info = trace[2*i + 1];
+    if ((info&BF_TRACE_REUSE_DIST) == 0)
+      continue;
+    reuse_dist_addrs_prog(trace[2*i], info&BF_TRACE_SIZE_MASK,
+                          (info&BF_TRACE_STORE) != 0);
+  }
+}
+
+
+// Process the reuse distance of a set of addresses relative to a
+// given function ID.
+void bf_reuse_dist_addrs_func (uint32_t funcid, uint64_t baseaddr, uint64_t numaddrs)
+{
+  // Keep track of the most recently used calculator.
+  static const char* prev_funcname = NULL;
+  static ReuseDistance* prev_reuse_dist = NULL;
+
+  // Find the given function's reuse-distance calculator, creating it
+  // if necessary.
+  if (bf_thread_safe)
+    bf_acquire_mega_lock();
+  const char* funcname = bf_call_stack ? bf_call_context_name() : bf_func_id_to_name(funcid);
+  if (funcname != prev_funcname) {
+    func_to_reuse_t::iterator map_iter = function_reuse_dist->find(funcname);
+    if (map_iter == function_reuse_dist->end())
+      // This is the first time we've seen this function.
+      (*function_reuse_dist)[funcname] = prev_reuse_dist = new_reuse_distance();
+    else
+      // We've seen this function before.
+      prev_reuse_dist = map_iter->second;
+    prev_funcname = funcname;
+  }
+  prev_reuse_dist->process_range(baseaddr, numaddrs);
+  if (bf_thread_safe)
+    bf_release_mega_lock();
+}
+
+
+// Return the count of unique addresses (in units of
+// bf_reuse_dist_gran bytes) for the program as a whole.  When
+// sampling, this is an estimate.
+void bf_get_reuse_distance (uint64_t* unique_addrs)
 {
-  *hist = global_reuse_dist->get_histogram();
   *unique_addrs = global_reuse_dist->get_unique_addrs();
 }
 
 
-// Compute the median reuse distance for the program as a whole.
-void bf_get_median_reuse_distance (uint64_t* median_value, uint64_t* mad_value)
+// Compute the median reuse distance for a given reference stream.
+void bf_get_median_reuse_distance (bf_rd_stream_t stream, uint64_t* median_value, uint64_t* mad_value)
+{
+  stream_reuse_dist(stream)->compute_median(median_value, mad_value);
+}
+
+
+// Parse bf_mrc_sizes into a sorted list of cache sizes in bytes.
+static void get_mrc_sizes (vector<uint64_t>& sizes)
+{
+  for (const char* size_str = bf_mrc_sizes; *size_str != '\0'; ) {
+    char* next_str;
+    sizes.push_back(strtoull(size_str, &next_str, 10));
+    size_str = *next_str == ',' ? next_str + 1 : next_str;
+  }
+  sort(sizes.begin(), sizes.end());
+}
+
+
+// Compute a reuse-distance calculator's miss ratio at each of a list
+// of cache sizes in bytes.
+static void get_miss_ratios (ReuseDistance* reuse_dist,
+                             const vector<uint64_t>& sizes,
+                             vector<double>& miss_ratios)
+{
+  // Convert each cache size from bytes to units of bf_reuse_dist_gran.
+  vector<uint64_t> capacities;
+  for (vector<uint64_t>::const_iterator size_iter = sizes.begin();
+       size_iter != sizes.end();
+       size_iter++)
+    capacities.push_back(*size_iter/bf_reuse_dist_gran);
+  reuse_dist->compute_miss_ratios(capacities, miss_ratios);
+}
+
+
+// Output the miss ratio of a fully associative LRU cache at each of
+// the sizes listed in bf_mrc_sizes.  If bf_reuse_dist_split, also
+// output the miss ratios of loads and of stores.
+void bf_report_miss_ratio_curve (void)
+{
+  // Compute all of the miss ratios.
+  vector<uint64_t> sizes;
+  get_mrc_sizes(sizes);
+  vector<double> miss_ratios;
+  vector<double> load_miss_ratios;
+  vector<double> store_miss_ratios;
+  get_miss_ratios(global_reuse_dist, sizes, miss_ratios);
+  if (bf_reuse_dist_split) {
+    get_miss_ratios(load_reuse_dist, sizes, load_miss_ratios);
+    get_miss_ratios(store_reuse_dist, sizes, store_miss_ratios);
+  }
+
+  // Output a header line followed by one line per cache size.
+  *bfout << bf_output_prefix
+         << "BYFL_MRC_HEADER: "
+         << setw(20) << "Cache_bytes" << ' '
+         << setw(20) << "Miss_ratio";
+  if (bf_reuse_dist_split)
+    *bfout << ' '
+           << setw(20) << "LD_miss_ratio" << ' '
+           << setw(20) << "ST_miss_ratio";
+  *bfout << '\n';
+  for (size_t i = 0; i < sizes.size(); i++) {
+    *bfout << bf_output_prefix
+           << "BYFL_MRC: "
+           << setw(27) << sizes[i] << ' '
+           << fixed << setw(20) << setprecision(6) << miss_ratios[i];
+    if (bf_reuse_dist_split)
+      *bfout << ' '
+             << setw(20) << load_miss_ratios[i] << ' '
+             << setw(20) << store_miss_ratios[i];
+    *bfout << '\n';
+  }
+}
+
+
+// Compare two strings.
+static bool compare_char_stars (const char* one, const char* two)
+{
+  return strcmp(one, two) < 0;
+}
+
+
+// Output each function's median reuse distance and, if bf_mrc_sizes
+// is nonempty, its miss ratio at each of the sizes listed there.
+void bf_report_reuse_by_function (void)
+{
+  // Output a header line.
+  vector<uint64_t> sizes;
+  get_mrc_sizes(sizes);
+  *bfout << bf_output_prefix
+         << "BYFL_FUNC_REUSE_HEADER: "
+         << setw(20) << "Median_RD" << ' '
+         << setw(20) << "MAD_RD";
+  for (vector<uint64_t>::iterator size_iter = sizes.begin();
+       size_iter != sizes.end();
+       size_iter++)
+    *bfout << ' ' << setw(20) << "Miss_ratio_" + to_string(*size_iter);
+  *bfout << ' '
+         << "Function\n";
+
+  // Output the data by sorted function name.
+  vector<const char*>* all_func_names = function_reuse_dist->sorted_keys(compare_char_stars);
+  for (vector<const char*>::iterator fn_iter = all_func_names->begin();
+       fn_iter != all_func_names->end();
+       fn_iter++) {
+    const char* funcname = *fn_iter;
+    ReuseDistance* reuse_dist = (*function_reuse_dist)[funcname];
+    uint64_t median_value;
+    uint64_t mad_value;
+    reuse_dist->compute_median(&median_value, &mad_value);
+    *bfout << bf_output_prefix
+           << "BYFL_FUNC_REUSE: ";
+    if (median_value == infinite_distance)
+      *bfout << setw(27) << "inf" << ' '
+             << setw(20) << "inf";
+    else
+      *bfout << setw(27) << median_value << ' '
+             << setw(20) << mad_value;
+    vector<double> miss_ratios;
+    get_miss_ratios(reuse_dist, sizes, miss_ratios);
+    for (vector<double>::iterator mr_iter = miss_ratios.begin();
+         mr_iter != miss_ratios.end();
+         mr_iter++)
+      *bfout << ' ' << fixed << setw(20) << setprecision(6) << *mr_iter;
+    *bfout << ' ' << funcname << '\n';
+  }
+  delete all_func_names;
+}
+
+
+// Compute an approximate 95% confidence interval for the median reuse
+// distance of a given reference stream, and return the period at
+// which addresses were sampled to compute it.
+void bf_get_median_reuse_bounds (bf_rd_stream_t stream, uint64_t* lower, uint64_t* upper, uint64_t* sample_period)
 {
-  global_reuse_dist->compute_median(median_value, mad_value);
+  ReuseDistance* reuse_dist = stream_reuse_dist(stream);
+  reuse_dist->compute_median_bounds(lower, upper);
+  *sample_period = reuse_dist->get_sample_period();
 }
 
 }
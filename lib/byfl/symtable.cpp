@@ -6,31 +6,137 @@
  */
 
 #include "byfl.h"
+#include "arena.h"
+#include "flatmap.h"
 
 using namespace std;
 
-// Say whether one string is strictly less than another.
-struct str_less_than
+#ifdef __ELF__
+// The linker brackets the pass's function-name strings with these
+// symbols (see BF_FNAME_SECTION).  Both are NULL if no such strings
+// were linked in.
+extern "C" {
+  extern const char __start_bf_fnames[] __attribute__((weak));
+  extern const char __stop_bf_fnames[] __attribute__((weak));
+}
+#endif
+
+// Pair a string with its precomputed hash value.
+struct symbol_key_t
+{
+  const char* str;   // NUL-terminated string
+  uint64_t hash;     // Hash of the string's contents
+
+  symbol_key_t() : str(NULL), hash(0) {}
+  symbol_key_t(const char* s, uint64_t h) : str(s), hash(h) {}
+};
+
+// Return a key's precomputed hash value.
+struct symbol_key_hash
+{
+  size_t operator()(const symbol_key_t& key) const {
+    return key.hash;
+  }
+};
+
+// Say whether two keys represent equal strings.
+struct symbol_key_equal
 {
-  bool operator()(const char* s1, const char* s2) const {
-    if (s1 == s2)
+  bool operator()(const symbol_key_t& k1, const symbol_key_t& k2) const {
+    if (k1.hash != k2.hash)
       return false;
-    return strcmp(s1, s2) < 0;
+    if (k1.str == k2.str)
+      return true;
+    return strcmp(k1.str, k2.str) == 0;
   }
 };
 
 namespace bytesflops {
 
-// Define a map from equal strings to equivalent strings.
-typedef map<const char*, const char*, str_less_than> symbol_table_t;
+// Define a map from string contents to unique strings.
+typedef FlatHashMap<symbol_key_t, const char*, symbol_key_hash, symbol_key_equal> symbol_table_t;
 static symbol_table_t* symbol_table = NULL;
 
+// Define a map from immutable strings (our own copies and the pass's
+// function names) to the unique string with the same contents.
+// Strings whose contents may change can't be looked up by address.
+typedef FlatHashMap<const char*, const char*> known_symbols_t;
+static known_symbols_t* known_symbols = NULL;
+
+// Store the contents of every unique string we create.
+static StringArena<>* symbol_storage = NULL;
+
+static pthread_mutex_t symbol_table_lock = PTHREAD_MUTEX_INITIALIZER;  // Lock protecting all of the above
+
+
+// Map each program-wide function ID to the function's name.  Names
+// are interned once the symbol table exists.  Modules usually
+// register their names from constructors, but a module loaded with
+// dlopen() registers its names while other threads may be looking up
+// names.  The table is therefore append-only: it grows by adding
+// chunks, each twice as large as the previous one, so a name never
+// moves once it's been stored.  Registration holds func_ids_lock and
+// publishes the new number of IDs with release semantics, and lookups
+// read that number with acquire semantics and need no lock.  All of
+// these variables are statically initialized to avoid the "C++ static
+// initialization order fiasco" (cf. the C++ FAQ).
+static const uint32_t first_chunk_bits = 10;                // log2 of the number of names in chunk 0
+static const size_t max_func_id_chunks = 32 - first_chunk_bits + 1;  // Enough chunks for 2^32 IDs
+static const char** func_id_chunks[max_func_id_chunks];    // Chunks of function names
+static uint32_t num_func_ids = 0;                           // Number of IDs assigned so far
+static pthread_mutex_t func_ids_lock = PTHREAD_MUTEX_INITIALIZER;  // Lock protecting registration
+
+// Return the chunk number and offset within the chunk of a given
+// function ID.  Chunk c holds (2^c)*(2^first_chunk_bits) names.
+static inline void locate_func_id (uint32_t funcid, size_t* chunk, size_t* offset)
+{
+  uint64_t scaled = (uint64_t(funcid) >> first_chunk_bits) + 1;
+  *chunk = 63 - __builtin_clzll(scaled);
+  *offset = funcid - (((uint64_t(1) << *chunk) - 1) << first_chunk_bits);
+}
+
 
 // Initialize some of our variables at first use.
 void initialize_symtable (void) {
+  pthread_mutex_lock(&func_ids_lock);
   symbol_table = new symbol_table_t();
+  known_symbols = new known_symbols_t();
+  symbol_storage = new StringArena<>();
+
+  // Intern the names of all functions registered so far.
+  for (uint32_t funcid = 0; funcid < num_func_ids; funcid++) {
+    size_t chunk, offset;
+    locate_func_id(funcid, &chunk, &offset);
+    const char*& name = func_id_chunks[chunk][offset];
+    name = bf_string_to_symbol(name);
+  }
+  pthread_mutex_unlock(&func_ids_lock);
 }
 
+// Hash a string (64-bit FNV-1a) and return both the hash and the
+// string's length.
+static inline uint64_t hash_string (const char* str, size_t* len)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  const char* s;
+  for (s = str; *s != '\0'; s++) {
+    hash ^= (unsigned char) *s;
+    hash *= 1099511628211ULL;
+  }
+  *len = s - str;
+  return hash;
+}
+
+// Say whether a string lies in the pass's read-only function-name
+// section.
+static inline bool is_pass_fname (const char* str)
+{
+#ifdef __ELF__
+  return str >= __start_bf_fnames && str < __stop_bf_fnames;
+#else
+  return false;
+#endif
+}
 
 // Map a nonunique string to a unique string (in other words, intern a
 // string to a symbol).
@@ -38,16 +144,80 @@ const char* bf_string_to_symbol (const char* nonunique)
 {
   if (nonunique == NULL)
     return NULL;
-  symbol_table_t::iterator sym_iter = symbol_table->find(nonunique);
-  if (sym_iter == symbol_table->end()) {
-    // New entry for the symbol table -- create a unique symbol and return it.
-    const char* unique = strdup(nonunique);
-    (*symbol_table)[unique] = unique;
-    return unique;
+  if (bf_thread_safe)
+    pthread_mutex_lock(&symbol_table_lock);
+  const char* unique;
+  known_symbols_t::iterator known_iter = known_symbols->find(nonunique);
+  if (known_iter != known_symbols->end())
+    // Fast path -- we've seen this very string before.
+    unique = known_iter->second;
+  else {
+    // Slow path -- look up the string by its contents.
+    size_t len;
+    uint64_t hash = hash_string(nonunique, &len);
+    symbol_key_t key(nonunique, hash);
+    symbol_table_t::iterator sym_iter = symbol_table->find(key);
+    if (sym_iter == symbol_table->end()) {
+      // New entry for the symbol table -- create a unique symbol and
+      // return it.
+      unique = symbol_storage->copy(nonunique, len);
+      (*symbol_table)[symbol_key_t(unique, hash)] = unique;
+      (*known_symbols)[unique] = unique;
+    }
+    else
+      // Existing entry in the symbol table -- return it.
+      unique = sym_iter->second;
+    if (is_pass_fname(nonunique))
+      (*known_symbols)[nonunique] = unique;
+  }
+  if (bf_thread_safe)
+    pthread_mutex_unlock(&symbol_table_lock);
+  return unique;
+}
+
+
+// Register a module's function names and return (via base) the
+// program-wide ID of the module's first function.  This is invoked by
+// a constructor in every module that passes function IDs to the
+// run-time library.
+void bf_register_func_table (const char** names, uint32_t num_names, uint32_t* base)
+{
+  pthread_mutex_lock(&func_ids_lock);
+  uint32_t first_id = num_func_ids;
+  if (uint64_t(first_id) + num_names > uint64_t(~uint32_t(0))) {
+    cerr << "Too many functions were registered with the Byfl run-time library\n";
+    exit(1);
+  }
+  for (uint32_t i = 0; i < num_names; i++) {
+    size_t chunk, offset;
+    locate_func_id(first_id + i, &chunk, &offset);
+    if (func_id_chunks[chunk] == NULL)
+      func_id_chunks[chunk] = new const char*[size_t(1) << (chunk + first_chunk_bits)];
+    func_id_chunks[chunk][offset] =
+      symbol_table == NULL ? names[i] : bf_string_to_symbol(names[i]);
   }
-  else
-    // Existing entry in the symbol table -- return it.
-    return sym_iter->second;
+  __atomic_store_n(&num_func_ids, first_id + num_names, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&func_ids_lock);
+  *base = first_id;
+}
+
+
+// Return the number of function IDs assigned so far.
+uint32_t bf_num_func_ids (void)
+{
+  return __atomic_load_n(&num_func_ids, __ATOMIC_ACQUIRE);
+}
+
+
+// Map a function ID to the function's name (a symbol), or to a
+// placeholder name if the ID was never assigned.
+const char* bf_func_id_to_name (uint32_t funcid)
+{
+  if (funcid >= bf_num_func_ids())
+    return "[unknown function]";
+  size_t chunk, offset;
+  locate_func_id(funcid, &chunk, &offset);
+  return func_id_chunks[chunk][offset];
 }
 
 } // namespace bytesflops
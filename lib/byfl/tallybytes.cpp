@@ -6,6 +6,7 @@
  */
 
 #include "byfl.h"
+#include "arena.h"
 
 namespace bytesflops {}
 using namespace bytesflops;
@@ -18,11 +19,13 @@ struct eqaddr
 };
 
 // Define a mapping from a page-aligned memory address to a vector of
-// byte tallies.
+// byte tallies.  The class name must differ from ubytes.cpp's
+// PageTableEntry; otherwise the linker may merge the two classes'
+// inline methods.
 static const size_t logical_page_size = 8192;      // Arbitrary; not tied to the OS page size
-class PageTableEntry {
+class PageCounterEntry {
 private:
-  bytecount_t* byte_counter;   // One counter per byte on the page
+  bytecount_t byte_counter[logical_page_size];   // One counter per byte on the page
   size_t bytes_touched;        // Number of nonzeroes in the above
 
 public:
@@ -56,23 +59,26 @@ public:
       }
   }
 
-  PageTableEntry() {
+  PageCounterEntry() {
     bytes_touched = 0;
-    byte_counter = new bytecount_t[logical_page_size];
     memset((void *)byte_counter, 0, sizeof(bytecount_t)*logical_page_size);
   }
-
-  ~PageTableEntry() {
-    delete[] byte_counter;
-  }
 };
-typedef CachedUnorderedMap<uintptr_t, PageTableEntry*, hash<uintptr_t>, eqaddr> page_to_counts_t;
+
+// Allocate page-table entries from slabs rather than individually
+// from the heap.  The program as a whole and the individual functions
+// use separate arenas because they may be updated by different
+// threads (see bf_async_analysis).
+typedef SlabArena<PageCounterEntry> page_arena_t;
+typedef CachedUnorderedMap<uintptr_t, PageCounterEntry*, hash<uintptr_t>, eqaddr> page_to_counts_t;
 typedef CachedUnorderedMap<const char*, page_to_counts_t*> func_to_page_t;
 
 // Keep track of the unique bytes touched by each function and by the
 // program as a whole.
 static page_to_counts_t* global_unique_bytes = NULL;
 static func_to_page_t* function_unique_bytes = NULL;
+static page_arena_t* global_arena = NULL;
+static page_arena_t* function_arena = NULL;
 
 namespace bytesflops {
 
@@ -81,6 +87,8 @@ void initialize_tallybytes (void)
 {
   global_unique_bytes = new page_to_counts_t();
   function_unique_bytes = new func_to_page_t();
+  global_arena = new page_arena_t();
+  function_arena = new page_arena_t();
 }
 
 
@@ -91,7 +99,7 @@ static uint64_t tally_unique_addresses (const page_to_counts_t& mapping)
   for (page_to_counts_t::const_iterator page_iter = mapping.begin();
        page_iter != mapping.end();
        page_iter++) {
-    const PageTableEntry* counters = page_iter->second;
+    const PageCounterEntry* counters = page_iter->second;
     unique_addrs += counters->count();
   }
   return unique_addrs;
@@ -117,13 +125,15 @@ uint64_t bf_tally_unique_addresses_tb (void)
 
 
 // Given a mapping of page numbers to bit vectors and a page number,
-// return a bit vector, creating it if not found.
-static PageTableEntry* find_or_create_page (page_to_counts_t& mapping, uint64_t pagenum)
+// return a bit vector, creating it from a given arena if not found.
+static PageCounterEntry* find_or_create_page (page_to_counts_t& mapping,
+                                              page_arena_t* arena,
+                                              uint64_t pagenum)
 {
   page_to_counts_t::iterator counts_iter = mapping.find(pagenum);
   if (counts_iter == mapping.end()) {
     // This is the first bit we've touched on the page.
-    mapping[pagenum] = new PageTableEntry();
+    mapping[pagenum] = arena->create();
     return mapping[pagenum];
   }
   else
@@ -133,13 +143,14 @@ static PageTableEntry* find_or_create_page (page_to_counts_t& mapping, uint64_t
 
 
 // Mark every bit in a given range as having been accessed.
-static void flag_bytes_in_range (page_to_counts_t& mapping, uint64_t baseaddr, uint64_t numaddrs)
+static void flag_bytes_in_range (page_to_counts_t& mapping, page_arena_t* arena,
+                                 uint64_t baseaddr, uint64_t numaddrs)
 {
   uint64_t first_page = baseaddr / logical_page_size;
   uint64_t last_page = (baseaddr + numaddrs - 1) / logical_page_size;
   if (first_page == last_page) {
     // Common case (we hope) -- all addresses lie on the same logical page.
-    PageTableEntry* counts = find_or_create_page(mapping, first_page);
+    PageCounterEntry* counts = find_or_create_page(mapping, arena, first_page);
     uint64_t pagebase = baseaddr % logical_page_size;
     counts->increment(pagebase, pagebase + numaddrs - 1);
   }
@@ -149,7 +160,7 @@ static void flag_bytes_in_range (page_to_counts_t& mapping, uint64_t baseaddr, u
       uint64_t address = baseaddr + i;
       uint64_t pagenum = address / logical_page_size;
       uint64_t bitoffset = address % logical_page_size;
-      PageTableEntry* counts = find_or_create_page(mapping, pagenum);
+      PageCounterEntry* counts = find_or_create_page(mapping, arena, pagenum);
       counts->increment(bitoffset, bitoffset);
     }
 }
@@ -169,15 +180,15 @@ static page_to_counts_t* assoc_addresses_with_func (const char* funcname,
   else
     // We've seen this function before.
     unique_bytes = map_iter->second;
-  flag_bytes_in_range(*unique_bytes, baseaddr, numaddrs);
+  flag_bytes_in_range(*unique_bytes, function_arena, baseaddr, numaddrs);
   return unique_bytes;
 }
 
 
-// Associate a set of memory locations with a given function.  This
-// function basically wraps assoc_addresses_with_func() with a quick
-// cache lookup.
-void bf_assoc_addresses_with_func_tb (const char* funcname, uint64_t baseaddr, uint64_t numaddrs)
+// Associate a set of memory locations with a given function ID.
+// This function basically wraps assoc_addresses_with_func() with a
+// quick cache lookup.
+void bf_assoc_addresses_with_func_tb (uint32_t funcid, uint64_t baseaddr, uint64_t numaddrs)
 {
   // Keep track of the two most recently used page-to-bit-vector maps.
   typedef struct {
@@ -187,20 +198,19 @@ void bf_assoc_addresses_with_func_tb (const char* funcname, uint64_t baseaddr, u
   static prev_value_t prev_values[2] = {{NULL, NULL}, {NULL, NULL}};
 
   // Find the given function's mapping from page number to bit list.
-  if (bf_call_stack)
-    funcname = bf_func_and_parents;
-  else
-    funcname = bf_string_to_symbol(funcname);
+  if (bf_thread_safe)
+    bf_acquire_mega_lock();
+  const char* funcname = bf_call_stack ? bf_call_context_name() : bf_func_id_to_name(funcid);
   if (funcname == prev_values[0].funcname)
     // Fastest case: same function as last time
-    flag_bytes_in_range(*prev_values[0].unique_bytes, baseaddr, numaddrs);
+    flag_bytes_in_range(*prev_values[0].unique_bytes, function_arena, baseaddr, numaddrs);
   else
     // Second-fastest case: same function as the time before last
     if (funcname == prev_values[1].funcname) {
       prev_value_t swap = prev_values[0];
       prev_values[0] = prev_values[1];
       prev_values[1] = swap;
-      flag_bytes_in_range(*prev_values[0].unique_bytes, baseaddr, numaddrs);
+      flag_bytes_in_range(*prev_values[0].unique_bytes, function_arena, baseaddr, numaddrs);
     }
     else {
       // Slowest case: different function from the last two times
@@ -208,13 +218,32 @@ void bf_assoc_addresses_with_func_tb (const char* funcname, uint64_t baseaddr, u
       prev_values[0].funcname = funcname;
       prev_values[0].unique_bytes = assoc_addresses_with_func(funcname, baseaddr, numaddrs);
     }
+  if (bf_thread_safe)
+    bf_release_mega_lock();
 }
 
 
 // Associate a set of memory locations with the program as a whole.
 void bf_assoc_addresses_with_prog_tb (uint64_t baseaddr, uint64_t numaddrs)
 {
-  flag_bytes_in_range(*global_unique_bytes, baseaddr, numaddrs);
+  if (bf_thread_safe)
+    bf_acquire_mega_lock();
+  flag_bytes_in_range(*global_unique_bytes, global_arena, baseaddr, numaddrs);
+  if (bf_thread_safe)
+    bf_release_mega_lock();
+}
+
+
+// Associate the memory locations in a batch of trace records with the
+// program as a whole.  The caller is responsible for taking the
+// mega-lock if necessary.
+void bf_assoc_trace_with_prog_tb (const uint64_t* trace, size_t num_records)
+{
+  for (size_t i = 0; i < num_records; i++) {
+    uint64_t info = trace[2*i + 1];
+    if ((info&BF_TRACE_UNIQUE_BYTES) != 0 && (info&BF_TRACE_SIZE_MASK) > 0)
+      flag_bytes_in_range(*global_unique_bytes, global_arena, trace[2*i], info&BF_TRACE_SIZE_MASK);
+  }
 }
 
 
@@ -228,7 +257,8 @@ bool greater_multiplier_than (bf_addr_tally_t a, bf_addr_tally_t b)
 
 // Convert a collection of tallies to a histogram, freeing the former
 // as we build the latter.
-void get_address_tally_hist (page_to_counts_t& mapping, vector<bf_addr_tally_t>& histogram, uint64_t* total)
+void get_address_tally_hist (page_to_counts_t& mapping, page_arena_t* arena,
+                             vector<bf_addr_tally_t>& histogram, uint64_t* total)
 {
   // Process each page of counts in turn.
   typedef CachedUnorderedMap<bytecount_t, uint64_t> count_to_mult_t;
@@ -238,7 +268,7 @@ void get_address_tally_hist (page_to_counts_t& mapping, vector<bf_addr_tally_t>&
     // Increment the iterator now so we can safely delete it at the
     // bottom of this block.
     uintptr_t baseaddr = counts_iter->first;
-    PageTableEntry* pte = counts_iter->second;
+    PageCounterEntry* pte = counts_iter->second;
     counts_iter++;
 
     // Increment the multiplier for each count.
@@ -248,7 +278,7 @@ void get_address_tally_hist (page_to_counts_t& mapping, vector<bf_addr_tally_t>&
 	count2mult[byte_counter[i]]++;
 
     // Free the memory occupied by the page table entry.
-    delete pte;
+    arena->destroy(pte);
     mapping.erase(baseaddr);
   }
 
@@ -267,7 +297,7 @@ void get_address_tally_hist (page_to_counts_t& mapping, vector<bf_addr_tally_t>&
 // former as we build the latter.
 void bf_get_address_tally_hist (vector<bf_addr_tally_t>& histogram, uint64_t* total)
 {
-  get_address_tally_hist(*global_unique_bytes, histogram, total);
+  get_address_tally_hist(*global_unique_bytes, global_arena, histogram, total);
 }
 
 } // namespace bytesflops
@@ -11,7 +11,7 @@ namespace bytesflops {}
 using namespace bytesflops;
 using namespace std;
 
-static pthread_mutex_t megalock = PTHREAD_MUTEX_INITIALIZER;    // Lock protecting all library data structures
+static pthread_mutex_t megalock = PTHREAD_MUTEX_INITIALIZER;    // Lock protecting all data structures shared across threads
 
 namespace bytesflops {
 
@@ -0,0 +1,371 @@
+/*
+ * Helper library for computing bytes:flops ratios
+ * (buffering memory-access traces)
+ *
+ * By Scott Pakin <pakin@lanl.gov>
+ */
+
+#include "byfl.h"
+#include <deque>
+
+namespace bytesflops {}
+using namespace bytesflops;
+using namespace std;
+
+// Define the calling thread's current position in and end of its
+// trace buffer.  Each record is an {address, BF_TRACE_* flags |
+// number of bytes} pair.  Instrumented code appends records, then
+// publishes the new bf_trace_pos with release semantics, and calls
+// bf_drain_trace_buffer() whenever bf_trace_pos reaches bf_trace_end.
+__thread uint64_t* bf_trace_pos = NULL;
+__thread uint64_t* bf_trace_end = NULL;
+
+// Describe one thread's trace buffer.  Another thread may read the
+// records between first_unread and the owning thread's bf_trace_pos
+// while holding the lock.
+typedef struct {
+  uint64_t* records;        // Start of the owning thread's buffer
+  uint64_t* first_unread;   // First record not yet handed off by bf_drain_all_trace_buffers()
+  uint64_t** pos_ptr;       // Pointer to the owning thread's bf_trace_pos
+  pthread_mutex_t lock;     // Lock protecting records and first_unread
+} trace_buffer_t;
+
+// Keep track of the calling thread's trace buffer and of all live
+// threads' trace buffers.
+static __thread trace_buffer_t* trace_buffer = NULL;
+static vector<trace_buffer_t*>* all_trace_buffers = NULL;
+static pthread_mutex_t trace_buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Describe a batch of trace records awaiting processing by
+// asynchronous consumers.
+typedef struct {
+  uint64_t* records;         // Trace records, which the batch owns
+  size_t num_records;        // Number of records in the above
+  int pending_consumers;     // Number of consumers that haven't yet processed the batch
+} trace_batch_t;
+
+// Describe a thread that performs one analysis on every batch of
+// trace records.
+typedef struct {
+  void (*process)(const uint64_t*, size_t);   // Analysis to perform
+  deque<trace_batch_t*> queue;   // Batches not yet processed
+  bool busy;                     // true=processing a batch
+  pthread_mutex_t lock;          // Lock protecting the above
+  pthread_cond_t changed;        // Signaled when the queue or busy changes
+} consumer_t;
+
+// Keep track of all asynchronous consumers, the number of batches
+// not yet processed by all of them, and a pool of buffers that no
+// batch is using.
+static vector<consumer_t*>* consumers = NULL;
+static size_t outstanding_batches = 0;
+static const size_t max_outstanding_batches = 16;
+static vector<uint64_t*>* free_buffers = NULL;
+static pthread_mutex_t batches_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t batch_retired = PTHREAD_COND_INITIALIZER;
+
+namespace bytesflops {
+
+// Process a batch of trace records.  Each analysis processes the
+// entire batch in turn to improve the locality of its data
+// structures.
+static void process_trace (const uint64_t* trace, size_t num_records)
+{
+  if (num_records == 0)
+    return;
+  if (bf_thread_safe)
+    bf_acquire_mega_lock();
+  if (bf_unique_bytes) {
+    if (bf_mem_footprint)
+      bf_assoc_trace_with_prog_tb(trace, num_records);
+    else
+      bf_assoc_trace_with_prog(trace, num_records);
+  }
+  bf_reuse_dist_trace_prog(trace, num_records);
+  if (bf_thread_safe)
+    bf_release_mega_lock();
+}
+
+
+// Return an empty trace buffer.
+static uint64_t* allocate_trace_buffer (void)
+{
+  uint64_t* buffer = NULL;
+  pthread_mutex_lock(&batches_lock);
+  if (free_buffers != NULL && !free_buffers->empty()) {
+    buffer = free_buffers->back();
+    free_buffers->pop_back();
+  }
+  pthread_mutex_unlock(&batches_lock);
+  if (buffer == NULL)
+    buffer = new uint64_t[2*bf_trace_buffer_entries];
+  return buffer;
+}
+
+
+// Return a trace buffer to the pool of empty buffers.
+static void free_trace_buffer (uint64_t* buffer)
+{
+  pthread_mutex_lock(&batches_lock);
+  free_buffers->push_back(buffer);
+  pthread_mutex_unlock(&batches_lock);
+}
+
+
+// Note that a consumer has processed a batch, and recycle the batch's
+// buffer once every consumer has done so.
+static void release_batch (trace_batch_t* batch)
+{
+  if (__sync_sub_and_fetch(&batch->pending_consumers, 1) > 0)
+    return;
+  pthread_mutex_lock(&batches_lock);
+  free_buffers->push_back(batch->records);
+  outstanding_batches--;
+  pthread_cond_broadcast(&batch_retired);
+  pthread_mutex_unlock(&batches_lock);
+  delete batch;
+}
+
+
+// Repeatedly perform a consumer's analysis on the next batch in its
+// queue.
+static void* consume_batches (void* consumer_ptr)
+{
+  consumer_t* consumer = (consumer_t*) consumer_ptr;
+  pthread_mutex_lock(&consumer->lock);
+  while (true) {
+    // Wait for a batch to arrive.
+    while (consumer->queue.empty())
+      pthread_cond_wait(&consumer->changed, &consumer->lock);
+    trace_batch_t* batch = consumer->queue.front();
+    consumer->queue.pop_front();
+    consumer->busy = true;
+    pthread_mutex_unlock(&consumer->lock);
+
+    // Process the batch without holding any locks.
+    consumer->process(batch->records, batch->num_records);
+    release_batch(batch);
+
+    // Tell anyone waiting for us to finish that we're idle.
+    pthread_mutex_lock(&consumer->lock);
+    consumer->busy = false;
+    pthread_cond_broadcast(&consumer->changed);
+  }
+  return NULL;
+}
+
+
+// Create a thread that performs a given analysis on every batch.
+static void start_consumer (void (*process)(const uint64_t*, size_t))
+{
+  consumer_t* consumer = new consumer_t;
+  consumer->process = process;
+  consumer->busy = false;
+  pthread_mutex_init(&consumer->lock, NULL);
+  pthread_cond_init(&consumer->changed, NULL);
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, consume_batches, consumer) != 0) {
+    cerr << "Failed to create an analysis thread\n";
+    exit(1);
+  }
+  pthread_detach(thread);
+  consumers->push_back(consumer);
+}
+
+
+// Hand a buffer of trace records to every asynchronous consumer,
+// waiting first if too many batches are outstanding.  The batch takes
+// ownership of the buffer.  Because the wait can be long, the caller
+// must not hold trace_buffers_lock.
+static void submit_trace (uint64_t* trace, size_t num_records)
+{
+  // Recycle empty buffers immediately.
+  if (num_records == 0) {
+    free_trace_buffer(trace);
+    return;
+  }
+
+  // Limit the amount of memory consumed by unprocessed batches.
+  pthread_mutex_lock(&batches_lock);
+  while (outstanding_batches >= max_outstanding_batches)
+    pthread_cond_wait(&batch_retired, &batches_lock);
+  outstanding_batches++;
+  pthread_mutex_unlock(&batches_lock);
+
+  // Enqueue the batch on every consumer.
+  trace_batch_t* batch = new trace_batch_t;
+  batch->records = trace;
+  batch->num_records = num_records;
+  batch->pending_consumers = int(consumers->size());
+  for (vector<consumer_t*>::iterator cons_iter = consumers->begin();
+       cons_iter != consumers->end();
+       cons_iter++) {
+    consumer_t* consumer = *cons_iter;
+    pthread_mutex_lock(&consumer->lock);
+    consumer->queue.push_back(batch);
+    pthread_cond_broadcast(&consumer->changed);
+    pthread_mutex_unlock(&consumer->lock);
+  }
+}
+
+
+// Wait for every asynchronous consumer to process every batch it has
+// been given.
+static void wait_for_consumers (void)
+{
+  for (vector<consumer_t*>::iterator cons_iter = consumers->begin();
+       cons_iter != consumers->end();
+       cons_iter++) {
+    consumer_t* consumer = *cons_iter;
+    pthread_mutex_lock(&consumer->lock);
+    while (!consumer->queue.empty() || consumer->busy)
+      pthread_cond_wait(&consumer->changed, &consumer->lock);
+    pthread_mutex_unlock(&consumer->lock);
+  }
+}
+
+
+// Initialize some of our variables at first use.  If we were asked to
+// process traces asynchronously, start one consumer thread per
+// analysis.
+void initialize_tracebuf (void)
+{
+  all_trace_buffers = new vector<trace_buffer_t*>();
+  consumers = new vector<consumer_t*>();
+  free_buffers = new vector<uint64_t*>();
+  if (bf_async_analysis && bf_trace_buffer_entries > 0) {
+    if (bf_unique_bytes)
+      start_consumer(bf_mem_footprint ? bf_assoc_trace_with_prog_tb : bf_assoc_trace_with_prog);
+    if (bf_reuse_dist)
+      start_consumer(bf_reuse_dist_trace_prog);
+  }
+}
+
+
+// Detach the unread records from the calling thread's trace buffer,
+// move them to the front of the buffer, and return their number.  The
+// caller must hold the trace buffer's lock.
+static size_t take_unread_records (trace_buffer_t* tb)
+{
+  size_t num_records = (bf_trace_pos - tb->first_unread)/2;
+  if (tb->first_unread != tb->records)
+    // bf_drain_all_trace_buffers() already handed off the records
+    // before first_unread.
+    memmove(tb->records, tb->first_unread, num_records*2*sizeof(uint64_t));
+  return num_records;
+}
+
+
+// Process a buffer of trace records, or hand it to the asynchronous
+// consumers, and recycle the buffer.
+static void dispose_of_trace (uint64_t* trace, size_t num_records)
+{
+  if (consumers->empty()) {
+    process_trace(trace, num_records);
+    free_trace_buffer(trace);
+  }
+  else
+    submit_trace(trace, num_records);
+}
+
+
+// Process and empty the calling thread's trace buffer, allocating it
+// first if necessary.  The calling thread receives a new buffer, and
+// the full buffer is processed (or given to the asynchronous
+// consumers) without holding any lock.
+void bf_drain_trace_buffer (void)
+{
+  // Allocate a trace buffer on first use.
+  trace_buffer_t* tb = trace_buffer;
+  if (tb == NULL) {
+    tb = new trace_buffer_t;
+    tb->records = allocate_trace_buffer();
+    tb->first_unread = tb->records;
+    tb->pos_ptr = &bf_trace_pos;
+    pthread_mutex_init(&tb->lock, NULL);
+    __atomic_store_n(&bf_trace_pos, tb->records, __ATOMIC_RELEASE);
+    bf_trace_end = tb->records + 2*bf_trace_buffer_entries;
+    trace_buffer = tb;
+    pthread_mutex_lock(&trace_buffers_lock);
+    all_trace_buffers->push_back(tb);
+    pthread_mutex_unlock(&trace_buffers_lock);
+    return;
+  }
+
+  // Swap the full buffer for an empty one.  Only
+  // bf_drain_all_trace_buffers() can contend for the lock.
+  uint64_t* new_records = allocate_trace_buffer();
+  pthread_mutex_lock(&tb->lock);
+  uint64_t* full_records = tb->records;
+  size_t num_records = take_unread_records(tb);
+  tb->records = new_records;
+  tb->first_unread = new_records;
+  __atomic_store_n(&bf_trace_pos, new_records, __ATOMIC_RELEASE);
+  bf_trace_end = new_records + 2*bf_trace_buffer_entries;
+  pthread_mutex_unlock(&tb->lock);
+
+  // Process the full buffer after releasing the lock.
+  dispose_of_trace(full_records, num_records);
+}
+
+
+// Process and free the calling thread's trace buffer.  This is
+// invoked when a thread exits.
+void bf_retire_trace_buffer (void)
+{
+  trace_buffer_t* tb = trace_buffer;
+  if (tb == NULL)
+    return;
+
+  // Stop bf_drain_all_trace_buffers() from seeing our buffer.  It
+  // holds trace_buffers_lock while it reads any buffer, so once we've
+  // removed ours, no other thread can be reading it.
+  pthread_mutex_lock(&trace_buffers_lock);
+  all_trace_buffers->erase(find(all_trace_buffers->begin(), all_trace_buffers->end(), tb));
+  pthread_mutex_unlock(&trace_buffers_lock);
+
+  // Process the remaining records.
+  size_t num_records = take_unread_records(tb);
+  dispose_of_trace(tb->records, num_records);
+  pthread_mutex_destroy(&tb->lock);
+  delete tb;
+  trace_buffer = NULL;
+  bf_trace_pos = NULL;
+  bf_trace_end = NULL;
+}
+
+
+// Process the records in every live thread's trace buffer, and wait
+// for all asynchronous processing to complete.  This is invoked when
+// the program exits.  Other threads may still be appending records,
+// so we copy only the records they've already published and leave
+// their buffers in place.
+void bf_drain_all_trace_buffers (void)
+{
+  // Copy every buffer's unread records while holding the locks.
+  vector<pair<uint64_t*, size_t> > batches;   // Copies of records to process
+  pthread_mutex_lock(&trace_buffers_lock);
+  for (vector<trace_buffer_t*>::iterator tb_iter = all_trace_buffers->begin();
+       tb_iter != all_trace_buffers->end();
+       tb_iter++) {
+    trace_buffer_t* tb = *tb_iter;
+    pthread_mutex_lock(&tb->lock);
+    uint64_t* pos = __atomic_load_n(tb->pos_ptr, __ATOMIC_ACQUIRE);
+    size_t num_records = (pos - tb->first_unread)/2;
+    uint64_t* records = allocate_trace_buffer();
+    memcpy(records, tb->first_unread, num_records*2*sizeof(uint64_t));
+    batches.push_back(make_pair(records, num_records));
+    tb->first_unread = pos;
+    pthread_mutex_unlock(&tb->lock);
+  }
+  pthread_mutex_unlock(&trace_buffers_lock);
+
+  // Process the copies after releasing the locks.
+  for (vector<pair<uint64_t*, size_t> >::iterator batch_iter = batches.begin();
+       batch_iter != batches.end();
+       batch_iter++)
+    dispose_of_trace(batch_iter->first, batch_iter->second);
+  wait_for_consumers();
+}
+
+} // namespace bytesflops
@@ -6,6 +6,7 @@
  */
 
 #include "byfl.h"
+#include "arena.h"
 
 namespace bytesflops {}
 using namespace bytesflops;
@@ -19,11 +20,15 @@ struct eqaddr
 
 // Define a mapping from a page-aligned memory address to a vector of
 // bits touched on that page.
-static const size_t logical_page_size = 8192;      // Arbitrary; not tied to the OS page size
+static const size_t logical_page_size = 1<<BF_UBYTES_PAGE_BITS;   // Arbitrary; not tied to the OS page size
+typedef struct {
+  uint64_t words[logical_page_size/64];   // One bit per byte on the page
+} bit_page_t;
 class PageTableEntry {
 private:
-  uint64_t* bit_vector;           // One bit per byte on the page, packed into words
+  bit_page_t* bit_vector;         // One bit per byte on the page, packed into words
   size_t bits_set;                // Number of 1 bits in the above
+  SlabArena<bit_page_t>* arena;   // Arena from which bit_vector was allocated
 
 public:
   // Count the number of bits that are set.
@@ -42,25 +47,25 @@ public:
     size_t word_ofs2 = pos2/64;              // Offset of word representing pos2
     if (word_ofs1 == word_ofs2) {
       // Fast case -- we have only one word to deal with.
-      uint64_t word = bit_vector[word_ofs1]; // Vector of 64 bits
+      uint64_t word = bit_vector->words[word_ofs1]; // Vector of 64 bits
       size_t bit_ofs1 = pos1%64;             // First bit to set
       size_t bit_ofs2 = pos2%64;             // Last bit to set
       uint64_t mask;                         // All 0s except for the bits to set
       mask = ((2ULL<<(bit_ofs2 - bit_ofs1)) - 1ULL) << bit_ofs1;
       uint64_t new_word = word | mask;       // Word with new bits set
       bits_set += __builtin_popcountll(word ^ new_word);   // Tally the number of bits that changed.
-      bit_vector[word_ofs1] = new_word;
+      bit_vector->words[word_ofs1] = new_word;
     }
     else {
       // Slow case -- positions span multiple words.
       for (size_t pos = pos1; pos <= pos2; pos++) {
         size_t word_ofs = pos/64;             // Word containing the bit of interest
         size_t bit_ofs = pos%64;              // Bit offset in the target word
-        uint64_t word = bit_vector[word_ofs]; // Vector of 64 bits
+        uint64_t word = bit_vector->words[word_ofs]; // Vector of 64 bits
         uint64_t mask = 1ULL<<bit_ofs;        // All 0s except for bitofs
         if ((word&mask) == 0ULL) {
           // Bit was previously 0.  Set it to 1.
-          bit_vector[word_ofs] |= mask;
+          bit_vector->words[word_ofs] |= mask;
           bits_set++;
         }
       }
@@ -69,28 +74,51 @@ public:
     // If we filled the page, deallocate the memory used by the bit
     // vector, as we won't be setting any more bits.
     if (bits_set == logical_page_size) {
-      delete[] bit_vector;
+      arena->destroy(bit_vector);
       bit_vector = NULL;
     }
   }
 
-  PageTableEntry() {
+  PageTableEntry(SlabArena<bit_page_t>* bit_arena) {
     bits_set = 0;
-    bit_vector = new uint64_t[logical_page_size/64];
-    memset((void *)bit_vector, 0, sizeof(uint64_t)*logical_page_size/64);
+    arena = bit_arena;
+    bit_vector = arena->create();   // Zero-initialized
   }
 
   ~PageTableEntry() {
-    delete[] bit_vector;
+    if (bit_vector)
+      arena->destroy(bit_vector);
   }
 };
+
+// Allocate page-table entries and bit vectors from slabs rather than
+// individually from the heap.  The program as a whole and the
+// individual functions use separate arenas because they may be
+// updated by different threads (see bf_async_analysis).
+typedef struct {
+  SlabArena<PageTableEntry> entries;   // Page-table entries
+  SlabArena<bit_page_t> bit_vectors;   // Bit vectors, including those in the shadow directory
+} page_arena_t;
 typedef CachedUnorderedMap<uintptr_t, PageTableEntry*, hash<uintptr_t>, eqaddr> page_to_bits_t;
 typedef CachedUnorderedMap<const char*, page_to_bits_t*> func_to_page_t;
 
+// Define the shadow directory that instrumented code consults inline
+// to mark the bytes accessed by the program as a whole (see
+// byfl-common.h).  Instrumented code substitutes bf_ubytes_empty_leaf
+// for a missing leaf and writes to bf_ubytes_scratch when it needs to
+// call bf_assoc_addresses_with_prog() instead.
+uint64_t** bf_ubytes_directory[1<<BF_UBYTES_DIR_BITS];
+uint64_t* bf_ubytes_empty_leaf[1<<BF_UBYTES_LEAF_BITS];
+uint64_t bf_ubytes_scratch;
+
 // Keep track of the unique bytes touched by each function and by the
-// program as a whole.
+// program as a whole.  global_unique_bytes holds only addresses that
+// don't fit in the shadow directory.
 static page_to_bits_t* global_unique_bytes = NULL;
 static func_to_page_t* function_unique_bytes = NULL;
+static vector<uint64_t*>* shadow_pages = NULL;    // Every bit vector in the shadow directory
+static page_arena_t* global_arena = NULL;
+static page_arena_t* function_arena = NULL;
 
 namespace bytesflops {
 
@@ -99,6 +127,9 @@ void initialize_ubytes (void)
 {
   global_unique_bytes = new page_to_bits_t();
   function_unique_bytes = new func_to_page_t();
+  shadow_pages = new vector<uint64_t*>();
+  global_arena = new page_arena_t();
+  function_arena = new page_arena_t();
 }
 
 
@@ -130,18 +161,28 @@ uint64_t bf_tally_unique_addresses (const char* funcname)
 // Return the number of unique addresses referenced by the entire program.
 uint64_t bf_tally_unique_addresses (void)
 {
-  return tally_unique_addresses(*global_unique_bytes);
+  uint64_t unique_addrs = tally_unique_addresses(*global_unique_bytes);
+  for (vector<uint64_t*>::const_iterator page_iter = shadow_pages->begin();
+       page_iter != shadow_pages->end();
+       page_iter++) {
+    const uint64_t* bits = *page_iter;
+    for (size_t i = 0; i < logical_page_size/64; i++)
+      unique_addrs += __builtin_popcountll(bits[i]);
+  }
+  return unique_addrs;
 }
 
 
 // Given a mapping of page numbers to bit vectors and a page number,
-// return a bit vector, creating it if not found.
-static PageTableEntry* find_or_create_page (page_to_bits_t& mapping, uint64_t pagenum)
+// return a bit vector, creating it from a given arena if not found.
+static PageTableEntry* find_or_create_page (page_to_bits_t& mapping,
+                                            page_arena_t* arena,
+                                            uint64_t pagenum)
 {
   page_to_bits_t::iterator bits_iter = mapping.find(pagenum);
   if (bits_iter == mapping.end()) {
     // This is the first bit we've touched on the page.
-    mapping[pagenum] = new PageTableEntry();
+    mapping[pagenum] = arena->entries.create(&arena->bit_vectors);
     return mapping[pagenum];
   }
   else
@@ -151,13 +192,14 @@ static PageTableEntry* find_or_create_page (page_to_bits_t& mapping, uint64_t pa
 
 
 // Mark every bit in a given range as having been accessed.
-static void flag_bytes_in_range (page_to_bits_t& mapping, uint64_t baseaddr, uint64_t numaddrs)
+static void flag_bytes_in_range (page_to_bits_t& mapping, page_arena_t* arena,
+                                 uint64_t baseaddr, uint64_t numaddrs)
 {
   uint64_t first_page = baseaddr / logical_page_size;
   uint64_t last_page = (baseaddr + numaddrs - 1) / logical_page_size;
   if (first_page == last_page) {
     // Common case (we hope) -- all addresses lie on the same logical page.
-    PageTableEntry* bits = find_or_create_page(mapping, first_page);
+    PageTableEntry* bits = find_or_create_page(mapping, arena, first_page);
     uint64_t pagebase = baseaddr % logical_page_size;
     bits->set(pagebase, pagebase + numaddrs - 1);
   }
@@ -167,12 +209,56 @@ static void flag_bytes_in_range (page_to_bits_t& mapping, uint64_t baseaddr, uin
       uint64_t address = baseaddr + i;
       uint64_t pagenum = address / logical_page_size;
       uint64_t bitoffset = address % logical_page_size;
-      PageTableEntry* bits = find_or_create_page(mapping, pagenum);
+      PageTableEntry* bits = find_or_create_page(mapping, arena, pagenum);
       bits->set(bitoffset, bitoffset);
     }
 }
 
 
+// Mark every byte in a given range as having been accessed in the
+// shadow directory, allocating leaves and bit vectors as necessary.
+// The caller must ensure that the entire range lies within the
+// directory.
+static void flag_shadow_bytes (uint64_t baseaddr, uint64_t numaddrs)
+{
+  const uint64_t leaf_mask = (1ULL<<BF_UBYTES_LEAF_BITS) - 1;
+  uint64_t lastaddr = baseaddr + numaddrs - 1;
+  uint64_t address = baseaddr;
+  while (address <= lastaddr) {
+    // Find or create the bit vector for the current address.  Fully
+    // initialize each new leaf and bit vector before instrumented
+    // code running in other threads can see it.
+    uint64_t dir_ofs = address >> (BF_UBYTES_LEAF_BITS + BF_UBYTES_PAGE_BITS);
+    uint64_t leaf_ofs = (address >> BF_UBYTES_PAGE_BITS) & leaf_mask;
+    uint64_t** leaf = bf_ubytes_directory[dir_ofs];
+    if (leaf == NULL) {
+      leaf = new uint64_t*[1<<BF_UBYTES_LEAF_BITS]();
+      __sync_synchronize();
+      bf_ubytes_directory[dir_ofs] = leaf;
+    }
+    uint64_t* bits = leaf[leaf_ofs];
+    if (bits == NULL) {
+      bits = global_arena->bit_vectors.create()->words;
+      shadow_pages->push_back(bits);
+      __sync_synchronize();
+      leaf[leaf_ofs] = bits;
+    }
+
+    // Set all of the bits that lie in the current word.
+    uint64_t word_last = min(address | uint64_t(63), lastaddr);  // Last address represented by the current word
+    size_t bit_ofs1 = address%64;            // First bit to set
+    size_t bit_ofs2 = word_last%64;          // Last bit to set
+    uint64_t mask = ((2ULL<<(bit_ofs2 - bit_ofs1)) - 1ULL) << bit_ofs1;
+    uint64_t* word = &bits[(address%logical_page_size)/64];
+    if (bf_thread_safe)
+      __sync_fetch_and_or(word, mask);
+    else
+      *word |= mask;
+    address = word_last + 1;
+  }
+}
+
+
 // Associate a set of memory locations with a given function.  Return
 // the page-to-bit-vector mapping for the given function.
 static page_to_bits_t* assoc_addresses_with_func (const char* funcname,
@@ -187,15 +273,15 @@ static page_to_bits_t* assoc_addresses_with_func (const char* funcname,
   else
     // We've seen this function before.
     unique_bytes = map_iter->second;
-  flag_bytes_in_range(*unique_bytes, baseaddr, numaddrs);
+  flag_bytes_in_range(*unique_bytes, function_arena, baseaddr, numaddrs);
   return unique_bytes;
 }
 
 
-// Associate a set of memory locations with a given function.  This
-// function basically wraps assoc_addresses_with_func() with a quick
-// cache lookup.
-void bf_assoc_addresses_with_func (const char* funcname, uint64_t baseaddr, uint64_t numaddrs)
+// Associate a set of memory locations with a given function ID.
+// This function basically wraps assoc_addresses_with_func() with a
+// quick cache lookup.
+void bf_assoc_addresses_with_func (uint32_t funcid, uint64_t baseaddr, uint64_t numaddrs)
 {
   // Keep track of the two most recently used page-to-bit-vector maps.
   typedef struct {
@@ -205,20 +291,19 @@ void bf_assoc_addresses_with_func (const char* funcname, uint64_t baseaddr, uint
   static prev_value_t prev_values[2] = {{NULL, NULL}, {NULL, NULL}};
 
   // Find the given function's mapping from page number to bit list.
-  if (bf_call_stack)
-    funcname = bf_func_and_parents;
-  else
-    funcname = bf_string_to_symbol(funcname);
+  if (bf_thread_safe)
+    bf_acquire_mega_lock();
+  const char* funcname = bf_call_stack ? bf_call_context_name() : bf_func_id_to_name(funcid);
   if (funcname == prev_values[0].funcname)
     // Fastest case: same function as last time
-    flag_bytes_in_range(*prev_values[0].unique_bytes, baseaddr, numaddrs);
+    flag_bytes_in_range(*prev_values[0].unique_bytes, function_arena, baseaddr, numaddrs);
   else
     // Second-fastest case: same function as the time before last
     if (funcname == prev_values[1].funcname) {
       prev_value_t swap = prev_values[0];
       prev_values[0] = prev_values[1];
       prev_values[1] = swap;
-      flag_bytes_in_range(*prev_values[0].unique_bytes, baseaddr, numaddrs);
+      flag_bytes_in_range(*prev_values[0].unique_bytes, function_arena, baseaddr, numaddrs);
     }
     else {
       // Slowest case: different function from the last two times
@@ -226,13 +311,48 @@ void bf_assoc_addresses_with_func (const char* funcname, uint64_t baseaddr, uint
       prev_values[0].funcname = funcname;
       prev_values[0].unique_bytes = assoc_addresses_with_func(funcname, baseaddr, numaddrs);
     }
+  if (bf_thread_safe)
+    bf_release_mega_lock();
+}
+
+
+// Mark every byte in a given range as having been accessed by the
+// program as a whole.
+static void assoc_addresses_with_prog (uint64_t baseaddr, uint64_t numaddrs)
+{
+  if (numaddrs == 0)
+    return;
+  uint64_t lastaddr = baseaddr + numaddrs - 1;
+  if (lastaddr >= baseaddr && (lastaddr >> BF_UBYTES_ADDR_BITS) == 0)
+    flag_shadow_bytes(baseaddr, numaddrs);
+  else
+    flag_bytes_in_range(*global_unique_bytes, global_arena, baseaddr, numaddrs);
 }
 
 
 // Associate a set of memory locations with the program as a whole.
+// Instrumented code calls this only when it can't mark the bytes in
+// the shadow directory itself.
 void bf_assoc_addresses_with_prog (uint64_t baseaddr, uint64_t numaddrs)
 {
-  flag_bytes_in_range(*global_unique_bytes, baseaddr, numaddrs);
+  if (bf_thread_safe)
+    bf_acquire_mega_lock();
+  assoc_addresses_with_prog(baseaddr, numaddrs);
+  if (bf_thread_safe)
+    bf_release_mega_lock();
+}
+
+
+// Associate the memory locations in a batch of trace records with the
+// program as a whole.  The caller is responsible for taking the
+// mega-lock if necessary.
+void bf_assoc_trace_with_prog (const uint64_t* trace, size_t num_records)
+{
+  for (size_t i = 0; i < num_records; i++) {
+    uint64_t info = trace[2*i + 1];
+    if ((info&BF_TRACE_UNIQUE_BYTES) != 0)
+      assoc_addresses_with_prog(trace[2*i], info&BF_TRACE_SIZE_MASK);
+  }
 }
 
 } // namespace bytesflops
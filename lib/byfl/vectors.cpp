@@ -118,15 +118,18 @@ static void tally_vector_operation (name_to_vector_t* vector_usage,
 }
 
 
-void bf_tally_vector_operation (const char *funcname, uint64_t num_elements,
+void bf_tally_vector_operation (uint32_t funcid, uint64_t num_elements,
                                 uint64_t element_bits, bool is_flop)
 {
   // Find the given function's mapping from vector to tally and increment that.
+  if (bf_thread_safe)
+    bf_acquire_mega_lock();
+  const char* funcname;
   if (bf_per_func)
     if (bf_call_stack)
-      funcname = bf_func_and_parents;
+      funcname = bf_call_context_name();
     else
-      funcname = bf_string_to_symbol(funcname);
+      funcname = bf_func_id_to_name(funcid);
   else
     funcname = "";
   tally_vector_operation(function_vector_usage, funcname, num_elements, element_bits, is_flop);
@@ -135,6 +138,8 @@ void bf_tally_vector_operation (const char *funcname, uint64_t num_elements,
   const char* partition = bf_string_to_symbol(bf_categorize_counters());
   if (partition != NULL)
     tally_vector_operation(user_defined_vector_usage, partition, num_elements, element_bits, is_flop);
+  if (bf_thread_safe)
+    bf_release_mega_lock();
 }
 
 
@@ -27,6 +27,19 @@ namespace bytesflops_pass {
   TrackCallStack("bf-call-stack", cl::init(false), cl::NotHidden,
                  cl::desc("Additionally output the name of each function's parent"));
 
+  // Define a command-line option for limiting the depth of the call
+  // stacks that -bf-call-stack distinguishes.
+  cl::opt<unsigned long long>
+  MaxCallDepth("bf-max-call-depth", cl::init(0), cl::NotHidden,
+               cl::desc("Distinguish call stacks only by their outermost this many functions (0=unlimited)"),
+               cl::value_desc("depth"));
+
+  // Define a command-line option for merging all recursive calls to
+  // a function into a single call stack.
+  cl::opt<bool>
+  CollapseRecursion("bf-collapse-recursion", cl::init(false), cl::NotHidden,
+                    cl::desc("Treat a call to a function already on the call stack as a return to that function"));
+
   // Define a command-line option for keeping track of unique bytes
   cl::opt<bool>
   TrackUniqueBytes("bf-unique-bytes", cl::init(false), cl::NotHidden,
@@ -69,11 +82,30 @@ namespace bytesflops_pass {
                cl::desc("Do not instrument the functions in the given list"),
                cl::value_desc("function,..."));
 
-  // Define a command-line option for enabling thread safety (at the
-  // cost of increasing execution time).
+  // Define a command-line option for enabling thread safety.  Counters
+  // are always per-thread; this option protects the shared analysis
+  // data structures (unique bytes, reuse distance, etc.).
   cl::opt<bool>
   ThreadSafety("bf-thread-safe", cl::init(false), cl::NotHidden,
-               cl::desc("Generate slower but thread-safe instrumentation"));
+               cl::desc("Support instrumented code running in multiple threads"));
+
+  // Define a command-line option for selecting how instrumented code
+  // accesses the run-time library's thread-local counters.  The
+  // default, initial-exec, turns each counter access into a single
+  // offset from the thread pointer; general-dynamic, which calls
+  // __tls_get_addr(), is needed only if the run-time library may be
+  // loaded with dlopen().
+  cl::opt<GlobalVariable::ThreadLocalMode>
+  CounterTLSModel("bf-tls-model", cl::init(GlobalVariable::InitialExecTLSModel),
+                  cl::NotHidden,
+                  cl::desc("Thread-local storage model for accessing counters"),
+                  cl::values(clEnumValN(GlobalVariable::GeneralDynamicTLSModel, "general-dynamic",
+                                        "Allow the run-time library to be loaded with dlopen()"),
+                             clEnumValN(GlobalVariable::InitialExecTLSModel, "initial-exec",
+                                        "Require the run-time library to be loaded at program start-up (default)"),
+                             clEnumValN(GlobalVariable::LocalExecTLSModel, "local-exec",
+                                        "Require the run-time library to be linked into the executable"),
+                             clEnumValEnd));
 
   // Define a command-line option for tallying vector operations.
   cl::opt<bool>
@@ -97,6 +129,80 @@ namespace bytesflops_pass {
                cl::desc("Treat addresses not touched after this many accesses as untouched"),
                cl::value_desc("accesses"));
 
+  // Define a command-line option for the granularity at which to
+  // measure reuse distance.
+  cl::opt<unsigned long long>
+  ReuseDistGran("bf-reuse-dist-gran", cl::init(1), cl::NotHidden,
+                cl::desc("Measure reuse distance in units of this many bytes (1=byte, 8=word, 64=cache line)"),
+                cl::value_desc("bytes"));
+
+  // Define a command-line option for also computing reuse distance
+  // per function (or per call stack).
+  cl::opt<bool>
+  ReuseDistByFunc("bf-reuse-dist-by-func", cl::init(false), cl::NotHidden,
+                  cl::desc("With -bf-by-func, also compute reuse distance for each function"));
+
+  // Define a command-line option for selecting the algorithm used to
+  // compute reuse distance.
+  cl::opt<bf_reuse_engine_t>
+  ReuseEngine("bf-reuse-engine", cl::init(BF_REUSE_ENGINE_SPLAY), cl::NotHidden,
+              cl::desc("Algorithm to use for computing reuse distance"),
+              cl::values(clEnumValN(BF_REUSE_ENGINE_SPLAY,   "splay",   "Splay tree (default)"),
+                         clEnumValN(BF_REUSE_ENGINE_FENWICK, "fenwick", "Fenwick tree"),
+                         clEnumValEnd));
+
+  // Define a command-line option for sampling addresses when
+  // computing reuse distance.
+  cl::opt<unsigned long long>
+  ReuseSample("bf-reuse-sample", cl::init(1), cl::NotHidden,
+              cl::desc("Compute reuse distance from only 1 in this many addresses (1=all)"),
+              cl::value_desc("period"));
+
+  // Define a command-line option for outputting a miss-ratio curve.
+  cl::list<string>
+  MissRatioSizes("bf-mrc", cl::NotHidden, cl::ZeroOrMore, cl::CommaSeparated,
+                 cl::ValueOptional,
+                 cl::desc("Output the LRU miss ratio at each of the given cache sizes (default: 32K,256K,1M,32M)"),
+                 cl::value_desc("bytes"));
+
+  // Define a command-line option for bounding the memory used to
+  // compute reuse distance.
+  cl::opt<unsigned long long>
+  ReuseSampleMax("bf-reuse-sample-max", cl::init(0), cl::NotHidden,
+                 cl::desc("Sample addresses adaptively to compute reuse distance from at most this many (0=unlimited)"),
+                 cl::value_desc("addresses"));
+
+  // Define a command-line option for tallying simple loops' counters
+  // once per loop instead of once per iteration.
+  cl::opt<bool>
+  HoistLoopCounters("bf-hoist-loops", cl::init(true), cl::NotHidden,
+                    cl::desc("Tally counters once per loop for loops with a computable trip count"));
+
+  // Define a command-line option for counting control-flow edges
+  // instead of updating every counter in every basic block.
+  cl::opt<bool>
+  EdgeProfile("bf-edge-profile", cl::init(false), cl::NotHidden,
+              cl::desc("Count a minimal set of control-flow edges and reconstruct all other counters at exit"));
+
+  // Define a command-line option for keeping counters in function-local
+  // variables that are flushed only before calls and returns.
+  cl::opt<bool>
+  LocalCounters("bf-local-counters", cl::init(false), cl::NotHidden,
+                cl::desc("Keep counters in registers, flushing them only before calls and returns"));
+
+  // Define a command-line option for buffering the addresses that
+  // -bf-unique-bytes and -bf-reuse-dist process.
+  cl::opt<unsigned long long>
+  TraceBufferEntries("bf-trace-buffer", cl::init(0), cl::NotHidden,
+                     cl::desc("Buffer this many memory accesses per thread before processing them (0=don't buffer)"),
+                     cl::value_desc("entries"));
+
+  // Define a command-line option for processing buffered addresses on
+  // background threads.
+  cl::opt<bool>
+  AsyncAnalysis("bf-async-analysis", cl::init(false), cl::NotHidden,
+                cl::desc("Process buffered memory accesses on background threads"));
+
   static RegisterPass<BytesFlops> H("bytesflops", "Bytes:flops instrumentation");
 
 }  // namespace bytesflops_pass
@@ -7,13 +7,19 @@
  */
 
 #include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpander.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/GlobalValue.h"
 #include "llvm/IR/Instruction.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/PassManager.h"
 #include "llvm/Pass.h"
@@ -21,11 +27,15 @@
 #include "llvm/IR/InstIterator.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+#include "llvm/Transforms/Utils/PromoteMemToReg.h"
 #include "llvm/Transforms/Utils/UnifyFunctionExitNodes.h"
 #include <fstream>
 #include <sstream>
 #include <vector>
 #include <set>
+#include <map>
 #include "byfl-common.h"
 
 using namespace std;
@@ -45,6 +55,14 @@ namespace bytesflops_pass {
   // names but also immediate parents.
   extern cl::opt<bool> TrackCallStack;
 
+  // Define a command-line option for limiting the depth of the call
+  // stacks that -bf-call-stack distinguishes.
+  extern cl::opt<unsigned long long> MaxCallDepth;
+
+  // Define a command-line option for merging all recursive calls to
+  // a function into a single call stack.
+  extern cl::opt<bool> CollapseRecursion;
+
   // Define a command-line option for keeping track of unique bytes.
   extern cl::opt<bool> TrackUniqueBytes;
 
@@ -73,10 +91,13 @@ namespace bytesflops_pass {
   // instrument, including all others.
   extern cl::list<string> ExcludedFunctions;
 
-  // Define a command-line option for enabling thread safety (at the
-  // cost of increasing execution time).
+  // Define a command-line option for enabling thread safety.
   extern cl::opt<bool> ThreadSafety;
 
+  // Define a command-line option for selecting how instrumented code
+  // accesses the run-time library's thread-local counters.
+  extern cl::opt<GlobalVariable::ThreadLocalMode> CounterTLSModel;
+
   // Define a command-line option for tallying vector operations.
   extern cl::opt<bool> TallyVectors;
 
@@ -88,6 +109,49 @@ namespace bytesflops_pass {
   // Define a command-line option for pruning reuse distance.
   extern cl::opt<unsigned long long> MaxReuseDist;
 
+  // Define a command-line option for the granularity at which to
+  // measure reuse distance.
+  extern cl::opt<unsigned long long> ReuseDistGran;
+
+  // Define a command-line option for also computing reuse distance
+  // per function (or per call stack).
+  extern cl::opt<bool> ReuseDistByFunc;
+
+  // Define a command-line option for selecting the algorithm used to
+  // compute reuse distance.
+  extern cl::opt<bf_reuse_engine_t> ReuseEngine;
+
+  // Define a command-line option for sampling addresses when
+  // computing reuse distance.
+  extern cl::opt<unsigned long long> ReuseSample;
+
+  // Define a command-line option for bounding the memory used to
+  // compute reuse distance.
+  extern cl::opt<unsigned long long> ReuseSampleMax;
+
+  // Define a command-line option for outputting a miss-ratio curve.
+  extern cl::list<string> MissRatioSizes;
+
+  // Define a command-line option for tallying simple loops' counters
+  // once per loop instead of once per iteration.
+  extern cl::opt<bool> HoistLoopCounters;
+
+  // Define a command-line option for counting control-flow edges
+  // instead of updating every counter in every basic block.
+  extern cl::opt<bool> EdgeProfile;
+
+  // Define a command-line option for keeping counters in function-local
+  // variables that are flushed only before calls and returns.
+  extern cl::opt<bool> LocalCounters;
+
+  // Define a command-line option for buffering the addresses that
+  // -bf-unique-bytes and -bf-reuse-dist process.
+  extern cl::opt<unsigned long long> TraceBufferEntries;
+
+  // Define a command-line option for processing buffered addresses on
+  // background threads.
+  extern cl::opt<bool> AsyncAnalysis;
+
   // Destructively remove all instances of a given character from a string.
   extern void remove_all_instances(string& some_string, char some_char);
 
@@ -96,6 +160,10 @@ namespace bytesflops_pass {
   // elements and need to be recombined.
   extern set<string>* parse_function_names(vector<string>& funclist);
 
+  // Parse a list of cache sizes, each optionally suffixed with K, M,
+  // or G, into a comma-separated list of byte counts.
+  extern string parse_cache_sizes(vector<string>& sizelist);
+
 
   // Define a pass over each basic block in the module.
   struct BytesFlops : public FunctionPass {
@@ -134,6 +202,11 @@ namespace bytesflops_pass {
     GlobalVariable* fp_bits_var;  // Global reference to bf_fp_bits_count, a 64-bit FP-bit counter
     GlobalVariable* op_var;    // Global reference to bf_op_count, a 64-bit operation counter
     GlobalVariable* op_bits_var;   // Global reference to bf_op_bits_count, a 64-bit operation-bit counter
+    GlobalVariable* ubytes_dir_var;         // Global reference to bf_ubytes_directory, the unique-bytes shadow directory
+    GlobalVariable* ubytes_empty_leaf_var;  // Global reference to bf_ubytes_empty_leaf, a shadow-directory leaf with no bit vectors
+    GlobalVariable* ubytes_scratch_var;     // Global reference to bf_ubytes_scratch, a word to which to write shadow bits we can't set inline
+    GlobalVariable* trace_pos_var;          // Global reference to bf_trace_pos, the next free record in the trace buffer
+    GlobalVariable* trace_end_var;          // Global reference to bf_trace_end, the end of the trace buffer
     uint64_t static_loads;   // Number of static load instructions
     uint64_t static_stores;  // Number of static store instructions
     uint64_t static_flops;   // Number of static floating-point instructions
@@ -152,16 +225,21 @@ namespace bytesflops_pass {
     Function* tally_function;    // Pointer to bf_incr_func_tally()
     Function* push_bb;           // Pointer to bf_push_basic_block()
     Function* pop_bb;            // Pointer to bf_pop_basic_block()
-    Function* take_mega_lock;    // Pointer to bf_acquire_mega_lock()
-    Function* release_mega_lock; // Pointer to bf_release_mega_lock()
     Function* tally_vector;      // Pointer to bf_tally_vector_operation()
     Function* reuse_dist_prog;   // Pointer to bf_reuse_dist_addrs_prog()
+    Function* reuse_dist_func;   // Pointer to bf_reuse_dist_addrs_func()
+    Function* register_edge_profile;  // Pointer to bf_register_edge_profile()
+    Function* register_func_table;    // Pointer to bf_register_func_table()
+    Function* drain_trace_buffer;     // Pointer to bf_drain_trace_buffer()
     Function* memset_intrinsic;  // Pointer to LLVM's memset() intrinsic
     Function* init_func;         // Pointer to EAUDIT_init()
     Function* push_func;         // Pointer to EAUDIT_push()
     Function* pop_func;          // Pointer to EAUDIT_pop()
     Function* shutdown_func;     // Pointer to EAUDIT_shutdown()
     StringMap<Constant*> func_name_to_arg;   // Map from a function name to an IR function argument
+    StringMap<uint32_t> func_name_to_id;     // Map from a function name to a module-local function ID
+    vector<Constant*> func_id_names;         // Function names indexed by module-local function ID
+    GlobalVariable* func_id_base_var;        // Program-wide ID of this module's function 0
     set<string>* instrument_only;   // Set of functions to instrument; NULL=all
     set<string>* dont_instrument;   // Set of functions not to instrument; NULL=none
     ConstantInt* not_end_of_bb;     // 0, not at the end of a basic block
@@ -170,19 +248,85 @@ namespace bytesflops_pass {
     ConstantInt* zero;        // A 64-bit constant "0"
     ConstantInt* one;         // A 64-bit constant "1"
 
+    // Constant counter increments not yet applied to the current
+    // basic block, keyed by {variable, array index (-1=scalar)} and
+    // listed in the order in which they were first requested
+    typedef pair<Constant*, int64_t> counter_ref_t;
+    vector<counter_ref_t> pending_counters;
+    map<counter_ref_t, uint64_t> pending_increments;
+
     // Insert after a given instruction some code to increment a
-    // global variable.
+    // global variable.  Constant increments are deferred until the
+    // next call to flush_pending_increments().
     void increment_global_variable(BasicBlock::iterator& iter,
                                    Constant* global_var,
                                    Value* increment);
 
     // Insert after a given instruction some code to increment an
-    // element of a global array.
+    // element of a global array.  Constant increments of constant
+    // indexes are deferred until the next call to
+    // flush_pending_increments().
     void increment_global_array(BasicBlock::iterator& insert_before,
                                 Constant* global_var,
                                 Value* idx,
                                 Value* increment);
 
+    // Describe a single-block loop whose counters are tallied once in
+    // its preheader instead of on every iteration.
+    typedef struct {
+      Value* trip_count;      // Number of times the loop body executes
+      vector<pair<counter_ref_t, uint64_t> > increments;  // Counter increments for one iteration
+      int must_clear;         // Counters that the loop body modifies
+    } hoisted_loop_t;
+
+    // Function-local copies of the counters, used when the current
+    // function's counters are kept in registers, and the placeholder
+    // instructions before which the copies are added to the counters
+    bool localize_counters;
+    map<counter_ref_t, AllocaInst*> local_counters;
+    vector<Instruction*> local_flush_points;
+
+    // Calls to bf_assoc_addresses_with_prog() that should be executed
+    // only when the unique-bytes shadow directory can't be updated inline
+    vector<CallInst*> ubytes_slow_calls;
+
+    // Describe a memory access to append to the trace buffer.
+    typedef struct {
+      CallInst* drain_call;   // Call to bf_drain_trace_buffer(), to be made conditional
+      Value* address;         // Address accessed
+      uint64_t info;          // BF_TRACE_* flags | number of bytes accessed
+    } trace_site_t;
+    vector<trace_site_t> trace_sites;
+
+    // Describe the edge profile of a single function.
+    typedef struct {
+      Constant* funcname;    // Function name as passed to the run-time library
+      Constant* cfg;         // Static description of the control-flow graph
+      Constant* counters;    // Execution counts of non-spanning-tree edges
+    } edge_profile_t;
+    vector<edge_profile_t> edge_profiles;   // All functions profiled with -bf-edge-profile
+
+    // Add a constant to the pending increment of a counter.
+    void defer_increment(Constant* global_var, int64_t idx, uint64_t increment);
+
+    // Insert before a given instruction a single update of each
+    // counter with a pending increment.
+    void flush_pending_increments(Module* module, BasicBlock::iterator& insert_before);
+
+    // Return the function-local copy of a counter, creating it if
+    // necessary, or NULL if the counter should be updated in place.
+    AllocaInst* find_local_counter(Constant* global_var, int64_t idx);
+
+    // Insert before a given instruction a placeholder for code to add
+    // every function-local counter to its global counterpart.
+    void insert_local_flush(Module* module, StringRef function_name,
+                            BasicBlock::iterator& insert_before);
+
+    // Allocate and zero all function-local counters in a given basic
+    // block, replace each flush placeholder with real code, and
+    // promote the counters to registers.
+    void expand_local_counters(Module* module, BasicBlock* entry_block);
+
     // Mark a variable as "used" (not eligible for dead-code elimination).
     void mark_as_used(Module& module, Constant* protected_var);
 
@@ -231,7 +375,21 @@ namespace bytesflops_pass {
     // Map a function name (string) to an argument to an IR function call.
     Constant* map_func_name_to_arg (Module* module, StringRef funcname);
 
-    // Declare an external variable.
+    // Map a function name (string) to a module-local function ID.
+    ConstantInt* map_func_name_to_local_id (Module* module, StringRef funcname);
+
+    // Insert code to compute a function's program-wide ID, and return
+    // the result.
+    Value* map_func_name_to_id (Module* module, StringRef funcname,
+                                Instruction* insert_before);
+    Value* map_func_name_to_id (Module* module, StringRef funcname,
+                                BasicBlock* insert_at_end);
+
+    // Add a constructor that registers the module's function names
+    // with the run-time library.
+    void register_func_ids (Module& module);
+
+    // Declare an external thread-local variable.
     GlobalVariable* declare_global_var(Module& module, Type* var_type,
                                        StringRef var_name, bool is_const=false);
 
@@ -241,12 +399,15 @@ namespace bytesflops_pass {
                                 uint64_t num_elts,
                                 BasicBlock::iterator& insert_before);
 
+    // Tally the type of a basic block's terminator.
+    void tally_terminator (Module* module, BasicBlock::iterator& insert_before);
+
     // Insert code at the end of a basic block.
     void insert_end_bb_code (Module* module, StringRef function_name,
-                             int& must_clear, BasicBlock::iterator& insert_before);
+                             int& must_clear, BasicBlock::iterator& insert_before,
+                             bool tally_end=true);
 
-    // Wrap CallInst::Create() with code to acquire and release the
-    // mega-lock when instrumenting in thread-safe mode.
+    // Wrap CallInst::Create() with a more convenient interface.
     void callinst_create(Value* function, ArrayRef<Value*> args,
                          Instruction* insert_before);
 
@@ -295,6 +456,62 @@ namespace bytesflops_pass {
                           BasicBlock::iterator& insert_before,
                           int& must_clear);
 
+    // Instrument a single instruction.
+    void instrument_instruction(Module* module,
+                                StringRef function_name,
+                                BasicBlock::iterator& iter,
+                                LLVMContext& bbctx,
+                                const DataLayout& target_data,
+                                BasicBlock::iterator& insert_before,
+                                int& must_clear);
+
+    // Return true if the command-line options permit hoisting loop
+    // counters into preheaders.
+    static bool may_hoist_loops(void);
+
+    // Find all loops whose counters can be tallied once in the loop's
+    // preheader, and insert code to compute their trip counts.
+    void find_hoistable_loops(Module* module,
+                              Function& function,
+                              StringRef function_name,
+                              map<BasicBlock*, hoisted_loop_t>& hoisted_loops,
+                              set<BasicBlock*>& hoisted_bodies,
+                              set<Instruction*>& trip_count_code);
+
+    // Insert code to increment each counter by a hoisted loop's
+    // per-iteration increment times its trip count.
+    void insert_hoisted_increments(Module* module,
+                                   hoisted_loop_t& loop_info,
+                                   BasicBlock::iterator& insert_before,
+                                   int& must_clear);
+
+    // Return true if we can reconstruct a function's counters from
+    // its edge profile.
+    bool can_profile_edges(Function& function);
+
+    // Move a basic block's pending counter increments into a table of
+    // per-block static tallies.
+    void record_block_tallies(Module* module,
+                              BasicBlock::iterator& insert_before,
+                              vector<uint64_t>& block_tallies);
+
+    // Insert counters on all control-flow edges not in a maximum
+    // spanning tree of the function's control-flow graph, and
+    // remember how to reconstruct the function's counters from them.
+    void insert_edge_counters(Module* module,
+                              Function& function,
+                              StringRef function_name,
+                              vector<uint64_t>& block_tallies);
+
+    // Precede each call to bf_assoc_addresses_with_prog() with code
+    // to update the unique-bytes shadow directory inline, and execute
+    // the call only if that code can't do so.
+    void inline_unique_bytes_fast_paths(Module* module);
+
+    // Append a record to the trace buffer at each trace site, draining
+    // the buffer first if it's full.
+    void insert_trace_appends(Module* module);
+
     // Do most of the instrumentation work: Walk each instruction in
     // each basic block and add instrumentation code around loads,
     // stores, flops, etc.
@@ -324,10 +541,15 @@ namespace bytesflops_pass {
     void add_energy_instrumentation(Module* module, Function& function, 
                                     StringRef function_name);
 
-    // Indicate that we need access to DataLayout.
+    // Indicate that we need access to DataLayout, to loop structure,
+    // and -- only if we might hoist loop counters -- to loop trip
+    // counts.
     virtual void getAnalysisUsage(AnalysisUsage &AU) const {
       AU.addRequired<DataLayoutPass>();
       AU.addRequired<UnifyFunctionExitNodes>();
+      AU.addRequired<LoopInfo>();
+      if (may_hoist_loops())
+        AU.addRequired<ScalarEvolution>();
     }
 
   public:
@@ -340,6 +562,9 @@ namespace bytesflops_pass {
     // Insert code for incrementing our byte, flop, etc. counters.
     virtual bool runOnFunction(Function& function);
 
+    // Register all edge profiles with the run-time library.
+    virtual bool doFinalization(Module& module);
+
     // Output what we instrumented.
     virtual void print(raw_ostream &outfile, const Module *module) const;
   };
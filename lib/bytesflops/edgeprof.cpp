@@ -0,0 +1,286 @@
+/*
+ * Instrument code to keep track of run-time behavior:
+ * edge profiling (counting a minimal set of control-flow edges)
+ *
+ * By Scott Pakin <pakin@lanl.gov>
+ * and Pat McCormick <pat@lanl.gov>
+ */
+
+#include "bytesflops.h"
+
+namespace bytesflops_pass {
+
+  // Describe a single edge in a function's control-flow graph.
+  typedef struct {
+    BasicBlock* source;      // Source basic block (NULL=function exit)
+    unsigned int succ_num;   // Index of the target in the source's successor list
+    uint64_t source_id;      // Source basic block's index
+    uint64_t target_id;      // Target basic block's index
+    uint64_t weight;         // Estimated relative execution frequency
+    uint64_t counter;        // Counter index or BF_EDGE_NO_COUNTER
+  } cfg_edge_t;
+
+  // Sort edges from highest to lowest weight.
+  static bool compare_edge_weights(const cfg_edge_t& one, const cfg_edge_t& two)
+  {
+    return one.weight > two.weight;
+  }
+
+  // Find the representative of a node's set in a union-find forest.
+  static uint64_t find_set(vector<uint64_t>& parent, uint64_t node)
+  {
+    while (parent[node] != node) {
+      parent[node] = parent[parent[node]];
+      node = parent[node];
+    }
+    return node;
+  }
+
+  // Return true if we can reconstruct a function's counters from its
+  // edge profile.  We currently reject functions that can transfer
+  // control to a landing pad or to an arbitrary address.
+  bool BytesFlops::can_profile_edges(Function& function) {
+    for (Function::iterator func_iter = function.begin();
+         func_iter != function.end();
+         func_iter++) {
+      TerminatorInst* terminator = func_iter->getTerminator();
+      if (isa<InvokeInst>(terminator) || isa<IndirectBrInst>(terminator))
+        return false;
+    }
+    return true;
+  }
+
+  // Move a basic block's pending counter increments into a table of
+  // per-block static tallies.  Increments of counters that have no
+  // column in the table are applied immediately instead.
+  void BytesFlops::record_block_tallies(Module* module,
+                                        BasicBlock::iterator& insert_before,
+                                        vector<uint64_t>& block_tallies) {
+    // Map each scalar counter to its column.
+    map<Constant*, size_t> scalar_column;
+    scalar_column[load_var] = BF_EDGE_LOADS;
+    scalar_column[store_var] = BF_EDGE_STORES;
+    scalar_column[load_inst_var] = BF_EDGE_LOAD_INS;
+    scalar_column[store_inst_var] = BF_EDGE_STORE_INS;
+    scalar_column[flop_var] = BF_EDGE_FLOPS;
+    scalar_column[fp_bits_var] = BF_EDGE_FP_BITS;
+    scalar_column[op_var] = BF_EDGE_OPS;
+    scalar_column[op_bits_var] = BF_EDGE_OP_BITS;
+
+    // Copy each pending increment into its column.
+    size_t first_col = block_tallies.size();
+    block_tallies.resize(first_col + BF_EDGE_NUM_COLS, 0);
+    vector<counter_ref_t> other_counters;
+    map<counter_ref_t, uint64_t> other_increments;
+    for (vector<counter_ref_t>::iterator ctr_iter = pending_counters.begin();
+         ctr_iter != pending_counters.end();
+         ctr_iter++) {
+      Constant* global_var = ctr_iter->first;
+      int64_t idx = ctr_iter->second;
+      uint64_t increment = pending_increments[*ctr_iter];
+      map<Constant*, size_t>::iterator col_iter = scalar_column.find(global_var);
+      if (idx < 0 && col_iter != scalar_column.end())
+        block_tallies[first_col + col_iter->second] += increment;
+      else if (global_var == terminator_var && idx < BF_END_BB_NUM)
+        block_tallies[first_col + BF_EDGE_TERMINATORS + idx] += increment;
+      else if (global_var == mem_intrinsics_var && idx < BF_NUM_MEM_INTRIN)
+        block_tallies[first_col + BF_EDGE_MEM_INTRIN + idx] += increment;
+      else {
+        other_counters.push_back(*ctr_iter);
+        other_increments[*ctr_iter] = increment;
+      }
+    }
+
+    // Apply all remaining increments.
+    pending_counters = other_counters;
+    pending_increments = other_increments;
+    flush_pending_increments(module, insert_before);
+  }
+
+  // Insert counters on all control-flow edges not in a maximum
+  // spanning tree of the function's control-flow graph, and remember
+  // how to reconstruct the function's counters from them.  The
+  // spanning tree includes a virtual edge from function exit to
+  // function entry so the run-time library can solve for every other
+  // edge using flow conservation (cf. Ball and Larus, "Optimally
+  // Profiling and Tracing Programs", TOPLAS 16(4), 1994).
+  void BytesFlops::insert_edge_counters(Module* module,
+                                        Function& function,
+                                        StringRef function_name,
+                                        vector<uint64_t>& block_tallies) {
+    // Number each basic block.  Block 0 is the entry block, and block
+    // num_blocks represents function exit.
+    map<BasicBlock*, uint64_t> block_id;
+    uint64_t num_blocks = 0;
+    for (Function::iterator func_iter = function.begin();
+         func_iter != function.end();
+         func_iter++)
+      block_id[&*func_iter] = num_blocks++;
+    uint64_t exit_id = num_blocks;
+
+    // Enumerate every edge in the control-flow graph.  Weight each
+    // edge by its source's loop depth so that edges within loops are
+    // preferentially left uninstrumented.
+    LoopInfo& loop_info = getAnalysis<LoopInfo>();
+    vector<cfg_edge_t> edges;
+    cfg_edge_t edge;
+    edge.source = NULL;
+    edge.succ_num = 0;
+    edge.source_id = exit_id;
+    edge.target_id = 0;
+    edge.weight = ~(uint64_t)0;
+    edge.counter = BF_EDGE_NO_COUNTER;
+    edges.push_back(edge);
+    for (Function::iterator func_iter = function.begin();
+         func_iter != function.end();
+         func_iter++) {
+      BasicBlock* bb = &*func_iter;
+      TerminatorInst* terminator = bb->getTerminator();
+      edge.source = bb;
+      edge.source_id = block_id[bb];
+      edge.weight = 1 + loop_info.getLoopDepth(bb);
+      unsigned int num_succs = terminator->getNumSuccessors();
+      if (num_succs == 0) {
+        edge.succ_num = 0;
+        edge.target_id = exit_id;
+        edges.push_back(edge);
+      }
+      for (unsigned int s = 0; s < num_succs; s++) {
+        edge.succ_num = s;
+        edge.target_id = block_id[terminator->getSuccessor(s)];
+        edges.push_back(edge);
+      }
+    }
+
+    // Find a maximum spanning tree using Kruskal's algorithm.  Every
+    // edge not in the tree needs a counter.
+    stable_sort(edges.begin(), edges.end(), compare_edge_weights);
+    vector<uint64_t> parent(num_blocks + 1);
+    for (uint64_t b = 0; b <= num_blocks; b++)
+      parent[b] = b;
+    uint64_t num_counters = 0;
+    for (vector<cfg_edge_t>::iterator edge_iter = edges.begin();
+         edge_iter != edges.end();
+         edge_iter++) {
+      uint64_t source_set = find_set(parent, edge_iter->source_id);
+      uint64_t target_set = find_set(parent, edge_iter->target_id);
+      if (source_set == target_set)
+        edge_iter->counter = num_counters++;
+      else
+        parent[source_set] = target_set;
+    }
+
+    // Allocate the function's edge counters.
+    LLVMContext& globctx = module->getContext();
+    IntegerType* i64type = Type::getInt64Ty(globctx);
+    Constant* counters = ConstantPointerNull::get(Type::getInt64PtrTy(globctx));
+    if (num_counters > 0) {
+      ArrayType* counters_type = ArrayType::get(i64type, num_counters);
+      counters = new GlobalVariable(*module, counters_type, false,
+                                    GlobalValue::PrivateLinkage,
+                                    ConstantAggregateZero::get(counters_type),
+                                    "bf_edge_counts");
+    }
+
+    // Insert code to increment each counter.  Edges are instrumented
+    // in their source block when it has only one successor, in their
+    // target block when it has only one predecessor, and in a new
+    // basic block otherwise.
+    for (vector<cfg_edge_t>::iterator edge_iter = edges.begin();
+         edge_iter != edges.end();
+         edge_iter++) {
+      if (edge_iter->counter == BF_EDGE_NO_COUNTER)
+        continue;
+      TerminatorInst* terminator = edge_iter->source->getTerminator();
+      Instruction* insert_before;
+      if (edge_iter->target_id == exit_id || terminator->getNumSuccessors() == 1)
+        insert_before = terminator;
+      else {
+        BasicBlock* target = terminator->getSuccessor(edge_iter->succ_num);
+        if (target->getSinglePredecessor() != NULL)
+          insert_before = target->getFirstInsertionPt();
+        else {
+          BasicBlock* new_bb = SplitCriticalEdge(terminator, edge_iter->succ_num, this);
+          insert_before = new_bb->getTerminator();
+        }
+      }
+      vector<Constant*> indexes;
+      indexes.push_back(zero);
+      indexes.push_back(ConstantInt::get(globctx, APInt(64, edge_iter->counter)));
+      Constant* counter_ptr = ConstantExpr::getInBoundsGetElementPtr(counters, indexes);
+      if (ThreadSafety)
+        new AtomicRMWInst(AtomicRMWInst::Add, counter_ptr, one,
+                          Monotonic, CrossThread, insert_before);
+      else {
+        LoadInst* old_count = new LoadInst(counter_ptr, "edge_count", false, insert_before);
+        BinaryOperator* new_count =
+          BinaryOperator::Create(Instruction::Add, old_count, one,
+                                 "new_edge_count", insert_before);
+        new StoreInst(new_count, counter_ptr, false, insert_before);
+      }
+    }
+
+    // Describe the function's control-flow graph to the run-time
+    // library.
+    vector<uint64_t> cfg;
+    cfg.push_back(num_blocks);
+    cfg.push_back(edges.size());
+    cfg.insert(cfg.end(), block_tallies.begin(), block_tallies.end());
+    for (vector<cfg_edge_t>::iterator edge_iter = edges.begin();
+         edge_iter != edges.end();
+         edge_iter++) {
+      cfg.push_back(edge_iter->source_id);
+      cfg.push_back(edge_iter->target_id);
+      cfg.push_back(edge_iter->counter);
+    }
+    Constant* cfg_data = ConstantDataArray::get(globctx, cfg);
+    GlobalVariable* cfg_var =
+      new GlobalVariable(*module, cfg_data->getType(), true,
+                         GlobalValue::PrivateLinkage, cfg_data, "bf_cfg");
+
+    // Remember the function's edge profile so we can register it with
+    // the run-time library.
+    edge_profile_t profile;
+    profile.funcname = map_func_name_to_arg(module, function_name);
+    profile.cfg = ConstantExpr::getPointerCast(cfg_var, Type::getInt64PtrTy(globctx));
+    profile.counters = ConstantExpr::getPointerCast(counters, Type::getInt64PtrTy(globctx));
+    edge_profiles.push_back(profile);
+  }
+
+  // Register all function IDs and edge profiles with the run-time
+  // library.
+  bool BytesFlops::doFinalization(Module& module) {
+    // Register the function names to which we assigned IDs.
+    bool modified = false;
+    if (!func_id_names.empty()) {
+      register_func_ids(module);
+      modified = true;
+    }
+
+    // Do nothing more if we didn't profile any edges.
+    if (edge_profiles.empty())
+      return modified;
+
+    // Construct a constructor that passes each edge profile to
+    // bf_register_edge_profile().
+    LLVMContext& globctx = module.getContext();
+    FunctionType* void_func_type = FunctionType::get(Type::getVoidTy(globctx), false);
+    Function* ctor = Function::Create(void_func_type, GlobalValue::InternalLinkage,
+                                      "bf_register_edge_profiles", &module);
+    BasicBlock* ctor_body = BasicBlock::Create(globctx, "entry", ctor);
+    for (vector<edge_profile_t>::iterator prof_iter = edge_profiles.begin();
+         prof_iter != edge_profiles.end();
+         prof_iter++) {
+      vector<Value*> arg_list;
+      arg_list.push_back(prof_iter->funcname);
+      arg_list.push_back(prof_iter->cfg);
+      arg_list.push_back(prof_iter->counters);
+      callinst_create(register_edge_profile, arg_list, ctor_body);
+    }
+    ReturnInst::Create(globctx, ctor_body);
+    appendToGlobalCtors(module, ctor, 65535);
+    edge_profiles.clear();
+    return true;
+  }
+
+}  // namespace bytesflops_pass
@@ -41,6 +41,40 @@ namespace bytesflops_pass {
                       some_string.end());
   }
 
+  // Parse a list of cache sizes, each optionally suffixed with K, M,
+  // or G (powers of 1024), into a comma-separated list of byte counts.
+  // An empty list produces a default set of sizes.
+  string parse_cache_sizes(vector<string>& sizelist) {
+    vector<string> default_sizes;
+    if (sizelist.size() == 0 || (sizelist.size() == 1 && sizelist[0].empty())) {
+      default_sizes.push_back("32K");
+      default_sizes.push_back("256K");
+      default_sizes.push_back("1M");
+      default_sizes.push_back("32M");
+    }
+    vector<string>& all_sizes = default_sizes.empty() ? sizelist : default_sizes;
+    string result;
+    for (vector<string>::iterator size_iter = all_sizes.begin();
+         size_iter != all_sizes.end();
+         size_iter++) {
+      const char* size_str = size_iter->c_str();
+      char* suffix;
+      uint64_t size = strtoull(size_str, &suffix, 10);
+      switch (*suffix) {
+        case 'G': case 'g': size *= 1024;   // Fall through
+        case 'M': case 'm': size *= 1024;   // Fall through
+        case 'K': case 'k': size *= 1024; suffix++; break;
+        default: break;
+      }
+      if (suffix == size_str || *suffix != '\0' || size == 0)
+        report_fatal_error(string("Invalid cache size \"") + *size_iter + '"');
+      if (!result.empty())
+        result += ',';
+      result += to_string(size);
+    }
+    return result;
+  }
+
   // Parse a list of function names into a set.  The trick is that (1)
   // demangled C++ function names are split (at commas) across list
   // elements and need to be recombined, and (2) the form "@filename"
@@ -88,8 +122,19 @@ namespace bytesflops_pass {
   void BytesFlops::increment_global_variable(BasicBlock::iterator& insert_before,
                                              Constant* global_var,
                                              Value* increment) {
+    // Defer constant increments so they can be coalesced.
+    if (ConstantInt* const_inc = dyn_cast<ConstantInt>(increment)) {
+      defer_increment(global_var, -1, const_inc->getZExtValue());
+      return;
+    }
+
+    // Increment the function-local copy of the variable if there is one.
+    Value* counter = find_local_counter(global_var, -1);
+    if (counter == NULL)
+      counter = global_var;
+
     // %0 = load i64* @<global_var>, align 8
-    LoadInst* load_var = new LoadInst(global_var, "gvar", false, insert_before);
+    LoadInst* load_var = new LoadInst(counter, "gvar", false, insert_before);
 
     // %1 = add i64 %0, <increment>
     BinaryOperator* inc_var =
@@ -97,7 +142,7 @@ namespace bytesflops_pass {
                              "new_gvar", insert_before);
 
     // store i64 %1, i64* @<global_var>, align 8
-    new StoreInst(inc_var, global_var, false, insert_before);
+    new StoreInst(inc_var, counter, false, insert_before);
   }
 
   // Insert before a given instruction some code to increment an
@@ -106,6 +151,29 @@ namespace bytesflops_pass {
                                           Constant* global_var,
                                           Value* idx,
                                           Value* increment) {
+    // Defer constant increments so they can be coalesced.
+    ConstantInt* const_idx = dyn_cast<ConstantInt>(idx);
+    ConstantInt* const_inc = dyn_cast<ConstantInt>(increment);
+    if (const_idx && const_inc) {
+      defer_increment(global_var, int64_t(const_idx->getZExtValue()),
+                      const_inc->getZExtValue());
+      return;
+    }
+
+    // Increment the function-local copy of the element if there is one.
+    if (const_idx) {
+      AllocaInst* local_var =
+        find_local_counter(global_var, int64_t(const_idx->getZExtValue()));
+      if (local_var != NULL) {
+        LoadInst* load_var = new LoadInst(local_var, "lvar", false, insert_before);
+        BinaryOperator* inc_var =
+          BinaryOperator::Create(Instruction::Add, load_var, increment,
+                                 "new_lvar", insert_before);
+        new StoreInst(inc_var, local_var, false, insert_before);
+        return;
+      }
+    }
+
     // %1 = load i64** @<global_var>, align 8
     LoadInst* load_array = new LoadInst(global_var, "garray", false, insert_before);
     load_array->setAlignment(8);
@@ -126,6 +194,175 @@ namespace bytesflops_pass {
     store_inst->setAlignment(8);
   }
 
+  // Add a constant to the pending increment of a counter.
+  void BytesFlops::defer_increment(Constant* global_var, int64_t idx,
+                                   uint64_t increment) {
+    counter_ref_t counter(global_var, idx);
+    map<counter_ref_t, uint64_t>::iterator pend_iter = pending_increments.find(counter);
+    if (pend_iter == pending_increments.end()) {
+      pending_counters.push_back(counter);
+      pending_increments[counter] = increment;
+    }
+    else
+      pend_iter->second += increment;
+  }
+
+  // Insert before a given instruction a single update of each counter
+  // with a pending increment.  Each array's base address is loaded
+  // only once.
+  void BytesFlops::flush_pending_increments(Module* module,
+                                            BasicBlock::iterator& insert_before) {
+    LLVMContext& globctx = module->getContext();
+    map<Constant*, LoadInst*> array_bases;   // Base address of each array already loaded
+    for (vector<counter_ref_t>::iterator ctr_iter = pending_counters.begin();
+         ctr_iter != pending_counters.end();
+         ctr_iter++) {
+      Constant* global_var = ctr_iter->first;
+      int64_t idx = ctr_iter->second;
+      uint64_t increment = pending_increments[*ctr_iter];
+      if (increment == 0)
+        continue;
+      ConstantInt* inc_val = ConstantInt::get(globctx, APInt(64, increment));
+      AllocaInst* local_var = find_local_counter(global_var, idx);
+      if (local_var != NULL) {
+        // Function-local copy: load, add, and store the local variable.
+        LoadInst* load_var = new LoadInst(local_var, "lvar", false, insert_before);
+        BinaryOperator* inc_var =
+          BinaryOperator::Create(Instruction::Add, load_var, inc_val,
+                                 "new_lvar", insert_before);
+        new StoreInst(inc_var, local_var, false, insert_before);
+      }
+      else if (idx < 0) {
+        // Scalar: load, add, and store the global variable.
+        LoadInst* load_var = new LoadInst(global_var, "gvar", false, insert_before);
+        BinaryOperator* inc_var =
+          BinaryOperator::Create(Instruction::Add, load_var, inc_val,
+                                 "new_gvar", insert_before);
+        new StoreInst(inc_var, global_var, false, insert_before);
+      }
+      else {
+        // Array element: load the array's base address (once), then
+        // load, add, and store the element.
+        LoadInst*& load_array = array_bases[global_var];
+        if (load_array == NULL) {
+          load_array = new LoadInst(global_var, "garray", false, insert_before);
+          load_array->setAlignment(8);
+        }
+        ConstantInt* idx_val = ConstantInt::get(globctx, APInt(64, idx));
+        GetElementPtrInst* elt_ptr =
+          GetElementPtrInst::Create(load_array, idx_val, "idx_ptr", insert_before);
+        LoadInst* elt_val = new LoadInst(elt_ptr, "idx_val", false, insert_before);
+        elt_val->setAlignment(8);
+        BinaryOperator* inc_elt =
+          BinaryOperator::Create(Instruction::Add, elt_val, inc_val, "new_val", insert_before);
+        StoreInst* store_inst = new StoreInst(inc_elt, elt_ptr, false, insert_before);
+        store_inst->setAlignment(8);
+      }
+    }
+    pending_counters.clear();
+    pending_increments.clear();
+  }
+
+  // Return the function-local copy of a counter, creating it if
+  // necessary, or NULL if the counter should be updated in place.  New
+  // copies are not yet inserted into the function; see
+  // expand_local_counters().
+  AllocaInst* BytesFlops::find_local_counter(Constant* global_var, int64_t idx) {
+    if (!localize_counters)
+      return NULL;
+    counter_ref_t counter(global_var, idx);
+    AllocaInst*& local_var = local_counters[counter];
+    if (local_var == NULL)
+      local_var = new AllocaInst(Type::getInt64Ty(global_var->getContext()),
+                                 "bf_local_count");
+    return local_var;
+  }
+
+  // Insert before a given instruction a placeholder for code to add
+  // every function-local counter to its global counterpart.  The
+  // placeholder is needed because we don't know yet which counters
+  // the function will use.
+  void BytesFlops::insert_local_flush(Module* module, StringRef function_name,
+                                      BasicBlock::iterator& insert_before) {
+    // Insert a placeholder.
+    Instruction* placeholder =
+      new BitCastInst(zero, zero->getType(), "bf_flush", insert_before);
+    local_flush_points.push_back(placeholder);
+
+    // If we're instrumenting by function, associate the flushed
+    // counters with the current function so a callee doesn't claim
+    // them.
+    if (TallyByFunction) {
+      int must_clear = CLEAR_LOADS | CLEAR_STORES | CLEAR_FLOPS
+        | CLEAR_FP_BITS | CLEAR_OPS | CLEAR_OP_BITS;
+      insert_end_bb_code(module, function_name, must_clear, insert_before, false);
+    }
+  }
+
+  // Allocate and zero all function-local counters at the end of a
+  // given basic block, replace each flush placeholder with code to add
+  // every function-local counter to its global counterpart, and
+  // promote the function-local counters to registers.
+  void BytesFlops::expand_local_counters(Module* module, BasicBlock* entry_block) {
+    // Allocate and zero each function-local counter.
+    Instruction* entry_end = entry_block->getTerminator();
+    vector<AllocaInst*> allocas;
+    for (map<counter_ref_t, AllocaInst*>::iterator local_iter = local_counters.begin();
+         local_iter != local_counters.end();
+         local_iter++) {
+      AllocaInst* local_var = local_iter->second;
+      entry_block->getInstList().push_front(local_var);
+      new StoreInst(zero, local_var, false, entry_end);
+      allocas.push_back(local_var);
+    }
+
+    // Replace each placeholder with code to flush every counter.
+    for (vector<Instruction*>::iterator flush_iter = local_flush_points.begin();
+         flush_iter != local_flush_points.end();
+         flush_iter++) {
+      Instruction* placeholder = *flush_iter;
+      map<Constant*, LoadInst*> array_bases;   // Base address of each array already loaded
+      for (map<counter_ref_t, AllocaInst*>::iterator local_iter = local_counters.begin();
+           local_iter != local_counters.end();
+           local_iter++) {
+        Constant* global_var = local_iter->first.first;
+        int64_t idx = local_iter->first.second;
+        AllocaInst* local_var = local_iter->second;
+        Value* global_ptr = global_var;
+        if (idx >= 0) {
+          LoadInst*& load_array = array_bases[global_var];
+          if (load_array == NULL) {
+            load_array = new LoadInst(global_var, "garray", false, placeholder);
+            load_array->setAlignment(8);
+          }
+          ConstantInt* idx_val = ConstantInt::get(module->getContext(), APInt(64, idx));
+          global_ptr = GetElementPtrInst::Create(load_array, idx_val, "idx_ptr", placeholder);
+        }
+        LoadInst* local_val = new LoadInst(local_var, "lvar", false, placeholder);
+        LoadInst* global_val = new LoadInst(global_ptr, "gvar", false, placeholder);
+        global_val->setAlignment(8);
+        BinaryOperator* sum =
+          BinaryOperator::Create(Instruction::Add, global_val, local_val,
+                                 "new_gvar", placeholder);
+        StoreInst* store_inst = new StoreInst(sum, global_ptr, false, placeholder);
+        store_inst->setAlignment(8);
+        new StoreInst(zero, local_var, false, placeholder);
+      }
+      placeholder->eraseFromParent();
+    }
+    local_counters.clear();
+    local_flush_points.clear();
+
+    // Promote the function-local counters to SSA values ourselves.  No
+    // mem2reg or SROA pass runs after us at -O0, which would leave
+    // every counter update a load and a store to the stack.
+    if (!allocas.empty()) {
+      DominatorTree dom_tree;
+      dom_tree.recalculate(*entry_block->getParent());
+      PromoteMemToReg(allocas, dom_tree);
+    }
+  }
+
   // Mark a variable as "used" (not eligible for dead-code elimination).
   void BytesFlops::mark_as_used(Module& module, Constant* protected_var) {
     LLVMContext& globctx = module.getContext();
@@ -350,6 +587,8 @@ namespace bytesflops_pass {
                          GlobalValue::PrivateLinkage,
                          ConstantDataArray::getString(globctx, funcname, true),
                          ".fname");
+    if (Triple(module->getTargetTriple()).isOSBinFormatELF())
+      const_char_ptr->setSection(BF_FNAME_SECTION);
     vector<Constant*> getelementptr_indices;
     ConstantInt* zero_index = ConstantInt::get(globctx, APInt(64, 0));
     getelementptr_indices.push_back(zero_index);
@@ -360,7 +599,76 @@ namespace bytesflops_pass {
     return string_argument;
   }
 
-  // Declare an external variable.
+  // Map a function name (string) to a module-local function ID.
+  ConstantInt* BytesFlops::map_func_name_to_local_id (Module* module, StringRef funcname) {
+    StringMap<uint32_t>::iterator id_iter = func_name_to_id.find(funcname);
+    uint32_t local_id;
+    if (id_iter == func_name_to_id.end()) {
+      // This is the first time we've seen this function name.
+      local_id = (uint32_t) func_id_names.size();
+      func_name_to_id[funcname] = local_id;
+      func_id_names.push_back(map_func_name_to_arg(module, funcname));
+    }
+    else
+      local_id = id_iter->second;
+    return ConstantInt::get(module->getContext(), APInt(32, local_id));
+  }
+
+  // Insert code before a given instruction to compute a function's
+  // program-wide ID, and return the result.
+  Value* BytesFlops::map_func_name_to_id (Module* module, StringRef funcname,
+                                          Instruction* insert_before) {
+    ConstantInt* local_id = map_func_name_to_local_id(module, funcname);
+    LoadInst* base_id = new LoadInst(func_id_base_var, "bf_fid_base", false, insert_before);
+    return BinaryOperator::Create(Instruction::Add, base_id, local_id,
+                                  "bf_fid", insert_before);
+  }
+
+  // Insert code at the end of a given basic block to compute a
+  // function's program-wide ID, and return the result.
+  Value* BytesFlops::map_func_name_to_id (Module* module, StringRef funcname,
+                                          BasicBlock* insert_at_end) {
+    ConstantInt* local_id = map_func_name_to_local_id(module, funcname);
+    LoadInst* base_id = new LoadInst(func_id_base_var, "bf_fid_base", false, insert_at_end);
+    return BinaryOperator::Create(Instruction::Add, base_id, local_id,
+                                  "bf_fid", insert_at_end);
+  }
+
+  // Add a constructor that passes the module's table of function
+  // names to bf_register_func_table(), which stores the program-wide
+  // ID of the module's function 0 in func_id_base_var.  The
+  // constructor is given a high priority so that it runs before any
+  // instrumented user constructor.
+  void BytesFlops::register_func_ids (Module& module) {
+    LLVMContext& globctx = module.getContext();
+    PointerType* i8ptrtype = Type::getInt8PtrTy(globctx);
+    ArrayType* names_type = ArrayType::get(i8ptrtype, func_id_names.size());
+    GlobalVariable* names_var =
+      new GlobalVariable(module, names_type, true,
+                         GlobalValue::PrivateLinkage,
+                         ConstantArray::get(names_type, func_id_names),
+                         "bf_func_names");
+    vector<Constant*> getelementptr_indices;
+    ConstantInt* zero_index = ConstantInt::get(globctx, APInt(64, 0));
+    getelementptr_indices.push_back(zero_index);
+    getelementptr_indices.push_back(zero_index);
+    FunctionType* void_func_type = FunctionType::get(Type::getVoidTy(globctx), false);
+    Function* ctor = Function::Create(void_func_type, GlobalValue::InternalLinkage,
+                                      "bf_register_func_names", &module);
+    BasicBlock* ctor_body = BasicBlock::Create(globctx, "entry", ctor);
+    vector<Value*> arg_list;
+    arg_list.push_back(ConstantExpr::getGetElementPtr(names_var, getelementptr_indices));
+    arg_list.push_back(ConstantInt::get(globctx, APInt(32, func_id_names.size())));
+    arg_list.push_back(func_id_base_var);
+    callinst_create(register_func_table, arg_list, ctor_body);
+    ReturnInst::Create(globctx, ctor_body);
+    appendToGlobalCtors(module, ctor, 101);
+    func_name_to_id.clear();
+    func_id_names.clear();
+  }
+
+  // Declare an external thread-local variable (one of the run-time
+  // library's per-thread counters).
   GlobalVariable* BytesFlops::declare_global_var(Module& module,
                                                  Type* var_type,
                                                  StringRef var_name,
@@ -372,7 +680,7 @@ namespace bytesflops_pass {
     else
       return new GlobalVariable(module, var_type, is_const,
                                 GlobalVariable::ExternalLinkage, 0,
-                                var_name, 0, GlobalVariable::NotThreadLocal);
+                                var_name, 0, CounterTLSModel);
   }
 
   // Insert code to set every element of a given array to zero.
@@ -404,11 +712,9 @@ namespace bytesflops_pass {
     callinst_create(memset_intrinsic, func_args, insert_before);
   }
 
-  // Insert code at the end of a basic block.
-  void BytesFlops::insert_end_bb_code (Module* module, StringRef function_name,
-                                       int& must_clear,
-                                       BasicBlock::iterator& insert_before) {
-    // Keep track of how the basic block terminated.
+  // Tally the type of a basic block's terminator.
+  void BytesFlops::tally_terminator (Module* module,
+                                     BasicBlock::iterator& insert_before) {
     Instruction& inst = *insert_before;
     unsigned int opcode = inst.getOpcode();   // Terminator instruction's opcode
     LLVMContext& globctx = module->getContext();
@@ -440,6 +746,19 @@ namespace bytesflops_pass {
     increment_global_array(insert_before, terminator_var,
                            ConstantInt::get(globctx, APInt(64, BF_END_BB_ANY)),
                            one);
+  }
+
+  // Insert code at the end of a basic block.
+  void BytesFlops::insert_end_bb_code (Module* module, StringRef function_name,
+                                       int& must_clear,
+                                       BasicBlock::iterator& insert_before,
+                                       bool tally_end) {
+    // Keep track of how the basic block terminated then apply all of
+    // the basic block's counter increments at once.
+    if (tally_end) {
+      tally_terminator(module, insert_before);
+      flush_pending_increments(module, insert_before);
+    }
 
     // If we're instrumenting every basic block, insert calls to
     // bf_accumulate_bb_tallies() and bf_report_bb_tallies().
@@ -452,7 +771,7 @@ namespace bytesflops_pass {
     // bf_assoc_counters_with_func() at the end of the basic block.
     if (TallyByFunction) {
       vector<Value*> arg_list;
-      arg_list.push_back(map_func_name_to_arg(module, function_name));
+      arg_list.push_back(map_func_name_to_id(module, function_name, insert_before));
       callinst_create(assoc_counts_with_func, arg_list, insert_before);
     }
 
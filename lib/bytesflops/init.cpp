@@ -66,6 +66,16 @@ namespace bytesflops_pass {
       report_fatal_error("-bf-call-stack is allowed only in conjuction with -bf-by-func");
     create_global_constant(module, "bf_call_stack", bool(TrackCallStack));
 
+    // Assign a value to bf_max_call_depth.
+    if (MaxCallDepth > 0 && !TrackCallStack)
+      report_fatal_error("-bf-max-call-depth is allowed only in conjuction with -bf-call-stack");
+    create_global_constant(module, "bf_max_call_depth", uint64_t(MaxCallDepth));
+
+    // Assign a value to bf_collapse_recursion.
+    if (CollapseRecursion && !TrackCallStack)
+      report_fatal_error("-bf-collapse-recursion is allowed only in conjuction with -bf-call-stack");
+    create_global_constant(module, "bf_collapse_recursion", bool(CollapseRecursion));
+
     // Assign a value to bf_unique_bytes.
     create_global_constant(module, "bf_unique_bytes", bool(TrackUniqueBytes));
 
@@ -75,9 +85,74 @@ namespace bytesflops_pass {
     // Assign a value to bf_vectors.
     create_global_constant(module, "bf_vectors", bool(TallyVectors));
 
+    // Assign a value to bf_thread_safe.
+    create_global_constant(module, "bf_thread_safe", bool(ThreadSafety));
+
+    // Ensure that -bf-edge-profile is used only with options whose
+    // counters can be reconstructed from an edge profile.
+    if (EdgeProfile) {
+      if (InstrumentEveryBB)
+        report_fatal_error("-bf-edge-profile and -bf-every-bb are mutually exclusive");
+      if (TrackCallStack)
+        report_fatal_error("-bf-edge-profile and -bf-call-stack are mutually exclusive");
+      if (TallyTypes)
+        report_fatal_error("-bf-edge-profile and -bf-types are mutually exclusive");
+      if (TallyInstMix)
+        report_fatal_error("-bf-edge-profile and -bf-inst-mix are mutually exclusive");
+    }
+
+    // Ensure that -bf-local-counters is not used with options that
+    // read the counters at the end of every basic block.
+    if (LocalCounters && InstrumentEveryBB)
+      report_fatal_error("-bf-local-counters and -bf-every-bb are mutually exclusive");
+
+    // Assign a value to bf_trace_buffer_entries.
+    create_global_constant(module, "bf_trace_buffer_entries", uint64_t(TraceBufferEntries));
+
+    // Assign a value to bf_async_analysis.
+    if (AsyncAnalysis && TraceBufferEntries == 0)
+      report_fatal_error("-bf-async-analysis is allowed only in conjunction with -bf-trace-buffer");
+    create_global_constant(module, "bf_async_analysis", bool(AsyncAnalysis));
+
+    // Assign a value to bf_reuse_dist.
+    create_global_constant(module, "bf_reuse_dist", bool(ReuseDist.getBits() != 0));
+
+    // Assign a value to bf_reuse_dist_split.
+    bool rd_loads_stores = ReuseDist.isSet(RD_BOTH)
+      || (ReuseDist.isSet(RD_LOADS) && ReuseDist.isSet(RD_STORES));
+    create_global_constant(module, "bf_reuse_dist_split", rd_loads_stores);
+
     // Assign a value to bf_max_reuse_dist.
     create_global_constant(module, "bf_max_reuse_distance", uint64_t(MaxReuseDist));
 
+    // Assign a value to bf_reuse_dist_gran.
+    if (ReuseDistGran == 0 || (ReuseDistGran&(ReuseDistGran - 1)) != 0)
+      report_fatal_error("-bf-reuse-dist-gran must be a power of two");
+    create_global_constant(module, "bf_reuse_dist_gran", uint64_t(ReuseDistGran));
+
+    // Assign a value to bf_reuse_dist_by_func.
+    if (ReuseDistByFunc && (!TallyByFunction || ReuseDist.getBits() == 0))
+      report_fatal_error("-bf-reuse-dist-by-func is allowed only in conjunction with -bf-by-func and -bf-reuse-dist");
+    create_global_constant(module, "bf_reuse_dist_by_func", bool(ReuseDistByFunc));
+
+    // Assign a value to bf_reuse_engine.
+    create_global_constant(module, "bf_reuse_engine", uint64_t(ReuseEngine));
+
+    // Assign values to bf_reuse_sample and bf_reuse_sample_max.
+    if (ReuseSample == 0)
+      report_fatal_error("-bf-reuse-sample must be at least 1");
+    create_global_constant(module, "bf_reuse_sample", uint64_t(ReuseSample));
+    create_global_constant(module, "bf_reuse_sample_max", uint64_t(ReuseSampleMax));
+
+    // Assign a value to bf_mrc_sizes.
+    string mrc_sizes;
+    if (MissRatioSizes.getNumOccurrences() > 0) {
+      if (ReuseDist.getBits() == 0)
+        report_fatal_error("-bf-mrc is allowed only in conjunction with -bf-reuse-dist");
+      mrc_sizes = parse_cache_sizes(MissRatioSizes);
+    }
+    create_global_constant(module, "bf_mrc_sizes", mrc_sizes.c_str());
+
     // Create a global string that stores all of our command-line options.
     ifstream cmdline("/proc/self/cmdline");   // Full command line passed to opt
     string bf_cmdline("[failed to read /proc/self/cmdline]");  // Reconstructed command line with -bf-* options only
@@ -127,27 +202,53 @@ namespace bytesflops_pass {
       report_bb_tallies = declare_thunk(&module, "_ZN10bytesflops20bf_report_bb_talliesEv");
     }
 
+    // Functions are passed to the run-time library by ID instead of by
+    // name.  Each module numbers its functions from zero, and a
+    // constructor asks the run-time library for the program-wide ID
+    // of the module's function 0.  Inject an external declaration for
+    // bf_register_func_table() and a variable to hold that ID.
+    func_name_to_id.clear();
+    func_id_names.clear();
+    func_id_base_var = NULL;
+    if (TallyByFunction || TallyVectors) {
+      vector<Type*> all_function_args;
+      all_function_args.push_back(PointerType::get(i8ptrtype, 0));
+      all_function_args.push_back(IntegerType::get(globctx, 32));
+      all_function_args.push_back(PointerType::get(IntegerType::get(globctx, 32), 0));
+      FunctionType* void_func_result =
+        FunctionType::get(Type::getVoidTy(globctx), all_function_args, false);
+      register_func_table =
+        declare_extern_c(void_func_result,
+                         "_ZN10bytesflops22bf_register_func_tableEPPKcjPj",
+                         &module);
+      func_id_base_var =
+        new GlobalVariable(module, IntegerType::get(globctx, 32), false,
+                           GlobalValue::PrivateLinkage,
+                           ConstantInt::get(globctx, APInt(32, 0)),
+                           "bf_func_id_base");
+    }
+
     // Inject an external declaration for bf_assoc_counters_with_func().
     if (TallyByFunction) {
-      vector<Type*> single_string_arg;
-      single_string_arg.push_back(PointerType::get(IntegerType::get(globctx, 8), 0));
+      vector<Type*> single_id_arg;
+      single_id_arg.push_back(IntegerType::get(globctx, 32));
       FunctionType* void_func_result =
-        FunctionType::get(Type::getVoidTy(globctx), single_string_arg, false);
+        FunctionType::get(Type::getVoidTy(globctx), single_id_arg, false);
       assoc_counts_with_func =
         declare_extern_c(void_func_result,
-                         "_ZN10bytesflops27bf_assoc_counters_with_funcEPKc",
+                         "_ZN10bytesflops27bf_assoc_counters_with_funcEj",
                          &module);
     }
 
     // Inject an external declarations for bf_increment_func_tally().
     if (TallyByFunction) {
-      vector<Type*> single_string_arg;
-      single_string_arg.push_back(PointerType::get(IntegerType::get(globctx, 8), 0));
+      vector<Type*> single_id_arg;
+      single_id_arg.push_back(IntegerType::get(globctx, 32));
       FunctionType* void_func_result =
-        FunctionType::get(Type::getVoidTy(globctx), single_string_arg, false);
+        FunctionType::get(Type::getVoidTy(globctx), single_id_arg, false);
       tally_function =
         declare_extern_c(void_func_result,
-                         "_ZN10bytesflops18bf_incr_func_tallyEPKc",
+                         "_ZN10bytesflops18bf_incr_func_tallyEj",
                          &module);
     }
 
@@ -155,13 +256,13 @@ namespace bytesflops_pass {
     // bf_pop_function().
     if (TallyByFunction && TrackCallStack) {
       // bf_push_function()
-      vector<Type*> single_string_arg;
-      single_string_arg.push_back(PointerType::get(IntegerType::get(globctx, 8), 0));
-      FunctionType* void_str_func_result =
-        FunctionType::get(Type::getVoidTy(globctx), single_string_arg, false);
+      vector<Type*> single_id_arg;
+      single_id_arg.push_back(IntegerType::get(globctx, 32));
+      FunctionType* void_id_func_result =
+        FunctionType::get(Type::getVoidTy(globctx), single_id_arg, false);
       push_function =
-        declare_extern_c(void_str_func_result,
-                         "_ZN10bytesflops16bf_push_functionEPKc",
+        declare_extern_c(void_id_func_result,
+                         "_ZN10bytesflops16bf_push_functionEj",
                          &module);
 
       // bf_pop_function()
@@ -172,7 +273,7 @@ namespace bytesflops_pass {
     // to track vector operations.
     if (TallyVectors) {
       vector<Type*> all_function_args;
-      all_function_args.push_back(PointerType::get(IntegerType::get(globctx, 8), 0));
+      all_function_args.push_back(IntegerType::get(globctx, 32));
       all_function_args.push_back(IntegerType::get(globctx, 64));
       all_function_args.push_back(IntegerType::get(globctx, 64));
       all_function_args.push_back(IntegerType::get(globctx, 8));
@@ -180,7 +281,7 @@ namespace bytesflops_pass {
         FunctionType::get(Type::getVoidTy(globctx), all_function_args, false);
       tally_vector =
         declare_extern_c(void_func_result,
-                         "_ZN10bytesflops25bf_tally_vector_operationEPKcmmb",
+                         "_ZN10bytesflops25bf_tally_vector_operationEjmmb",
                          &module);
     }
 
@@ -201,11 +302,31 @@ namespace bytesflops_pass {
                          : "_ZN10bytesflops28bf_assoc_addresses_with_progEmm",
                          &module);
 
+      // Declare the shadow directory that lets us update unique
+      // bytes inline.
+      if (!FindMemFootprint) {
+        PointerType* i64ptrptrtype = PointerType::get(i64ptrtype, 0);
+        ubytes_dir_var =
+          new GlobalVariable(module,
+                             ArrayType::get(i64ptrptrtype, 1ULL<<BF_UBYTES_DIR_BITS),
+                             false, GlobalVariable::ExternalLinkage, 0,
+                             "bf_ubytes_directory");
+        ubytes_empty_leaf_var =
+          new GlobalVariable(module,
+                             ArrayType::get(i64ptrtype, 1ULL<<BF_UBYTES_LEAF_BITS),
+                             false, GlobalVariable::ExternalLinkage, 0,
+                             "bf_ubytes_empty_leaf");
+        ubytes_scratch_var =
+          new GlobalVariable(module, i64type, false,
+                             GlobalVariable::ExternalLinkage, 0,
+                             "bf_ubytes_scratch");
+      }
+
       // Declare bf_assoc_addresses_with_func() only if we were
       // asked to track unique addresses by function.
       if (TallyByFunction) {
         vector<Type*> all_function_args;
-        all_function_args.push_back(PointerType::get(IntegerType::get(globctx, 8), 0));
+        all_function_args.push_back(IntegerType::get(globctx, 32));
         all_function_args.push_back(IntegerType::get(globctx, 64));
         all_function_args.push_back(IntegerType::get(globctx, 64));
         FunctionType* void_func_result =
@@ -213,8 +334,8 @@ namespace bytesflops_pass {
         assoc_addrs_with_func =
           declare_extern_c(void_func_result,
 			   FindMemFootprint
-			   ? "_ZN10bytesflops31bf_assoc_addresses_with_func_tbEPKcmm"
-			   : "_ZN10bytesflops28bf_assoc_addresses_with_funcEPKcmm",
+			   ? "_ZN10bytesflops31bf_assoc_addresses_with_func_tbEjmm"
+			   : "_ZN10bytesflops28bf_assoc_addresses_with_funcEjmm",
                            &module);
       }
     }
@@ -241,25 +362,58 @@ namespace bytesflops_pass {
     if ((rd_bits&(1<<RD_BOTH)) != 0)
       rd_bits = (1<<RD_LOADS) | (1<<RD_STORES);
 
-    // Inject external declarations for bf_reuse_dist_addrs_prog().
+    // Inject external declarations for bf_reuse_dist_addrs_prog() and
+    // bf_reuse_dist_addrs_func().
     if (rd_bits > 0) {
       vector<Type*> all_function_args;
       all_function_args.push_back(IntegerType::get(globctx, 64));
       all_function_args.push_back(IntegerType::get(globctx, 64));
+      all_function_args.push_back(IntegerType::get(globctx, 8));
       FunctionType* void_func_result =
         FunctionType::get(Type::getVoidTy(globctx), all_function_args, false);
       reuse_dist_prog =
         declare_extern_c(void_func_result,
-                         "_ZN10bytesflops24bf_reuse_dist_addrs_progEmm",
+                         "_ZN10bytesflops24bf_reuse_dist_addrs_progEmmb",
                          &module);
+
+      // Declare bf_reuse_dist_addrs_func() only if we were asked to
+      // compute reuse distance by function.
+      if (ReuseDistByFunc) {
+        vector<Type*> all_function_args;
+        all_function_args.push_back(IntegerType::get(globctx, 32));
+        all_function_args.push_back(IntegerType::get(globctx, 64));
+        all_function_args.push_back(IntegerType::get(globctx, 64));
+        FunctionType* void_func_result =
+          FunctionType::get(Type::getVoidTy(globctx), all_function_args, false);
+        reuse_dist_func =
+          declare_extern_c(void_func_result,
+                           "_ZN10bytesflops24bf_reuse_dist_addrs_funcEjmm",
+                           &module);
+      }
     }
 
-    // Inject external declarations for bf_acquire_mega_lock() and
-    // bf_release_mega_lock().
-    if (ThreadSafety) {
-      take_mega_lock = declare_thunk(&module, "_ZN10bytesflops20bf_acquire_mega_lockEv");
-      release_mega_lock = declare_thunk(&module, "_ZN10bytesflops20bf_release_mega_lockEv");
+    // Inject external declarations for the trace buffer and
+    // bf_drain_trace_buffer().
+    if (TraceBufferEntries > 0 && (TrackUniqueBytes || rd_bits > 0)) {
+      trace_pos_var = declare_global_var(module, i64ptrtype, "bf_trace_pos");
+      trace_end_var = declare_global_var(module, i64ptrtype, "bf_trace_end");
+      drain_trace_buffer = declare_thunk(&module, "_ZN10bytesflops21bf_drain_trace_bufferEv");
+    }
+
+    // Inject an external declaration for bf_register_edge_profile().
+    if (EdgeProfile) {
+      vector<Type*> all_function_args;
+      all_function_args.push_back(i8ptrtype);
+      all_function_args.push_back(i64ptrtype);
+      all_function_args.push_back(i64ptrtype);
+      FunctionType* void_func_result =
+        FunctionType::get(Type::getVoidTy(globctx), all_function_args, false);
+      register_edge_profile =
+        declare_extern_c(void_func_result,
+                         "_ZN10bytesflops24bf_register_edge_profileEPKcPKmPm",
+                         &module);
     }
+
     Type* voidtype = Type::getVoidTy(module.getContext());
     init_func = cast<Function>(module.getOrInsertFunction("EAUDIT_init", 
           voidtype, 
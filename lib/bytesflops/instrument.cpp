@@ -144,6 +144,22 @@ namespace bytesflops_pass {
                                   "", insert_before);
     }
 
+    // Determine which program-wide analyses should process the
+    // address via the trace buffer instead of via a direct call.
+    bool track_reuse =
+      (opcode == Instruction::Load && (rd_bits&(1<<RD_LOADS)) != 0)
+      || (opcode == Instruction::Store && (rd_bits&(1<<RD_STORES)) != 0);
+    uint64_t trace_flags = 0;
+    if (TraceBufferEntries > 0) {
+      if (TrackUniqueBytes)
+        trace_flags |= BF_TRACE_UNIQUE_BYTES;
+      if (track_reuse) {
+        trace_flags |= BF_TRACE_REUSE_DIST;
+        if (opcode == Instruction::Store)
+          trace_flags |= BF_TRACE_STORE;
+      }
+    }
+
     // If requested by the user, also insert a call to
     // bf_assoc_addresses_with_prog() and perhaps
     // bf_assoc_addresses_with_func().
@@ -151,27 +167,62 @@ namespace bytesflops_pass {
       // Conditionally insert a call to bf_assoc_addresses_with_func().
       if (TallyByFunction) {
         vector<Value*> arg_list;
-        arg_list.push_back(map_func_name_to_arg(module, function_name));
+        arg_list.push_back(map_func_name_to_id(module, function_name, insert_before));
         arg_list.push_back(mem_addr);
         arg_list.push_back(num_bytes);
         callinst_create(assoc_addrs_with_func, arg_list, insert_before);
       }
 
-      // Unconditionally insert a call to bf_assoc_addresses_with_prog().
-      vector<Value*> arg_list;
-      arg_list.push_back(mem_addr);
-      arg_list.push_back(num_bytes);
-      callinst_create(assoc_addrs_with_prog, arg_list, insert_before);
+      // Insert a call to bf_assoc_addresses_with_prog() unless we're
+      // buffering addresses.  If the access fits in a single word of
+      // the shadow directory, we'll later make the call conditional
+      // on a fast-path miss.
+      if (trace_flags == 0) {
+        vector<Value*> arg_list;
+        arg_list.push_back(mem_addr);
+        arg_list.push_back(num_bytes);
+        CallInst* slow_call =
+          CallInst::Create(assoc_addrs_with_prog, arg_list, "", insert_before);
+        slow_call->setCallingConv(CallingConv::C);
+        if (!FindMemFootprint && byte_count > 0 && byte_count <= 64)
+          ubytes_slow_calls.push_back(slow_call);
+      }
     }
 
     // If requested by the user, also insert a call to
-    // bf_reuse_dist_addrs_prog().
-    if ((opcode == Instruction::Load && (rd_bits&(1<<RD_LOADS)) != 0)
-        || (opcode == Instruction::Store && (rd_bits&(1<<RD_STORES)) != 0)) {
-      vector<Value*> arg_list;
-      arg_list.push_back(mem_addr);
-      arg_list.push_back(num_bytes);
-      callinst_create(reuse_dist_prog, arg_list, insert_before);
+    // bf_reuse_dist_addrs_prog() unless we're buffering addresses and
+    // perhaps a call to bf_reuse_dist_addrs_func().
+    if (track_reuse) {
+      // Conditionally insert a call to bf_reuse_dist_addrs_func().
+      if (ReuseDistByFunc) {
+        vector<Value*> arg_list;
+        arg_list.push_back(map_func_name_to_id(module, function_name, insert_before));
+        arg_list.push_back(mem_addr);
+        arg_list.push_back(num_bytes);
+        callinst_create(reuse_dist_func, arg_list, insert_before);
+      }
+
+      // Insert a call to bf_reuse_dist_addrs_prog().
+      if (trace_flags == 0) {
+        vector<Value*> arg_list;
+        arg_list.push_back(mem_addr);
+        arg_list.push_back(num_bytes);
+        arg_list.push_back(ConstantInt::get(bbctx, APInt(8, opcode == Instruction::Store)));
+        callinst_create(reuse_dist_prog, arg_list, insert_before);
+      }
+    }
+
+    // If we're buffering addresses, insert a call to
+    // bf_drain_trace_buffer(), which we'll later make conditional on
+    // the buffer's being full and follow with code to append the
+    // address to the buffer.
+    if (trace_flags != 0) {
+      trace_site_t site;
+      site.drain_call = CallInst::Create(drain_trace_buffer, "", insert_before);
+      site.drain_call->setCallingConv(CallingConv::C);
+      site.address = mem_addr;
+      site.info = trace_flags | byte_count;
+      trace_sites.push_back(site);
     }
   }
 
@@ -213,7 +264,7 @@ namespace bytesflops_pass {
     // functions.
     if (TallyByFunction) {
       string augmented_callee_name(string("+") + callee_name.str());
-      Constant* argument = map_func_name_to_arg(module, StringRef(augmented_callee_name));
+      Value* argument = map_func_name_to_id(module, StringRef(augmented_callee_name), insert_before);
       callinst_create(tally_function, argument, insert_before);
     }
   }
@@ -348,7 +399,7 @@ namespace bytesflops_pass {
         vector<Value*> arg_list;
         uint64_t elt_count = vt->getNumElements();
         uint64_t total_bits = instType->getPrimitiveSizeInBits();
-        arg_list.push_back(map_func_name_to_arg(module, function_name));
+        arg_list.push_back(map_func_name_to_id(module, function_name, insert_before));
         arg_list.push_back(get_vector_length(bbctx, vt, one));
         arg_list.push_back(ConstantInt::get(bbctx, APInt(64, total_bits/elt_count)));
         arg_list.push_back(ConstantInt::get(bbctx, APInt(8, 1)));
@@ -357,6 +408,340 @@ namespace bytesflops_pass {
       while (0);
   }
 
+  // Instrument a single instruction.
+  void BytesFlops::instrument_instruction(Module* module,
+                                          StringRef function_name,
+                                          BasicBlock::iterator& iter,
+                                          LLVMContext& bbctx,
+                                          const DataLayout& target_data,
+                                          BasicBlock::iterator& insert_before,
+                                          int& must_clear) {
+    // Snag the current opcode for further interrogation.
+    Instruction& inst = *iter;
+    unsigned int opcode = iter->getOpcode();
+
+    // Maintain a histogram of instructions executed.
+    if (TallyInstMix) {
+      ConstantInt* opCodeIdx = ConstantInt::get(bbctx,  APInt(64, int64_t(opcode)));
+      increment_global_array(insert_before, inst_mix_histo_var, opCodeIdx, one);
+    }
+
+    // Process the current instruction.
+    switch (opcode) {
+      case Instruction::Load:
+      case Instruction::Store:
+        instrument_load_store(module, function_name, iter, bbctx,
+                              target_data, insert_before, must_clear);
+        break;
+
+      case Instruction::Call:
+        instrument_call(module, function_name, &inst, insert_before, must_clear);
+        break;
+
+      default:
+        instrument_other(module, function_name, inst, bbctx, insert_before, must_clear);
+        break;
+    }
+    instrument_all(module, function_name, inst, bbctx, insert_before, must_clear);
+  }
+
+  // Return true if the command-line options permit hoisting loop
+  // counters into preheaders.  Hoisting is incompatible with every
+  // option that needs to observe each loop iteration individually.
+  // Note that this is called before doInitialization() sets rd_bits.
+  bool BytesFlops::may_hoist_loops(void) {
+    return HoistLoopCounters && !InstrumentEveryBB && !TrackUniqueBytes
+      && ReuseDist.getBits() == 0 && !TallyVectors;
+  }
+
+  // Find all innermost, single-block loops whose trip count
+  // ScalarEvolution can compute and that make no function calls.
+  // For each such loop, compute the counter increments of a single
+  // iteration and insert code into the loop's preheader to compute
+  // its trip count.  The caller is expected to instrument neither the
+  // loop body nor the trip-count code but instead to invoke
+  // insert_hoisted_increments() on the preheader.
+  void BytesFlops::find_hoistable_loops(Module* module,
+                                        Function& function,
+                                        StringRef function_name,
+                                        map<BasicBlock*, hoisted_loop_t>& hoisted_loops,
+                                        set<BasicBlock*>& hoisted_bodies,
+                                        set<Instruction*>& trip_count_code) {
+    LoopInfo& loop_info = getAnalysis<LoopInfo>();
+    ScalarEvolution& scev = getAnalysis<ScalarEvolution>();
+    const DataLayout& target_data = getAnalysis<DataLayoutPass>().getDataLayout();
+    LLVMContext& globctx = module->getContext();
+    IntegerType* i64type = Type::getInt64Ty(globctx);
+
+    // Find all candidate loops.
+    vector<Loop*> candidates;
+    vector<Loop*> worklist(loop_info.begin(), loop_info.end());
+    while (!worklist.empty()) {
+      Loop* loop = worklist.back();
+      worklist.pop_back();
+      worklist.insert(worklist.end(), loop->getSubLoops().begin(), loop->getSubLoops().end());
+      if (!loop->getSubLoops().empty() || loop->getNumBlocks() != 1)
+        continue;
+      BasicBlock* body = loop->getHeader();
+      if (loop->getLoopPreheader() == NULL || loop->getExitingBlock() != body)
+        continue;
+      bool has_call = false;
+      for (BasicBlock::iterator iter = body->begin(); iter != body->end(); iter++)
+        if ((isa<CallInst>(*iter) || isa<InvokeInst>(*iter)) && !ignorable_call(&*iter)) {
+          has_call = true;
+          break;
+        }
+      if (has_call)
+        continue;
+      const SCEV* taken_count = scev.getBackedgeTakenCount(loop);
+      if (isa<SCEVCouldNotCompute>(taken_count)
+          || !taken_count->getType()->isIntegerTy()
+          || !isSafeToExpand(taken_count, scev))
+        continue;
+      candidates.push_back(loop);
+    }
+    if (candidates.empty())
+      return;
+
+    // Remember every instruction that exists before we expand any
+    // trip counts.  SCEVExpander may place code anywhere that
+    // dominates the preheader so we use this to find what it added.
+    set<Instruction*> original_code;
+    for (inst_iterator iter = inst_begin(function); iter != inst_end(function); iter++)
+      original_code.insert(&*iter);
+
+    // Process each loop in turn.
+    SCEVExpander expander(scev, "bf_trips");
+    for (vector<Loop*>::iterator loop_iter = candidates.begin();
+         loop_iter != candidates.end();
+         loop_iter++) {
+      // Tally the counter increments for a single iteration of the
+      // loop.  Because the loop contains nothing but constant
+      // increments, these are all deferred rather than inserted.
+      Loop* loop = *loop_iter;
+      BasicBlock* body = loop->getHeader();
+      BasicBlock::iterator terminator_inst = body->end();
+      terminator_inst--;
+      hoisted_loop_t info;
+      info.must_clear = 0;
+      for (BasicBlock::iterator iter = body->begin(); iter != body->end(); iter++)
+        if (!ignorable_call(&*iter))
+          instrument_instruction(module, function_name, iter, globctx,
+                                 target_data, terminator_inst, info.must_clear);
+      tally_terminator(module, terminator_inst);
+      for (vector<counter_ref_t>::iterator ctr_iter = pending_counters.begin();
+           ctr_iter != pending_counters.end();
+           ctr_iter++)
+        info.increments.push_back(make_pair(*ctr_iter, pending_increments[*ctr_iter]));
+      pending_counters.clear();
+      pending_increments.clear();
+
+      // Compute the number of iterations (one more than the number
+      // of times the backedge is taken) in the preheader.
+      const SCEV* taken_count = scev.getBackedgeTakenCount(loop);
+      const SCEV* trip_count =
+        scev.getAddExpr(scev.getTruncateOrZeroExtend(taken_count, i64type),
+                        scev.getConstant(i64type, 1));
+      BasicBlock* preheader = loop->getLoopPreheader();
+      info.trip_count = expander.expandCodeFor(trip_count, i64type,
+                                               preheader->getTerminator());
+      hoisted_loops[preheader] = info;
+      hoisted_bodies.insert(body);
+    }
+
+    // Keep track of all of the code we added to compute trip counts.
+    for (inst_iterator iter = inst_begin(function); iter != inst_end(function); iter++)
+      if (original_code.count(&*iter) == 0)
+        trip_count_code.insert(&*iter);
+  }
+
+  // Insert before a given instruction code to increment each counter
+  // by a hoisted loop's per-iteration increment times its trip count.
+  void BytesFlops::insert_hoisted_increments(Module* module,
+                                             hoisted_loop_t& loop_info,
+                                             BasicBlock::iterator& insert_before,
+                                             int& must_clear) {
+    LLVMContext& globctx = module->getContext();
+    for (vector<pair<counter_ref_t, uint64_t> >::iterator inc_iter = loop_info.increments.begin();
+         inc_iter != loop_info.increments.end();
+         inc_iter++) {
+      Constant* global_var = inc_iter->first.first;
+      int64_t idx = inc_iter->first.second;
+      uint64_t increment = inc_iter->second;
+      if (increment == 0)
+        continue;
+      Value* total =
+        BinaryOperator::Create(Instruction::Mul, loop_info.trip_count,
+                               ConstantInt::get(globctx, APInt(64, increment)),
+                               "bf_hoisted", insert_before);
+      if (idx < 0)
+        increment_global_variable(insert_before, global_var, total);
+      else
+        increment_global_array(insert_before, global_var,
+                               ConstantInt::get(globctx, APInt(64, idx)), total);
+    }
+    must_clear |= loop_info.must_clear;
+  }
+
+  // Precede each call to bf_assoc_addresses_with_prog() with code to
+  // set the accessed bytes' bits in the unique-bytes shadow directory
+  // inline.  The call is executed only if the leaf or bit vector
+  // doesn't exist yet, the address lies outside the directory, or the
+  // bits span two words.
+  void BytesFlops::inline_unique_bytes_fast_paths(Module* module) {
+    LLVMContext& globctx = module->getContext();
+    IntegerType* i64type = Type::getInt64Ty(globctx);
+    MDNode* rarely_taken = MDBuilder(globctx).createBranchWeights(1, 1000);
+    for (vector<CallInst*>::iterator call_iter = ubytes_slow_calls.begin();
+         call_iter != ubytes_slow_calls.end();
+         call_iter++) {
+      CallInst* slow_call = *call_iter;
+      Value* mem_addr = slow_call->getArgOperand(0);
+      uint64_t byte_count = cast<ConstantInt>(slow_call->getArgOperand(1))->getZExtValue();
+
+      // Find the leaf, substituting an empty leaf for a missing one.
+      Value* dir_ofs =
+        BinaryOperator::Create(Instruction::LShr, mem_addr,
+                               ConstantInt::get(i64type, BF_UBYTES_LEAF_BITS + BF_UBYTES_PAGE_BITS),
+                               "dir_ofs", slow_call);
+      dir_ofs =
+        BinaryOperator::Create(Instruction::And, dir_ofs,
+                               ConstantInt::get(i64type, (1ULL<<BF_UBYTES_DIR_BITS) - 1),
+                               "dir_ofs", slow_call);
+      vector<Value*> dir_idx;
+      dir_idx.push_back(zero);
+      dir_idx.push_back(dir_ofs);
+      Value* leaf_ptr = GetElementPtrInst::Create(ubytes_dir_var, dir_idx, "leaf_ptr", slow_call);
+      LoadInst* leaf = new LoadInst(leaf_ptr, "leaf", false, slow_call);
+      leaf->setAlignment(8);
+      Value* no_leaf = new ICmpInst(slow_call, ICmpInst::ICMP_EQ, leaf,
+                                    ConstantPointerNull::get(cast<PointerType>(leaf->getType())),
+                                    "no_leaf");
+      Constant* empty_leaf =
+        ConstantExpr::getPointerCast(ubytes_empty_leaf_var, leaf->getType());
+      Value* any_leaf = SelectInst::Create(no_leaf, empty_leaf, leaf, "any_leaf", slow_call);
+
+      // Find the bit vector.
+      Value* leaf_ofs =
+        BinaryOperator::Create(Instruction::LShr, mem_addr,
+                               ConstantInt::get(i64type, BF_UBYTES_PAGE_BITS),
+                               "leaf_ofs", slow_call);
+      leaf_ofs =
+        BinaryOperator::Create(Instruction::And, leaf_ofs,
+                               ConstantInt::get(i64type, (1ULL<<BF_UBYTES_LEAF_BITS) - 1),
+                               "leaf_ofs", slow_call);
+      Value* bits_ptr = GetElementPtrInst::Create(any_leaf, leaf_ofs, "bits_ptr", slow_call);
+      LoadInst* bits = new LoadInst(bits_ptr, "bits", false, slow_call);
+      bits->setAlignment(8);
+
+      // Determine if we need to call the run-time library.
+      Value* high_bits =
+        BinaryOperator::Create(Instruction::LShr, mem_addr,
+                               ConstantInt::get(i64type, BF_UBYTES_ADDR_BITS),
+                               "high_bits", slow_call);
+      Value* miss = new ICmpInst(slow_call, ICmpInst::ICMP_NE, high_bits, zero, "out_of_range");
+      Value* no_bits = new ICmpInst(slow_call, ICmpInst::ICMP_EQ, bits,
+                                    ConstantPointerNull::get(cast<PointerType>(bits->getType())),
+                                    "no_bits");
+      miss = BinaryOperator::Create(Instruction::Or, miss, no_bits, "miss", slow_call);
+      Value* bit_ofs =
+        BinaryOperator::Create(Instruction::And, mem_addr,
+                               ConstantInt::get(i64type, 63), "bit_ofs", slow_call);
+      if (byte_count > 1) {
+        Value* last_bit =
+          BinaryOperator::Create(Instruction::Add, bit_ofs,
+                                 ConstantInt::get(i64type, byte_count - 1),
+                                 "last_bit", slow_call);
+        Value* spans_words = new ICmpInst(slow_call, ICmpInst::ICMP_UGT, last_bit,
+                                          ConstantInt::get(i64type, 63), "spans_words");
+        miss = BinaryOperator::Create(Instruction::Or, miss, spans_words, "miss", slow_call);
+      }
+
+      // Set the bits in the bit vector or, on a miss, in a scratch
+      // word.
+      Value* word_ofs =
+        BinaryOperator::Create(Instruction::LShr, mem_addr,
+                               ConstantInt::get(i64type, 6), "word_ofs", slow_call);
+      word_ofs =
+        BinaryOperator::Create(Instruction::And, word_ofs,
+                               ConstantInt::get(i64type, (1ULL<<(BF_UBYTES_PAGE_BITS - 6)) - 1),
+                               "word_ofs", slow_call);
+      Value* word_ptr = GetElementPtrInst::Create(bits, word_ofs, "word_ptr", slow_call);
+      word_ptr = SelectInst::Create(miss, ubytes_scratch_var, word_ptr, "word_ptr", slow_call);
+      Value* mask =
+        BinaryOperator::Create(Instruction::Shl,
+                               ConstantInt::get(globctx, APInt::getLowBitsSet(64, byte_count)),
+                               bit_ofs, "mask", slow_call);
+      if (ThreadSafety)
+        new AtomicRMWInst(AtomicRMWInst::Or, word_ptr, mask,
+                          Monotonic, CrossThread, slow_call);
+      else {
+        LoadInst* old_word = new LoadInst(word_ptr, "word", false, slow_call);
+        old_word->setAlignment(8);
+        Value* new_word =
+          BinaryOperator::Create(Instruction::Or, old_word, mask, "new_word", slow_call);
+        StoreInst* store_inst = new StoreInst(new_word, word_ptr, false, slow_call);
+        store_inst->setAlignment(8);
+      }
+
+      // Call the run-time library only on a miss.
+      TerminatorInst* then_term =
+        SplitBlockAndInsertIfThen(miss, slow_call, false, rarely_taken);
+      slow_call->moveBefore(then_term);
+    }
+    ubytes_slow_calls.clear();
+  }
+
+  // Append a record to the trace buffer at each trace site.  The
+  // site's call to bf_drain_trace_buffer() is executed only if the
+  // buffer is full (or not yet allocated).
+  void BytesFlops::insert_trace_appends(Module* module) {
+    LLVMContext& globctx = module->getContext();
+    MDNode* rarely_taken = MDBuilder(globctx).createBranchWeights(1, 1000);
+    ConstantInt* two = ConstantInt::get(globctx, APInt(64, 2));
+    for (vector<trace_site_t>::iterator site_iter = trace_sites.begin();
+         site_iter != trace_sites.end();
+         site_iter++) {
+      // Drain the buffer if it's full.
+      CallInst* drain_call = site_iter->drain_call;
+      Instruction* next_inst = drain_call->getNextNode();
+      LoadInst* trace_pos = new LoadInst(trace_pos_var, "trace_pos", false, drain_call);
+      trace_pos->setAlignment(8);
+      LoadInst* trace_end = new LoadInst(trace_end_var, "trace_end", false, drain_call);
+      trace_end->setAlignment(8);
+      Value* full = new ICmpInst(drain_call, ICmpInst::ICMP_EQ, trace_pos, trace_end, "trace_full");
+      TerminatorInst* then_term =
+        SplitBlockAndInsertIfThen(full, drain_call, false, rarely_taken);
+      drain_call->moveBefore(then_term);
+
+      // Append an {address, flags | size} record to the buffer.
+      trace_pos = new LoadInst(trace_pos_var, "trace_pos", false, next_inst);
+      trace_pos->setAlignment(8);
+      StoreInst* store_inst = new StoreInst(site_iter->address, trace_pos, false, next_inst);
+      store_inst->setAlignment(8);
+      Value* info_ptr = GetElementPtrInst::Create(trace_pos, one, "trace_info", next_inst);
+      store_inst = new StoreInst(ConstantInt::get(globctx, APInt(64, site_iter->info)),
+                                 info_ptr, false, next_inst);
+      store_inst->setAlignment(8);
+      Value* new_pos = GetElementPtrInst::Create(trace_pos, two, "new_trace_pos", next_inst);
+      if (ThreadSafety) {
+        // Publish the record with a release store so that
+        // bf_drain_all_trace_buffers() can read it from another
+        // thread.  Atomic stores must be of integers.
+        Type* int64_type = Type::getInt64Ty(globctx);
+        Value* new_pos_int = new PtrToIntInst(new_pos, int64_type, "new_trace_pos_int", next_inst);
+        Constant* pos_var_int =
+          ConstantExpr::getBitCast(trace_pos_var, PointerType::getUnqual(int64_type));
+        new StoreInst(new_pos_int, pos_var_int, false, 8, Release, CrossThread, next_inst);
+      }
+      else {
+        store_inst = new StoreInst(new_pos, trace_pos_var, false, next_inst);
+        store_inst->setAlignment(8);
+      }
+    }
+    trace_sites.clear();
+  }
+
   // Do most of the instrumentation work: Walk each instruction in
   // each basic block and add instrumentation code around loads,
   // stores, flops, etc.
@@ -366,12 +751,35 @@ namespace bytesflops_pass {
     // Tally the number of basic blocks that the function contains.
     static_bblocks += function.size();
 
+    // Determine if we should record static per-block tallies and
+    // count control-flow edges instead of updating every counter in
+    // every basic block.
+    bool profile_edges = EdgeProfile && can_profile_edges(function);
+    vector<uint64_t> block_tallies;   // BF_EDGE_NUM_COLS static tallies per basic block
+
+    // Determine if we should keep the function's counters in local
+    // variables, which we promote to registers.
+    localize_counters = LocalCounters && !profile_edges;
+
+    // Find loops whose counters can be tallied once in the loop's
+    // preheader instead of on every iteration.
+    map<BasicBlock*, hoisted_loop_t> hoisted_loops;  // Map from a preheader to its loop's information
+    set<BasicBlock*> hoisted_bodies;     // Loop bodies we should not instrument
+    set<Instruction*> trip_count_code;   // Instructions that compute trip counts
+    if (may_hoist_loops() && !profile_edges)
+      find_hoistable_loops(module, function, function_name,
+                           hoisted_loops, hoisted_bodies, trip_count_code);
+
     // Iterate over each basic block in turn.
     for (Function::iterator func_iter = function.begin();
          func_iter != function.end();
          func_iter++) {
-      // Perform per-basic-block variable initialization.
+      // Skip loop bodies whose counters were hoisted into a preheader.
       BasicBlock& bb = *func_iter;
+      if (hoisted_bodies.count(&bb) > 0)
+        continue;
+
+      // Perform per-basic-block variable initialization.
       LLVMContext& bbctx = bb.getContext();
       DataLayoutPass& target_data = getAnalysis<DataLayoutPass>();
       BasicBlock::iterator terminator_inst = bb.end();
@@ -383,10 +791,6 @@ namespace bytesflops_pass {
       // real terminator, and instrumentation stops at the sentinel.
       Instruction* unreachable = new UnreachableInst(bbctx, terminator_inst);
 
-      // Acquire the mega-lock before inserting any instrumentation code.
-      if (ThreadSafety)
-        callinst_create(take_mega_lock, terminator_inst);
-
       // Iterate over the basic block's instructions one-by-one until
       // we reach the sentinal.
       for (BasicBlock::iterator iter = bb.begin();
@@ -397,47 +801,79 @@ namespace bytesflops_pass {
         if (iter->isIdenticalTo(unreachable))
           iter = terminator_inst;
 
-        // Ignore various function calls non grata.
+        // Ignore various function calls non grata and code we
+        // inserted to compute loop trip counts.
         Instruction& inst = *iter;
-        if (ignorable_call(&inst))
+        if (ignorable_call(&inst) || trip_count_code.count(&inst) > 0)
           continue;
 
-        // Snag the current opcode for further interrogation.
-        unsigned int opcode = iter->getOpcode();
-
-        // Maintain a histogram of instructions executed.
-        if (TallyInstMix) {
-          ConstantInt* opCodeIdx = ConstantInt::get(bbctx,  APInt(64, int64_t(opcode)));
-          increment_global_array(terminator_inst, inst_mix_histo_var, opCodeIdx, one);
+        // Flush function-local counters before each call.
+        if (localize_counters
+            && (isa<CallInst>(inst) || isa<InvokeInst>(inst))
+            && !isa<IntrinsicInst>(inst))
+          insert_local_flush(module, function_name, iter);
+
+        // When profiling edges by function, associate the counters
+        // that are still updated dynamically with the current
+        // function before each call.  Otherwise, the callee would
+        // claim them when it returns, and they would be lost if the
+        // callee never returned (e.g., because of longjmp() or an
+        // exception).
+        if (profile_edges && TallyByFunction
+            && isa<CallInst>(inst) && !isa<IntrinsicInst>(inst)) {
+          int call_clear = CLEAR_LOADS | CLEAR_STORES | CLEAR_FLOPS
+            | CLEAR_FP_BITS | CLEAR_OPS | CLEAR_OP_BITS;
+          insert_end_bb_code(module, function_name, call_clear, iter, false);
         }
 
         // Process the current instruction.
-        switch (opcode) {
-          case Instruction::Load:
-          case Instruction::Store:
-            instrument_load_store(module, function_name, iter, bbctx,
-                                  target_data.getDataLayout(), terminator_inst, must_clear);
-            break;
-
-          case Instruction::Call:
-            instrument_call(module, function_name, &inst, terminator_inst, must_clear);
-            break;
+        instrument_instruction(module, function_name, iter, bbctx,
+                               target_data.getDataLayout(), terminator_inst, must_clear);
+      }
 
-          default:
-            instrument_other(module, function_name, inst, bbctx, terminator_inst, must_clear);
-            break;
+      // If the basic block is the preheader of a hoisted loop, tally
+      // all of the loop's iterations at once.
+      map<BasicBlock*, hoisted_loop_t>::iterator hoist_iter = hoisted_loops.find(&bb);
+      if (hoist_iter != hoisted_loops.end())
+        insert_hoisted_increments(module, hoist_iter->second, terminator_inst, must_clear);
+
+      // Add one last bit of code then elide the sentinel terminator.
+      // When profiling edges, the basic block's constant increments
+      // become static tallies, and per-function counters are
+      // associated with the function only when it exits.
+      if (profile_edges) {
+        tally_terminator(module, terminator_inst);
+        record_block_tallies(module, terminator_inst, block_tallies);
+        if (TallyByFunction && bb.getTerminator()->getNumSuccessors() == 0) {
+          must_clear = CLEAR_LOADS | CLEAR_STORES | CLEAR_FLOPS
+            | CLEAR_FP_BITS | CLEAR_OPS | CLEAR_OP_BITS;
+          insert_end_bb_code(module, function_name, must_clear, terminator_inst, false);
         }
-        instrument_all(module, function_name, inst, bbctx, terminator_inst, must_clear);
       }
-
-      // Add one last bit of code then release the mega-lock and elide
-      // the sentinel terminator.
-      insert_end_bb_code(module, function_name, must_clear, terminator_inst);
-      if (ThreadSafety)
-        callinst_create(release_mega_lock, terminator_inst);
+      else if (localize_counters) {
+        tally_terminator(module, terminator_inst);
+        flush_pending_increments(module, terminator_inst);
+        if (bb.getTerminator()->getNumSuccessors() == 0)
+          insert_local_flush(module, function_name, terminator_inst);
+      }
+      else
+        insert_end_bb_code(module, function_name, must_clear, terminator_inst);
       unreachable->eraseFromParent();
     }  // Ends the loop over basic blocks within the function
 
+    // Count control-flow edges from which to reconstruct the
+    // function's counters.
+    if (profile_edges)
+      insert_edge_counters(module, function, function_name, block_tallies);
+
+    // Now that we're done walking the function's basic blocks, split
+    // them as needed to update unique bytes and the trace buffer
+    // inline.
+    if (!ubytes_slow_calls.empty())
+      inline_unique_bytes_fast_paths(module);
+    if (!trace_sites.empty())
+      insert_trace_appends(module);
+
     // Insert a call to bf_initialize_if_necessary() at the
     // beginning of the function.  Also insert a call to
     // bf_push_function() if -bf-call-stack was specified or to
@@ -450,10 +886,15 @@ namespace bytesflops_pass {
     callinst_create(init_if_necessary, new_entry);
     if (TallyByFunction) {
       Function* entry_func = TrackCallStack ? push_function : tally_function;
-      Constant* argument = map_func_name_to_arg(module, function_name);
+      Value* argument = map_func_name_to_id(module, function_name, new_entry);
       callinst_create(entry_func, argument, new_entry);
     }
     BranchInst::Create(&old_entry, new_entry);
+
+    // Allocate function-local counters in the new entry block and
+    // promote them to registers.
+    if (localize_counters)
+      expand_local_counters(module, new_entry);
   }
 
   // Add energy instrumentation calls to each function.
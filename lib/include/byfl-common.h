@@ -65,6 +65,64 @@ enum {
   BF_NUM_MEM_INTRIN
 };
 
+// Define the static tallies that -bf-edge-profile records for each
+// basic block.
+enum {
+  BF_EDGE_LOADS,         // Bytes loaded
+  BF_EDGE_STORES,        // Bytes stored
+  BF_EDGE_LOAD_INS,      // Load instructions executed
+  BF_EDGE_STORE_INS,     // Store instructions executed
+  BF_EDGE_FLOPS,         // Floating-point operations performed
+  BF_EDGE_FP_BITS,       // Bits consumed or produced by FP operations
+  BF_EDGE_OPS,           // Operations of any type performed
+  BF_EDGE_OP_BITS,       // Bits consumed or produced by non-memory operations
+  BF_EDGE_TERMINATORS,   // First of BF_END_BB_NUM terminator tallies
+  BF_EDGE_MEM_INTRIN = BF_EDGE_TERMINATORS + BF_END_BB_NUM,  // First of BF_NUM_MEM_INTRIN memory-intrinsic tallies
+  BF_EDGE_NUM_COLS = BF_EDGE_MEM_INTRIN + BF_NUM_MEM_INTRIN
+};
+
+// -bf-edge-profile describes each function to the run-time library
+// with an array of the form {number of basic blocks, number of edges,
+// BF_EDGE_NUM_COLS tallies per basic block, {source, target, counter
+// number} per edge}.  The basic block numbered <number of basic
+// blocks> represents function exit, and the edge from function exit
+// to the entry block represents function invocation.  Edges for
+// which no counter exists have counter number BF_EDGE_NO_COUNTER.
+#define BF_EDGE_NO_COUNTER (~(uint64_t)0)
+
+// -bf-unique-bytes marks the bytes the program accesses in a
+// two-level shadow directory: bf_ubytes_directory[] maps the upper
+// address bits to a leaf, and each leaf maps the middle address bits
+// to a bit vector with one bit per byte of a logical page.  Missing
+// leaves and bit vectors are NULL.  Addresses that don't fit in
+// BF_UBYTES_ADDR_BITS bits are tracked separately.
+#define BF_UBYTES_ADDR_BITS 48    // Number of address bits covered by the directory
+#define BF_UBYTES_PAGE_BITS 13    // log2 of the number of bytes per bit vector
+#define BF_UBYTES_LEAF_BITS 16    // log2 of the number of bit vectors per leaf
+#define BF_UBYTES_DIR_BITS (BF_UBYTES_ADDR_BITS - BF_UBYTES_LEAF_BITS - BF_UBYTES_PAGE_BITS)
+
+// -bf-trace-buffer has instrumented code append {address, flags |
+// number of bytes} records to a per-thread trace buffer.  The flags
+// indicate which analyses should process the record.
+#define BF_TRACE_UNIQUE_BYTES (1ULL<<63)   // Record unique bytes (or memory footprint)
+#define BF_TRACE_REUSE_DIST   (1ULL<<62)   // Record reuse distance
+#define BF_TRACE_STORE        (1ULL<<61)   // Record was produced by a store, not a load
+#define BF_TRACE_SIZE_MASK    ((1ULL<<61) - 1)
+
+// Define the algorithms -bf-reuse-engine can select for computing
+// reuse distance.
+typedef enum {
+  BF_REUSE_ENGINE_SPLAY,     // Splay tree of last-access times
+  BF_REUSE_ENGINE_FENWICK    // Fenwick tree of last-access times
+} bf_reuse_engine_t;
+
+// On ELF targets the pass places every function-name string it passes
+// to the run-time library in a section with this name.  The linker
+// defines __start_ and __stop_ symbols bracketing the section, which
+// lets the run-time library recognize those (constant) strings by
+// address alone.
+#define BF_FNAME_SECTION "bf_fnames"
+
 // Map a memory-access type to an index into bf_mem_insts_count[].
 static inline uint64_t
 mem_type_to_index(uint64_t memop,
@@ -0,0 +1,31 @@
+; Ensure that -bf-local-counters keeps counters in registers even when
+; no optimization passes run after Byfl, as is the case at -O0.
+;
+; RUN: opt -load %bytesflops -bytesflops -bf-local-counters -bf-hoist-loops=false %s -S | FileCheck %s
+
+declare void @ext()
+
+; CHECK-LABEL: define i64 @sum(
+; CHECK-NOT: alloca
+; CHECK-NOT: {{(load|store) .*i64\* %bf_local_count}}
+; CHECK: call void @ext()
+; CHECK-NOT: {{(load|store) .*i64\* %bf_local_count}}
+; CHECK: ret i64
+define i64 @sum(i64* %a, i64 %n) {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %loop ]
+  %s = phi i64 [ 0, %entry ], [ %s.next, %loop ]
+  %p = getelementptr inbounds i64* %a, i64 %i
+  %v = load i64* %p
+  %s.next = add i64 %s, %v
+  call void @ext()
+  %i.next = add i64 %i, 1
+  %done = icmp eq i64 %i.next, %n
+  br i1 %done, label %exit, label %loop
+
+exit:
+  ret i64 %s.next
+}
@@ -0,0 +1,13 @@
+; Ensure that instrumented code accesses the per-thread counters using
+; the initial-exec TLS model unless -bf-tls-model says otherwise.
+;
+; RUN: opt -load %bytesflops -bytesflops %s -S | FileCheck %s
+; RUN: opt -load %bytesflops -bytesflops -bf-tls-model=general-dynamic %s -S | FileCheck --check-prefix=GD %s
+
+; CHECK: @bf_load_count = external thread_local(initialexec) global i64
+; GD: @bf_load_count = external thread_local global i64
+define i64 @get(i64* %p) {
+entry:
+  %v = load i64* %p
+  ret i64 %v
+}
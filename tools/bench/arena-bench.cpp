@@ -0,0 +1,125 @@
+/*
+ * Helper library for computing bytes:flops ratios
+ * (benchmark of SlabArena against new and delete)
+ *
+ * By Scott Pakin <pakin@lanl.gov>
+ */
+
+#include "arena.h"
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <stdint.h>
+#include <stdlib.h>
+
+using namespace std;
+
+// Define objects the size of a splay-tree node and of a unique-bytes
+// bit vector.
+typedef struct {
+  void* left;
+  void* right;
+  uint64_t address;
+  uint64_t time;
+  uint64_t weight;
+} node_sized_t;
+typedef struct {
+  uint64_t words[64];
+} page_sized_t;
+
+// Allocate and free objects with new and delete.
+template<class T>
+class HeapAllocator {
+public:
+  T* create() { return new T(); }
+  void destroy(T* object) { delete object; }
+  void clear() {}
+};
+
+// Allocate and free objects with a SlabArena.
+template<class T>
+class ArenaAllocator {
+private:
+  SlabArena<T> arena;
+
+public:
+  T* create() { return arena.create(); }
+  void destroy(T* object) { arena.destroy(object); }
+  void clear() { arena.clear(); }
+};
+
+// Allocate a given number of live objects, replace randomly chosen
+// live objects a given number of times (as when splay-tree nodes are
+// pruned and page bit vectors fill), then free everything.  Return
+// the elapsed time in seconds.
+template<class T, class Allocator>
+static double churn (size_t num_live, size_t num_replacements, uint64_t* checksum)
+{
+  mt19937_64 rng(12345);
+  vector<T*> live(num_live);
+  Allocator allocator;
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  for (size_t i = 0; i < num_live; i++)
+    live[i] = allocator.create();
+  for (size_t i = 0; i < num_replacements; i++) {
+    size_t victim = rng()%num_live;
+    allocator.destroy(live[victim]);
+    live[victim] = allocator.create();
+    *checksum += uintptr_t(live[victim]) & 0xff;
+  }
+  for (size_t i = 0; i < num_live; i++)
+    allocator.destroy(live[i]);
+  allocator.clear();
+  chrono::steady_clock::time_point stop = chrono::steady_clock::now();
+  return chrono::duration<double>(stop - start).count();
+}
+
+// Compare both allocators for a given object type.
+template<class T>
+static void run_benchmark (const char* label, size_t num_live, size_t num_replacements)
+{
+  uint64_t checksum = 0;
+  double heap_time = churn<T, HeapAllocator<T> >(num_live, num_replacements, &checksum);
+  double arena_time = churn<T, ArenaAllocator<T> >(num_live, num_replacements, &checksum);
+  cout << setw(8) << label << ' '
+       << setw(6) << sizeof(T) << ' '
+       << setw(10) << num_live << ' '
+       << setw(12) << num_replacements << ' '
+       << fixed << setprecision(3)
+       << setw(12) << heap_time << ' '
+       << setw(12) << arena_time << ' '
+       << setw(10) << setprecision(2) << heap_time/arena_time << "   "
+       << "(checksum " << checksum << ")\n";
+}
+
+int main (int argc, char* argv[])
+{
+  // Parse the command line.
+  size_t num_live = 1000000;
+  size_t num_replacements = 10000000;
+  if (argc > 3) {
+    cerr << "Usage: " << argv[0] << " [<live objects> [<replacements>]]\n";
+    exit(1);
+  }
+  if (argc > 1)
+    num_live = size_t(strtoull(argv[1], NULL, 10));
+  if (argc > 2)
+    num_replacements = size_t(strtoull(argv[2], NULL, 10));
+  if (num_live == 0) {
+    cerr << argv[0] << ": The number of live objects must be positive\n";
+    exit(1);
+  }
+
+  // Run the benchmark for each object size.
+  cout << setw(8) << "Object" << ' '
+       << setw(6) << "Bytes" << ' '
+       << setw(10) << "Live" << ' '
+       << setw(12) << "Replaced" << ' '
+       << setw(12) << "Heap_secs" << ' '
+       << setw(12) << "Arena_secs" << ' '
+       << setw(10) << "Speedup" << '\n';
+  run_benchmark<node_sized_t>("node", num_live, num_replacements);
+  run_benchmark<page_sized_t>("page", num_live/8, num_replacements/8);
+  return 0;
+}
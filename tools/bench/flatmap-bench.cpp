@@ -0,0 +1,108 @@
+/*
+ * Helper library for computing bytes:flops ratios
+ * (benchmark of FlatHashMap against std::unordered_map)
+ *
+ * By Scott Pakin <pakin@lanl.gov>
+ */
+
+#include "flatmap.h"
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+// Perform at least this many lookups per measurement.
+static const size_t min_lookups = 20000000;
+
+// Look up every probe in a map, repeating until at least min_lookups
+// lookups have been performed, and return the lookup rate in
+// lookups/second.  Tally the number of successful lookups so the
+// compiler can't discard them.
+template<class Map>
+static double lookup_rate (Map& table, const vector<uint64_t>& probes, uint64_t* found)
+{
+  size_t rounds = (min_lookups + probes.size() - 1)/probes.size();
+  uint64_t hits = 0;
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  for (size_t r = 0; r < rounds; r++)
+    for (vector<uint64_t>::const_iterator probe_iter = probes.begin();
+         probe_iter != probes.end();
+         probe_iter++)
+      if (table.find(*probe_iter) != table.end())
+        hits++;
+  chrono::steady_clock::time_point stop = chrono::steady_clock::now();
+  *found += hits;
+  return double(rounds*probes.size())/chrono::duration<double>(stop - start).count();
+}
+
+// Measure both maps with a given number of keys.  Keys are the page
+// numbers of a contiguous range of memory, as in the Byfl page
+// tables, inserted in shuffled order.  Half of the probes hit and
+// half miss, also in shuffled order.
+static void run_benchmark (size_t num_keys, mt19937_64& rng)
+{
+  const uint64_t base_page = 0x7f0000000000ULL >> 12;
+  vector<uint64_t> pages;
+  for (uint64_t i = 0; i < 2*num_keys; i++)
+    pages.push_back(base_page + i);
+  shuffle(pages.begin(), pages.end(), rng);
+  vector<uint64_t> probes(pages);
+  shuffle(probes.begin(), probes.end(), rng);
+
+  // Populate both maps with the same keys.
+  FlatHashMap<uint64_t, uint64_t> flat_map;
+  unordered_map<uint64_t, uint64_t> std_map;
+  for (size_t i = 0; i < num_keys; i++) {
+    flat_map[pages[i]] = i;
+    std_map[pages[i]] = i;
+  }
+
+  // Time lookups in each map.
+  uint64_t found = 0;
+  double std_rate = lookup_rate(std_map, probes, &found);
+  double flat_rate = lookup_rate(flat_map, probes, &found);
+  cout << setw(10) << num_keys << ' '
+       << fixed << setprecision(1)
+       << setw(20) << std_rate/1e6 << ' '
+       << setw(20) << flat_rate/1e6 << ' '
+       << setw(10) << setprecision(2) << flat_rate/std_rate << "   "
+       << "(" << found << " hits)\n";
+}
+
+int main (int argc, char* argv[])
+{
+  // Parse the command line.
+  vector<size_t> sizes;
+  for (int i = 1; i < argc; i++) {
+    char* endptr;
+    sizes.push_back(size_t(strtoull(argv[i], &endptr, 10)));
+    if (*endptr != '\0' || sizes.back() == 0) {
+      cerr << "Usage: " << argv[0] << " [<number of keys>...]\n";
+      exit(1);
+    }
+  }
+  if (sizes.empty()) {
+    sizes.push_back(1000);
+    sizes.push_back(100000);
+    sizes.push_back(4000000);
+  }
+
+  // Run the benchmark for each size.
+  mt19937_64 rng(12345);
+  cout << setw(10) << "Keys" << ' '
+       << setw(20) << "unordered_map_Mlps" << ' '
+       << setw(20) << "FlatHashMap_Mlps" << ' '
+       << setw(10) << "Speedup" << '\n';
+  for (vector<size_t>::iterator size_iter = sizes.begin();
+       size_iter != sizes.end();
+       size_iter++)
+    run_benchmark(*size_iter, rng);
+  return 0;
+}
@@ -0,0 +1,103 @@
+/*
+ * Helper library for computing bytes:flops ratios
+ * (benchmark of the reuse-distance engines)
+ *
+ * By Scott Pakin <pakin@lanl.gov>
+ */
+
+#include "byfl.h"
+#include <chrono>
+
+using namespace std;
+
+// Define the library variables that reuse-dist.cpp expects the
+// instrumented code or the rest of the library to provide.
+uint8_t bf_call_stack = 0;
+const char* bf_mrc_sizes = "8192,32768,262144,1048576,8388608,33554432";
+uint64_t bf_max_reuse_distance = ~(uint64_t)0;
+uint64_t bf_reuse_dist_gran = 1;
+uint8_t bf_reuse_dist_split = 0;
+uint8_t bf_reuse_dist_by_func = 0;
+uint64_t bf_reuse_engine = BF_REUSE_ENGINE_SPLAY;
+uint64_t bf_reuse_sample = 1;
+uint64_t bf_reuse_sample_max = 0;
+uint8_t bf_thread_safe = 0;
+
+namespace bytesflops {
+  ostream* bfout = &cout;
+  string bf_output_prefix;
+  __thread const char* bf_func_and_parents = "-";
+  void bf_acquire_mega_lock (void) {}
+  void bf_release_mega_lock (void) {}
+  const char* bf_string_to_symbol (const char* str) { return str; }
+  const char* bf_call_context_name (void) { return "-"; }
+  const char* bf_func_id_to_name (uint32_t /*funcid*/) { return "-"; }
+
+  // Instrumented code calls this but byfl.h doesn't declare it.
+  extern void bf_reuse_dist_addrs_prog(uint64_t baseaddr, uint64_t numaddrs, bool is_store);
+}
+
+using namespace bytesflops;
+
+// Parse a nonnegative integer argument or abort.
+static uint64_t parse_number (const char* progname, const char* arg)
+{
+  char* endptr;
+  uint64_t value = strtoull(arg, &endptr, 10);
+  if (*arg == '\0' || *endptr != '\0') {
+    cerr << progname << ": \"" << arg << "\" is not a number\n";
+    exit(1);
+  }
+  return value;
+}
+
+int main (int argc, char* argv[])
+{
+  // Parse the command line.
+  if (argc < 2 || argc > 4) {
+    cerr << "Usage: " << argv[0] << " splay|fenwick [<accesses> [<max reuse distance>]]\n";
+    exit(1);
+  }
+  string engine(argv[1]);
+  if (engine == "splay")
+    bf_reuse_engine = BF_REUSE_ENGINE_SPLAY;
+  else if (engine == "fenwick")
+    bf_reuse_engine = BF_REUSE_ENGINE_FENWICK;
+  else {
+    cerr << argv[0] << ": Unknown engine \"" << engine << "\"\n";
+    exit(1);
+  }
+  uint64_t num_accesses = argc > 2 ? parse_number(argv[0], argv[2]) : 4000000;
+  if (argc > 3)
+    bf_max_reuse_distance = parse_number(argv[0], argv[3]);
+
+  // Process a deterministic trace of 8-byte accesses.  Alternate
+  // accesses go to a small hot set and a large cold set so that the
+  // histogram has both short and long distances.
+  initialize_reuse();
+  uint64_t state = 12345;
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  for (uint64_t i = 0; i < num_accesses; i++) {
+    state = state*6364136223846793005ULL + 1442695040888963407ULL;
+    uint64_t word = (state >> 33) % ((i&1) ? 500 : 200000);
+    bf_reuse_dist_addrs_prog(word*8, 8, false);
+  }
+  chrono::steady_clock::time_point stop = chrono::steady_clock::now();
+
+  // Output summary statistics, which should be identical across
+  // engines, and the time taken.
+  uint64_t unique_addrs;
+  uint64_t median_value;
+  uint64_t mad_value;
+  bf_get_reuse_distance(&unique_addrs);
+  bf_get_median_reuse_distance(BF_RD_ALL, &median_value, &mad_value);
+  cout << "BYFL_BENCH: " << setw(25) << num_accesses << " accesses\n"
+       << "BYFL_BENCH: " << setw(25) << unique_addrs << " unique addresses\n"
+       << "BYFL_BENCH: " << setw(25) << median_value << " median reuse distance (+/- "
+       << mad_value << ")\n";
+  bf_report_miss_ratio_curve();
+  cout << "BYFL_BENCH: " << setw(25) << fixed << setprecision(3)
+       << chrono::duration<double>(stop - start).count()
+       << " seconds using the " << engine << " engine\n";
+  return 0;
+}